@@ -0,0 +1,730 @@
+#include "platform.h"
+#include "../fiber/fiber.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#if USING(OS_WINDOWS)
+# define WIN32_LEAN_AND_MEAN
+# define NOMINMAX
+# include <Windows.h>
+# include <intrin.h>
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+# include <sys/mman.h>
+# include <malloc.h>
+# include <ucontext.h>
+# include <x86intrin.h>
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+
+/* Context switch microbenchmarks. Every fiber::Options combination is run
+ * through the same set of patterns and the results are written as json, one
+ * object per measurement, so changes to the bytecode can be gated on them.
+ *   usage: Fiber_Bench [output.json]
+ * Each measurement is the best of BENCH_REPEATS runs.
+ */
+
+namespace
+{
+	static constexpr unsigned BENCH_REPEATS = 5;
+	static constexpr size_t PAGE_SIZE = 4096;
+	static constexpr size_t BENCH_STACK_SIZE = PAGE_SIZE * 4;
+
+	static constexpr unsigned PING_PONG_ROUNDS = 1000000;
+	static constexpr unsigned RING_FIBER_COUNT = 16;
+	static constexpr unsigned RING_ROUNDS = PING_PONG_ROUNDS / RING_FIBER_COUNT;
+	static constexpr unsigned COLD_FIBER_COUNT = 8192; // 8192 * 16kb stacks is well past the LLC
+	static constexpr unsigned COLD_ROUNDS = 16;
+	static constexpr unsigned CREATE_START_COUNT = 4096;
+	static constexpr unsigned CALL_COUNT = 10000000;
+
+	struct OptionsDesc
+	{
+		fiber::Options opts;
+		const char* name;
+	};
+
+	static constexpr OptionsDesc ALL_OPTIONS[] = {
+		{ fiber::Options::NONE, "NONE" },
+		{ fiber::Options::OS_API_SAFETY, "OS_API_SAFETY" },
+		{ fiber::Options::PRESERVE_FPU_CONTROL, "PRESERVE_FPU_CONTROL" },
+		{ fiber::Options::OS_API_SAFETY | fiber::Options::PRESERVE_FPU_CONTROL, "OS_API_SAFETY|PRESERVE_FPU_CONTROL" },
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+		{ fiber::Options::MINIMAL_SAVE, "MINIMAL_SAVE" },
+		{ fiber::Options::MINIMAL_SAVE | fiber::Options::OS_API_SAFETY, "MINIMAL_SAVE|OS_API_SAFETY" },
+		{ fiber::Options::MINIMAL_SAVE | fiber::Options::PRESERVE_FPU_CONTROL, "MINIMAL_SAVE|PRESERVE_FPU_CONTROL" },
+		{ fiber::Options::MINIMAL_SAVE | fiber::Options::OS_API_SAFETY | fiber::Options::PRESERVE_FPU_CONTROL, "MINIMAL_SAVE|OS_API_SAFETY|PRESERVE_FPU_CONTROL" },
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+	};
+
+	struct Measurement
+	{
+		double ns;
+		uint64_t cycles;
+	};
+
+	struct Timer
+	{
+		std::chrono::steady_clock::time_point startTime;
+		uint64_t startCycles;
+	};
+
+	namespace timer
+	{
+		static Timer Start()
+		{
+			Timer t;
+			t.startTime = std::chrono::steady_clock::now();
+			t.startCycles = __rdtsc();
+			return t;
+		}
+
+		static Measurement Stop(const Timer& t)
+		{
+			const uint64_t endCycles = __rdtsc();
+			const std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+			Measurement m;
+			m.ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - t.startTime).count());
+			m.cycles = endCycles - t.startCycles;
+			return m;
+		}
+
+		static Measurement Best(Measurement a, Measurement b)
+		{
+			return a.ns <= b.ns ? a : b;
+		}
+	}
+
+	namespace stacks
+	{
+		// One reservation for all the stacks, with a no access page under each for overflow protection
+		struct Pool
+		{
+			uint8_t* mem;
+			size_t memSize;
+			unsigned count;
+		};
+
+		static constexpr size_t STRIDE = BENCH_STACK_SIZE + PAGE_SIZE;
+
+		static Pool Create(unsigned count)
+		{
+			Pool pool;
+			pool.count = count;
+			pool.memSize = STRIDE * count;
+
+#if USING(OS_WINDOWS)
+			pool.mem = reinterpret_cast<uint8_t*>(VirtualAlloc(nullptr, pool.memSize, MEM_RESERVE, PAGE_NOACCESS));
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			pool.mem = reinterpret_cast<uint8_t*>(mmap(nullptr, pool.memSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+
+			for (unsigned stackIndex = 0; stackIndex < count; ++stackIndex)
+			{
+				uint8_t* const stack = pool.mem + STRIDE * stackIndex + PAGE_SIZE;
+
+#if USING(OS_WINDOWS)
+				VirtualAlloc(stack, BENCH_STACK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				mprotect(stack, BENCH_STACK_SIZE, PROT_READ | PROT_WRITE);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				memset(stack + BENCH_STACK_SIZE - PAGE_SIZE, 0, PAGE_SIZE); // Fault the top page in now rather than in the timed region
+			}
+
+			return pool;
+		}
+
+		static void* Get(const Pool& pool, unsigned stackIndex)
+		{
+			return pool.mem + STRIDE * stackIndex + PAGE_SIZE;
+		}
+
+		static void Destroy(Pool* pool)
+		{
+#if USING(OS_WINDOWS)
+			VirtualFree(pool->mem, 0, MEM_RELEASE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			munmap(pool->mem, pool->memSize);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			pool->mem = nullptr;
+		}
+	}
+
+	namespace report
+	{
+		static FILE* s_out;
+		static bool s_first = true;
+
+		static void Begin(FILE* out)
+		{
+			s_out = out;
+			fprintf(s_out, "{\n\t\"repeats\": %u,\n\t\"results\": [", BENCH_REPEATS);
+		}
+
+		static void Add(const char* bench, const char* options, const char* pattern, unsigned fibers, uint64_t ops, const Measurement& m)
+		{
+			fprintf(s_out, "%s\n\t\t{ \"bench\": \"%s\", \"options\": \"%s\", \"pattern\": \"%s\", \"fibers\": %u, \"ops\": %llu, \"ns_per_op\": %.3f, \"cycles_per_op\": %.3f }",
+				s_first ? "" : ",", bench, options, pattern, fibers, static_cast<unsigned long long>(ops), m.ns / ops, static_cast<double>(m.cycles) / ops);
+			s_first = false;
+
+			fprintf(stderr, "%-14s %-36s %-10s %6u fibers: %8.2f ns/op %8.2f cycles/op\n", bench, options, pattern, fibers, m.ns / ops, static_cast<double>(m.cycles) / ops);
+		}
+
+		// Estimated memory held per parked fiber, for the shared stack crossover
+		static void AddBytes(const char* bench, const char* options, const char* pattern, unsigned fibers, size_t bytesPerFiber)
+		{
+			fprintf(s_out, "%s\n\t\t{ \"bench\": \"%s\", \"options\": \"%s\", \"pattern\": \"%s\", \"fibers\": %u, \"bytes_per_fiber\": %zu }",
+				s_first ? "" : ",", bench, options, pattern, fibers, bytesPerFiber);
+			s_first = false;
+
+			fprintf(stderr, "%-14s %-36s %-10s %6u fibers: %8zu bytes/fiber\n", bench, options, pattern, fibers, bytesPerFiber);
+		}
+
+		static void End()
+		{
+			fprintf(s_out, "\n\t]\n}\n");
+		}
+	}
+
+	namespace switch_bench
+	{
+		struct Ring
+		{
+			fiber::FiberAPI api;
+			fiber::Fiber** fibers;
+			unsigned count;
+			unsigned rounds;
+		};
+
+		struct RingFiber
+		{
+			const Ring* ring;
+			unsigned index;
+		};
+
+		static void RingFunc(void* userData)
+		{
+			const RingFiber* const self = reinterpret_cast<RingFiber*>(userData);
+			const Ring* const ring = self->ring;
+			fiber::Fiber* const cur = ring->fibers[self->index];
+			fiber::Fiber* const next = ring->fibers[(self->index + 1) % ring->count];
+			const auto Switch = ring->api.Switch;
+
+			for (unsigned round = 0; round < ring->rounds; ++round)
+			{
+				Switch(cur, next);
+			}
+		}
+
+		template<fiber::Options Opts>
+		static void StaticRingFunc(void* userData)
+		{
+			const RingFiber* const self = reinterpret_cast<RingFiber*>(userData);
+			const Ring* const ring = self->ring;
+			fiber::Fiber* const cur = ring->fibers[self->index];
+			fiber::Fiber* const next = ring->fibers[(self->index + 1) % ring->count];
+
+			for (unsigned round = 0; round < ring->rounds; ++round)
+			{
+				fiber::Api<Opts>::Switch(cur, next);
+			}
+		}
+
+		template<fiber::Options Opts>
+		static void StaticValueRingFunc(void* userData)
+		{
+			const RingFiber* const self = reinterpret_cast<RingFiber*>(userData);
+			const Ring* const ring = self->ring;
+			fiber::Fiber* const cur = ring->fibers[self->index];
+			fiber::Fiber* const next = ring->fibers[(self->index + 1) % ring->count];
+			void* payload = nullptr;
+
+			for (unsigned round = 0; round < ring->rounds; ++round)
+			{
+				payload = fiber::Api<Opts>::SwitchWithValue(cur, next, reinterpret_cast<uint8_t*>(payload) + 1);
+			}
+		}
+
+		// Bumps a counter kept in a fiber local slot between switches
+		template<fiber::Options Opts>
+		static void StaticLocalsRingFunc(void* userData)
+		{
+			const RingFiber* const self = reinterpret_cast<RingFiber*>(userData);
+			const Ring* const ring = self->ring;
+			fiber::Fiber* const cur = ring->fibers[self->index];
+			fiber::Fiber* const next = ring->fibers[(self->index + 1) % ring->count];
+
+			for (unsigned round = 0; round < ring->rounds; ++round)
+			{
+				fiber::SetFiberLocal(0, reinterpret_cast<uint8_t*>(fiber::GetFiberLocal(0)) + 1);
+				fiber::Api<Opts>::Switch(cur, next);
+			}
+		}
+
+		// Every fiber switches to the next one in the ring, rounds times. Fiber 0 finishing ends the run.
+		static Measurement Run(const fiber::FiberAPI& api, fiber::FiberFunc ringFunc, const stacks::Pool& pool, unsigned fiberCount, unsigned rounds)
+		{
+			fiber::Fiber** const fibers = new fiber::Fiber*[fiberCount];
+			RingFiber* const ringFibers = new RingFiber[fiberCount];
+			const Ring ring{ api, fibers, fiberCount, rounds };
+
+			for (unsigned fiberIndex = 0; fiberIndex < fiberCount; ++fiberIndex)
+			{
+				ringFibers[fiberIndex] = RingFiber{ &ring, fiberIndex };
+				fibers[fiberIndex] = api.Create(stacks::Get(pool, fiberIndex), BENCH_STACK_SIZE, 0, ringFunc, ringFibers + fiberIndex);
+			}
+
+			const Timer t = timer::Start();
+			api.Start(fibers[0]);
+			const Measurement m = timer::Stop(t);
+
+			delete[] ringFibers;
+			delete[] fibers;
+
+			return m;
+		}
+
+		static void Bench(const char* bench, const OptionsDesc& opts, fiber::FiberFunc ringFunc, const char* pattern, const stacks::Pool& pool, unsigned fiberCount, unsigned rounds)
+		{
+			const fiber::FiberAPI api = fiber::GetAPI(opts.opts);
+			Measurement best = Run(api, ringFunc, pool, fiberCount, rounds); // Warm up
+
+			for (unsigned repeat = 0; repeat < BENCH_REPEATS; ++repeat)
+			{
+				best = timer::Best(best, Run(api, ringFunc, pool, fiberCount, rounds));
+			}
+
+			report::Add(bench, opts.name, pattern, fiberCount, static_cast<uint64_t>(fiberCount) * rounds, best);
+		}
+
+		// FiberAPI::Switch through the function table, then fiber::Api<Opts>::Switch and SwitchWithValue inlined.
+		// switch_locals is switch_static plus a fiber local read and write per switch.
+		template<fiber::Options Opts>
+		static void BenchAll(const OptionsDesc& opts, const char* pattern, const stacks::Pool& pool, unsigned fiberCount, unsigned rounds)
+		{
+			Bench("switch", opts, RingFunc, pattern, pool, fiberCount, rounds);
+			Bench("switch_static", opts, StaticRingFunc<Opts>, pattern, pool, fiberCount, rounds);
+			Bench("switch_value", opts, StaticValueRingFunc<Opts>, pattern, pool, fiberCount, rounds);
+			Bench("switch_locals", opts, StaticLocalsRingFunc<Opts>, pattern, pool, fiberCount, rounds);
+		}
+	}
+
+	namespace create_bench
+	{
+		static void EmptyFunc(void*) {}
+
+		static void Bench(const OptionsDesc& opts, const stacks::Pool& pool)
+		{
+			const fiber::FiberAPI api = fiber::GetAPI(opts.opts);
+			fiber::Fiber** const fibers = new fiber::Fiber*[CREATE_START_COUNT];
+			void** const userData = new void*[CREATE_START_COUNT]();
+			Measurement bestCreate{ 1e300, 0 };
+			Measurement bestCreateMany{ 1e300, 0 };
+			Measurement bestStart{ 1e300, 0 };
+
+			for (unsigned repeat = 0; repeat < BENCH_REPEATS; ++repeat)
+			{
+				{
+					const Timer t = timer::Start();
+					for (unsigned fiberIndex = 0; fiberIndex < CREATE_START_COUNT; ++fiberIndex)
+					{
+						fibers[fiberIndex] = api.Create(stacks::Get(pool, fiberIndex), BENCH_STACK_SIZE, 0, EmptyFunc, nullptr);
+					}
+					bestCreate = timer::Best(bestCreate, timer::Stop(t));
+				}
+
+				{
+					const Timer t = timer::Start();
+					api.CreateMany(stacks::Get(pool, 0), stacks::STRIDE, CREATE_START_COUNT, BENCH_STACK_SIZE, 0, EmptyFunc, userData, fibers);
+					bestCreateMany = timer::Best(bestCreateMany, timer::Stop(t));
+				}
+
+				{
+					// Start runs the fiber to completion, so this is start + finish of an empty fiber
+					const Timer t = timer::Start();
+					for (unsigned fiberIndex = 0; fiberIndex < CREATE_START_COUNT; ++fiberIndex)
+					{
+						api.Start(fibers[fiberIndex]);
+					}
+					bestStart = timer::Best(bestStart, timer::Stop(t));
+				}
+			}
+
+			report::Add("create", opts.name, "cold", CREATE_START_COUNT, CREATE_START_COUNT, bestCreate);
+			report::Add("create_many", opts.name, "cold", CREATE_START_COUNT, CREATE_START_COUNT, bestCreateMany);
+			report::Add("start", opts.name, "cold", CREATE_START_COUNT, CREATE_START_COUNT, bestStart);
+
+			delete[] userData;
+			delete[] fibers;
+		}
+	}
+
+	namespace shared_stack_bench
+	{
+		// Live stack depths, the shared stack copies this much (plus frames) out and back in per switch
+		static constexpr size_t LIVE_SIZES[] = { 0, 256, 1024, 4096 };
+		static constexpr unsigned SHARED_ROUNDS = RING_ROUNDS / 16;
+
+		struct Ring
+		{
+			fiber::Fiber** fibers;
+			unsigned count;
+			const stacks::Pool* pool;
+			size_t heapBytesBefore;
+			size_t* sampledBytes; // Only on the untimed run that measures memory, see Sample
+		};
+
+		struct RingFiber
+		{
+			const Ring* ring;
+			unsigned index;
+		};
+
+#if USING(OS_LINUX)
+		static size_t ResidentBytes(const void* mem, size_t size)
+		{
+			unsigned char pageResident[BENCH_STACK_SIZE / PAGE_SIZE];
+			size_t residentBytes = 0;
+
+			static_assert(BENCH_STACK_SIZE % PAGE_SIZE == 0);
+
+			if (size <= BENCH_STACK_SIZE && mincore(const_cast<void*>(mem), size, pageResident) == 0)
+			{
+				for (size_t pageIndex = 0; pageIndex < size / PAGE_SIZE; ++pageIndex)
+				{
+					residentBytes += (pageResident[pageIndex] & 1) ? PAGE_SIZE : 0;
+				}
+			}
+
+			return residentBytes;
+		}
+
+		static size_t HeapBytes()
+		{
+			return mallinfo2().uordblks;
+		}
+
+		// Memory the whole ring holds, with every fiber but the sampling one switched out. Resident stack pages,
+		// plus the heap shared fibers copy their stacks out to.
+		template<bool Shared>
+		static size_t Sample(const Ring& ring)
+		{
+			size_t bytes = 0;
+
+			for (unsigned fiberIndex = 0; fiberIndex < (Shared ? 1 : ring.count); ++fiberIndex)
+			{
+				bytes += ResidentBytes(stacks::Get(*ring.pool, fiberIndex), BENCH_STACK_SIZE);
+			}
+
+			return Shared ? bytes + (HeapBytes() - ring.heapBytesBefore) : bytes;
+		}
+#else //#if USING(OS_LINUX)
+		template<bool Shared>
+		static size_t Sample(const Ring&)
+		{
+			return 0; // Only measured on linux
+		}
+#endif //#else //#if USING(OS_LINUX)
+
+		template<fiber::Options Opts, size_t LiveSize>
+		static void LiveRingFunc(void* userData)
+		{
+			const RingFiber* const self = reinterpret_cast<RingFiber*>(userData);
+			const Ring* const ring = self->ring;
+			fiber::Fiber* const cur = ring->fibers[self->index];
+			fiber::Fiber* const next = ring->fibers[(self->index + 1) % ring->count];
+			volatile uint8_t live[LiveSize + 1]; // Only the depth matters, the whole frame gets copied
+
+			live[0] = static_cast<uint8_t>(self->index);
+			live[LiveSize] = static_cast<uint8_t>(self->index);
+
+			for (unsigned round = 0; round < SHARED_ROUNDS; ++round)
+			{
+				if (ring->sampledBytes && self->index == 0 && round == SHARED_ROUNDS / 2)
+				{
+					*ring->sampledBytes = Sample<!!(Opts & fiber::Options::SHARED_STACK)>(*ring);
+				}
+
+				fiber::Api<Opts>::Switch(cur, next);
+			}
+
+			static_cast<void>(live[0]);
+		}
+
+		// Every fiber on the one shared stack, or each on its own. Returns the peak stack use of fiber 0. With
+		// sampledBytes, also what the ring held in memory halfway through.
+		template<fiber::Options Opts, size_t LiveSize>
+		static Measurement Run(const stacks::Pool& pool, size_t* peakBytes, size_t* sampledBytes = nullptr)
+		{
+			static constexpr bool SHARED = !!(Opts & fiber::Options::SHARED_STACK);
+
+			fiber::Fiber* fibers[RING_FIBER_COUNT];
+			RingFiber ringFibers[RING_FIBER_COUNT];
+			Ring ring{ fibers, RING_FIBER_COUNT, &pool, 0, sampledBytes };
+
+#if USING(OS_LINUX)
+			if (sampledBytes)
+			{
+				// Drop whatever earlier runs touched, so only this run's pages count
+				for (unsigned fiberIndex = 0; fiberIndex < RING_FIBER_COUNT; ++fiberIndex)
+				{
+					madvise(stacks::Get(pool, fiberIndex), BENCH_STACK_SIZE, MADV_DONTNEED);
+				}
+
+				ring.heapBytesBefore = HeapBytes();
+			}
+#endif //#if USING(OS_LINUX)
+
+			if (SHARED)
+			{
+				memset(stacks::Get(pool, 0), 0, BENCH_STACK_SIZE); // Previously held unshared fibers
+			}
+
+			for (unsigned fiberIndex = 0; fiberIndex < RING_FIBER_COUNT; ++fiberIndex)
+			{
+				ringFibers[fiberIndex] = RingFiber{ &ring, fiberIndex };
+				fibers[fiberIndex] = fiber::Api<Opts>::Create(stacks::Get(pool, SHARED ? 0 : fiberIndex), BENCH_STACK_SIZE, 0, LiveRingFunc<Opts, LiveSize>, ringFibers + fiberIndex);
+			}
+
+			if (!SHARED)
+			{
+				fiber::PaintStack(fibers[0], BENCH_STACK_SIZE - PAGE_SIZE);
+			}
+
+			const Timer t = timer::Start();
+			fiber::Api<Opts>::Start(fibers[0]);
+			const Measurement m = timer::Stop(t);
+
+			for (unsigned fiberIndex = 0; fiberIndex < RING_FIBER_COUNT; ++fiberIndex)
+			{
+				if (SHARED)
+				{
+					fiber::DestroySharedStackFiber(fibers[fiberIndex]);
+				}
+			}
+
+			if (!SHARED)
+			{
+				*peakBytes = fiber::GetStackHighWaterMark(fibers[0], BENCH_STACK_SIZE - PAGE_SIZE);
+			}
+
+			return m;
+		}
+
+		template<fiber::Options Opts, size_t LiveSize>
+		static Measurement Best(const stacks::Pool& pool, size_t* peakBytes)
+		{
+			Measurement best = Run<Opts, LiveSize>(pool, peakBytes); // Warm up
+
+			for (unsigned repeat = 0; repeat < BENCH_REPEATS; ++repeat)
+			{
+				best = timer::Best(best, Run<Opts, LiveSize>(pool, peakBytes));
+			}
+
+			return best;
+		}
+
+		/* Switch cost against memory per parked fiber as the live stack grows. Separate stacks pay
+		*  for whole pages of peak depth per fiber, shared stacks pay for live bytes plus their share
+		*  of the one stack, but copy those bytes on every switch. On linux the bytes are measured,
+		*  resident stack pages plus heap, from an extra untimed run. Elsewhere they're estimated
+		*  from fiber 0's high water mark.
+		*/
+		template<size_t LiveSize>
+		static void BenchLive(const stacks::Pool& pool)
+		{
+			char pattern[32];
+			size_t peakBytes = 0;
+
+			snprintf(pattern, sizeof(pattern), "live_%zu", LiveSize);
+
+			const Measurement separate = Best<fiber::Options::NONE, LiveSize>(pool, &peakBytes);
+			const Measurement shared = Best<fiber::Options::SHARED_STACK, LiveSize>(pool, &peakBytes);
+			const uint64_t ops = static_cast<uint64_t>(RING_FIBER_COUNT) * SHARED_ROUNDS;
+#if USING(OS_LINUX)
+			size_t separateBytes = 0;
+			size_t sharedBytes = 0;
+
+			Run<fiber::Options::NONE, LiveSize>(pool, &peakBytes, &separateBytes);
+			Run<fiber::Options::SHARED_STACK, LiveSize>(pool, &peakBytes, &sharedBytes);
+
+			separateBytes /= RING_FIBER_COUNT;
+			sharedBytes /= RING_FIBER_COUNT;
+#else //#if USING(OS_LINUX)
+			const size_t separateBytes = (peakBytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+			const size_t sharedBytes = peakBytes + BENCH_STACK_SIZE / RING_FIBER_COUNT;
+#endif //#else //#if USING(OS_LINUX)
+
+			report::Add("shared_stack", "NONE", pattern, RING_FIBER_COUNT, ops, separate);
+			report::Add("shared_stack", "SHARED_STACK", pattern, RING_FIBER_COUNT, ops, shared);
+			report::AddBytes("shared_stack", "NONE", pattern, RING_FIBER_COUNT, separateBytes);
+			report::AddBytes("shared_stack", "SHARED_STACK", pattern, RING_FIBER_COUNT, sharedBytes);
+		}
+
+		static void BenchAll(const stacks::Pool& pool)
+		{
+			static_assert(sizeof(LIVE_SIZES) / sizeof(LIVE_SIZES[0]) == 4);
+
+			BenchLive<LIVE_SIZES[0]>(pool);
+			BenchLive<LIVE_SIZES[1]>(pool);
+			BenchLive<LIVE_SIZES[2]>(pool);
+			BenchLive<LIVE_SIZES[3]>(pool);
+		}
+	}
+
+	namespace baseline_bench
+	{
+#ifdef _MSC_VER
+		__declspec(noinline) static void CallFunc(unsigned* counter) { ++*counter; }
+#else //#ifdef _MSC_VER
+		__attribute__((noinline)) static void CallFunc(unsigned* counter) { ++*counter; __asm__ volatile("" ::: "memory"); }
+#endif //#else //#ifdef _MSC_VER
+
+		static void FunctionCall()
+		{
+			void (*volatile callPtr)(unsigned*) = CallFunc; // Indirect, like the FiberAPI table
+			Measurement best{ 1e300, 0 };
+
+			for (unsigned repeat = 0; repeat < BENCH_REPEATS; ++repeat)
+			{
+				void (*const call)(unsigned*) = callPtr;
+				unsigned counter = 0;
+				const Timer t = timer::Start();
+
+				for (unsigned callIndex = 0; callIndex < CALL_COUNT; ++callIndex)
+				{
+					call(&counter);
+				}
+
+				best = timer::Best(best, timer::Stop(t));
+			}
+
+			report::Add("call", "baseline", "indirect_call", 0, CALL_COUNT, best);
+		}
+
+#if USING(OS_LINUX)
+		static ucontext_t s_mainCtx;
+		static ucontext_t s_pongCtx;
+
+		static void PongFunc()
+		{
+			for (;;)
+			{
+				swapcontext(&s_pongCtx, &s_mainCtx);
+			}
+		}
+
+		static void OSContextSwitch(const stacks::Pool& pool)
+		{
+			Measurement best{ 1e300, 0 };
+
+			getcontext(&s_pongCtx);
+			s_pongCtx.uc_stack.ss_sp = stacks::Get(pool, 0);
+			s_pongCtx.uc_stack.ss_size = BENCH_STACK_SIZE;
+			s_pongCtx.uc_link = nullptr;
+			makecontext(&s_pongCtx, PongFunc, 0);
+
+			for (unsigned repeat = 0; repeat < BENCH_REPEATS; ++repeat)
+			{
+				const Timer t = timer::Start();
+
+				for (unsigned round = 0; round < PING_PONG_ROUNDS / 2; ++round)
+				{
+					swapcontext(&s_mainCtx, &s_pongCtx);
+				}
+
+				best = timer::Best(best, timer::Stop(t));
+			}
+
+			report::Add("switch", "swapcontext", "ping_pong", 2, PING_PONG_ROUNDS, best);
+		}
+#elif USING(OS_WINDOWS) //#if USING(OS_LINUX)
+		static void* s_mainFiber;
+		static void* s_pongFiber;
+
+		static void WINAPI PongFunc(void*)
+		{
+			for (;;)
+			{
+				SwitchToFiber(s_mainFiber);
+			}
+		}
+
+		static void OSContextSwitch(const stacks::Pool&)
+		{
+			Measurement best{ 1e300, 0 };
+
+			s_mainFiber = ConvertThreadToFiber(nullptr);
+			s_pongFiber = CreateFiber(BENCH_STACK_SIZE, PongFunc, nullptr);
+
+			for (unsigned repeat = 0; repeat < BENCH_REPEATS; ++repeat)
+			{
+				const Timer t = timer::Start();
+
+				for (unsigned round = 0; round < PING_PONG_ROUNDS / 2; ++round)
+				{
+					SwitchToFiber(s_pongFiber);
+				}
+
+				best = timer::Best(best, timer::Stop(t));
+			}
+
+			DeleteFiber(s_pongFiber);
+			ConvertFiberToThread();
+
+			report::Add("switch", "SwitchToFiber", "ping_pong", 2, PING_PONG_ROUNDS, best);
+		}
+#endif //#elif USING(OS_WINDOWS) //#if USING(OS_LINUX)
+	}
+}
+
+template<fiber::Options Opts>
+static void BenchOptions(const OptionsDesc& opts, const stacks::Pool& pool)
+{
+	static_assert(sizeof(ALL_OPTIONS) / sizeof(ALL_OPTIONS[0]) == (FIBER_MINIMAL_SAVE_SUPPORTED ? 8 : 4));
+
+	switch_bench::BenchAll<Opts>(opts, "ping_pong", pool, 2, PING_PONG_ROUNDS / 2);
+	switch_bench::BenchAll<Opts>(opts, "ring", pool, RING_FIBER_COUNT, RING_ROUNDS);
+	switch_bench::BenchAll<Opts>(opts, "cold_cache", pool, COLD_FIBER_COUNT, COLD_ROUNDS);
+	create_bench::Bench(opts, pool);
+}
+
+int main(int argc, char** argv)
+{
+	FILE* const out = argc > 1 ? fopen(argv[1], "w") : stdout;
+
+	if (!out)
+	{
+		fprintf(stderr, "Failed to open %s\n", argv[1]);
+		return 1;
+	}
+
+	stacks::Pool pool = stacks::Create(COLD_FIBER_COUNT);
+
+	report::Begin(out);
+
+	BenchOptions<ALL_OPTIONS[0].opts>(ALL_OPTIONS[0], pool);
+	BenchOptions<ALL_OPTIONS[1].opts>(ALL_OPTIONS[1], pool);
+	BenchOptions<ALL_OPTIONS[2].opts>(ALL_OPTIONS[2], pool);
+	BenchOptions<ALL_OPTIONS[3].opts>(ALL_OPTIONS[3], pool);
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+	BenchOptions<ALL_OPTIONS[4].opts>(ALL_OPTIONS[4], pool);
+	BenchOptions<ALL_OPTIONS[5].opts>(ALL_OPTIONS[5], pool);
+	BenchOptions<ALL_OPTIONS[6].opts>(ALL_OPTIONS[6], pool);
+	BenchOptions<ALL_OPTIONS[7].opts>(ALL_OPTIONS[7], pool);
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+
+	shared_stack_bench::BenchAll(pool);
+
+	baseline_bench::OSContextSwitch(pool);
+	baseline_bench::FunctionCall();
+
+	report::End();
+
+	stacks::Destroy(&pool);
+
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+
+	return 0;
+}
@@ -1,6 +1,14 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
+
+// Minimal save needs GNU style inline asm to tell the compiler which registers the switch clobbers
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+# define FIBER_MINIMAL_SAVE_SUPPORTED 1
+#else //#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+# define FIBER_MINIMAL_SAVE_SUPPORTED 0
+#endif //#else //#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
 
 namespace fiber
 {
@@ -8,7 +16,22 @@ namespace fiber
 	{
 		NONE = 0,
 		OS_API_SAFETY = 1<<0,
-		PRESERVE_FPU_CONTROL = 1<<1
+		PRESERVE_FPU_CONTROL = 1<<1,
+
+		/* The switch only saves the stack and frame pointers. Every other register is declared
+		*  clobbered to the compiler at the call site, so only values actually live across the
+		*  switch get spilled. Only available where FIBER_MINIMAL_SAVE_SUPPORTED.
+		*/
+		MINIMAL_SAVE = 1<<2,
+
+		/* Fibers share the stack given to Create instead of owning it, and live on the heap. Only
+		*  one fiber's frames are on a shared stack at a time. The others' live frames, sp up to the
+		*  stack head, are copied out to a right sized heap buffer and copied back when switched to.
+		*  Trades a memcpy per switch for memory proportional to live stack depth. Start must be
+		*  called from a stack that isn't shared. Can't be combined with MINIMAL_SAVE. The top
+		*  of the stack holds the shared state, so memory that held other fibers must be zeroed first.
+		*/
+		SHARED_STACK = 1<<3
 	};
 
 	constexpr Options operator|(Options a, Options b)
@@ -18,12 +41,12 @@ namespace fiber
 	
 	constexpr Options operator&(Options a, Options b)
 	{
-		return static_cast<Options>(static_cast<unsigned>(a) | static_cast<unsigned>(b));
+		return static_cast<Options>(static_cast<unsigned>(a) & static_cast<unsigned>(b));
 	}
 
 	constexpr bool operator!(Options a)
 	{
-		return a != Options::NONE;
+		return a == Options::NONE;
 	}
 
 	constexpr Options operator~(Options a)
@@ -41,10 +64,62 @@ namespace fiber
 		return reinterpret_cast<Options&>(reinterpret_cast<unsigned&>(a) &= static_cast<unsigned>(b));
 	}
 
-	struct Fiber;
+	static constexpr size_t FIBER_LOCAL_SLOT_COUNT = 4;
+
+	struct Fiber
+	{
+		uintptr_t* sp;
+		void* locals[FIBER_LOCAL_SLOT_COUNT]; // Fiber local storage, see GetFiberLocal
+	};
 
 	typedef void(*FiberFunc)(void*);
 
+	namespace api_internal
+	{
+		static constexpr size_t STACK_ALIGN = 2 * sizeof(uintptr_t);
+		static constexpr size_t FIBER_HEAD_SIZE = (sizeof(Fiber) + (STACK_ALIGN - 1)) & ~(STACK_ALIGN - 1); // Stack top to stack head
+
+		// Kept up to date by Start and the switches, for GetFiberLocal
+		inline thread_local Fiber* t_currentFiber = nullptr;
+
+		// The fiber lives at the top of its stack, just above the stack head
+		inline uintptr_t* ToStackHead(Fiber* fiber)
+		{
+			static constexpr size_t HEAD_STACK_ENTRIES = FIBER_HEAD_SIZE / sizeof(uintptr_t);
+			static constexpr size_t FIBER_STACK_ENTRIES = (sizeof(Fiber) + (sizeof(uintptr_t)-1)) / sizeof(uintptr_t);
+
+			return reinterpret_cast<uintptr_t*>(fiber) - (HEAD_STACK_ENTRIES - FIBER_STACK_ENTRIES);
+		}
+
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+		// Calls into the context switch bytecode with every register but rbp and rsp clobbered.
+		// The compiler doesn't know about the call, so step over the red zone before making it.
+		inline uintptr_t MinimalSaveCall(const void* fn, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3)
+		{
+			uintptr_t ret = reinterpret_cast<uintptr_t>(fn);
+
+			asm volatile(
+				"sub $128, %%rsp\n\t"
+				"call *%%rax\n\t"
+				"add $128, %%rsp\n\t"
+				: "+a"(ret), "+D"(arg0), "+S"(arg1), "+d"(arg2), "+c"(arg3)
+				:
+				: "rbx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+				  "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+				  "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+#ifdef __AVX512F__
+				  "xmm16", "xmm17", "xmm18", "xmm19", "xmm20", "xmm21", "xmm22", "xmm23",
+				  "xmm24", "xmm25", "xmm26", "xmm27", "xmm28", "xmm29", "xmm30", "xmm31",
+				  "k1", "k2", "k3", "k4", "k5", "k6", "k7",
+#endif //#ifdef __AVX512F__
+				  "st", "st(1)", "st(2)", "st(3)", "st(4)", "st(5)", "st(6)", "st(7)",
+				  "memory", "cc");
+
+			return ret;
+		}
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+	}
+
 	struct FiberAPI
 	{
 		/* Creates a new fiber with the given stack running the given function
@@ -57,9 +132,217 @@ namespace fiber
 		*  userData - Data passed to StartAddress
 		*/
 		Fiber* (*Create)(void* stack, size_t stackSize, size_t commitedStackSize, FiberFunc StartAddress, void* userData);
+
+		/* Creates count fibers in one pass, the same as count Creates. Fiber i gets the stackSize bytes at
+		*  stacks + i * stackStride, and runs StartAddress(userData[i]). For pools carved out of a single
+		*  reservation, with guard pages in the stride between stacks. A stride that's a multiple of 16
+		*  lays every stack out the same, so that's worked out once for the batch. With
+		*  Options::SHARED_STACK, a stride of 0 puts them all on one shared stack.
+		*/
+		void (*CreateMany)(void* stacks, size_t stackStride, size_t count, size_t stackSize, size_t commitedStackSize, FiberFunc StartAddress, void* const* userData, Fiber** outFibers);
+
 		void (*Start)(Fiber* toFiber);
 		void (*Switch)(Fiber* curFiber, Fiber* toFiber);
+
+		/* Switches to toFiber, handing it payload, and returns the payload given by whoever switches back.
+		*  The payload is passed in a register, not through memory. toFiber must have been suspended by
+		*  SwitchWithValue, or the payload is lost. Likewise, this fiber must be resumed by SwitchWithValue
+		*  for the return value to be meaningful. A fiber's first run gets its userData, not a payload.
+		*/
+		void* (*SwitchWithValue)(Fiber* curFiber, Fiber* toFiber, void* payload);
+
+		/* Switches to toFiber and runs onTop(arg) on toFiber's stack before toFiber resumes.
+		*  By the time onTop runs, curFiber is fully switched out, so it can free or publish curFiber
+		*  (return its stack, push it on a wait queue, etc.) without racing curFiber's own execution.
+		*  onTop runs under the OS stack limits of curFiber, so keep it shallow.
+		*/
+		void (*SwitchOnTop)(Fiber* curFiber, Fiber* toFiber, FiberFunc onTop, void* arg);
 	};
 
 	FiberAPI GetAPI(Options opts);
+
+	/* Fiber local storage. Every fiber has FIBER_LOCAL_SLOT_COUNT pointer slots, zeroed by Create, that
+	*  travel with it. Start and the switches keep a thread local current fiber pointer up to date, so a
+	*  lookup is two loads. Only valid while running on a fiber. Slots of a fiber that isn't running can
+	*  be set through Fiber::locals directly, before starting it for instance.
+	*/
+	inline Fiber* GetCurrentFiber()
+	{
+		return api_internal::t_currentFiber;
+	}
+
+	inline void* GetFiberLocal(size_t slot)
+	{
+		return api_internal::t_currentFiber->locals[slot];
+	}
+
+	inline void SetFiberLocal(size_t slot, void* value)
+	{
+		api_internal::t_currentFiber->locals[slot] = value;
+	}
+
+	/* Stack high water mark profiling, independent of Options.
+	*  PaintStack fills the paintSize bytes below the stack head with a pattern, skipping the initial
+	*  context Create put there. Call it after Create and before the fiber first runs. paintSize must
+	*  be committed.
+	*  GetStackHighWaterMark returns the peak stack depth in bytes, measured from the stack head. It
+	*  finds the lowest word that no longer holds the pattern. A fiber that went deeper than paintSize
+	*  reports paintSize, so check for that and treat it as "at least". Not for SHARED_STACK fibers.
+	*/
+	void PaintStack(Fiber* fiber, size_t paintSize);
+	size_t GetStackHighWaterMark(Fiber* fiber, size_t paintSize);
+
+	/* Frees a fiber created with Options::SHARED_STACK, along with its copied out stack.
+	*  The fiber must not be running.
+	*/
+	void DestroySharedStackFiber(Fiber* fiber);
+
+	namespace api_internal
+	{
+		// Options::SHARED_STACK implementation of Api<Opts>, see fiber.cpp
+		template<Options Opts>
+		struct SharedStackApi
+		{
+			static Fiber* Create(void* stack, size_t stackSize, size_t commitedStackSize, FiberFunc StartAddress, void* userData);
+			static void Start(Fiber* toFiber);
+			static void Switch(Fiber* curFiber, Fiber* toFiber);
+			static void* SwitchWithValue(Fiber* curFiber, Fiber* toFiber, void* payload);
+			static void SwitchOnTop(Fiber* curFiber, Fiber* toFiber, FiberFunc onTop, void* arg);
+		};
+
+		extern template struct SharedStackApi<Options::SHARED_STACK>;
+		extern template struct SharedStackApi<Options::SHARED_STACK | Options::OS_API_SAFETY>;
+		extern template struct SharedStackApi<Options::SHARED_STACK | Options::PRESERVE_FPU_CONTROL>;
+		extern template struct SharedStackApi<Options::SHARED_STACK | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>;
+	}
+
+	/* Compile time specialized version of FiberAPI. Switch and Start inline into the
+	*  caller and call straight into the context switch bytecode, skipping the FiberAPI
+	*  function table. Create and the stack layout are identical to the FiberAPI returned
+	*  by GetAPI(Opts), so fibers can be mixed between the two.
+	*/
+	template<Options Opts>
+	struct Api
+	{
+		static Fiber* Create(void* stack, size_t stackSize, size_t commitedStackSize, FiberFunc StartAddress, void* userData);
+		static void CreateMany(void* stacks, size_t stackStride, size_t count, size_t stackSize, size_t commitedStackSize, FiberFunc StartAddress, void* const* userData, Fiber** outFibers);
+
+		static void Start(Fiber* toFiber)
+		{
+			Fiber* const prevFiber = api_internal::t_currentFiber;
+
+			api_internal::t_currentFiber = toFiber;
+
+			if constexpr (!!(Opts & Options::SHARED_STACK))
+			{
+				api_internal::SharedStackApi<Opts>::Start(toFiber);
+			}
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+			else if constexpr (!!(Opts & Options::MINIMAL_SAVE))
+			{
+				api_internal::MinimalSaveCall(reinterpret_cast<const void*>(StartASM), reinterpret_cast<uintptr_t>(toFiber->sp), 0, 0, 0);
+			}
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+			else
+			{
+				StartASM(toFiber->sp);
+			}
+
+			api_internal::t_currentFiber = prevFiber; // Back once a fiber finishes
+		}
+
+		static void Switch(Fiber* curFiber, Fiber* toFiber)
+		{
+			api_internal::t_currentFiber = toFiber;
+
+			if constexpr (!!(Opts & Options::SHARED_STACK))
+			{
+				api_internal::SharedStackApi<Opts>::Switch(curFiber, toFiber);
+				return;
+			}
+
+			uintptr_t* const toStackHead = api_internal::ToStackHead(toFiber);
+			const uintptr_t* const curStackHead = api_internal::ToStackHead(curFiber);
+
+			toStackHead[-1] = curStackHead[-1]; // copy around the return stack frame pointer
+
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+			if constexpr (!!(Opts & Options::MINIMAL_SAVE))
+			{
+				api_internal::MinimalSaveCall(reinterpret_cast<const void*>(SwitchASM), reinterpret_cast<uintptr_t>(curFiber), reinterpret_cast<uintptr_t>(toFiber), 0, 0);
+				return;
+			}
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+			SwitchASM(curFiber, toFiber);
+		}
+
+		static void* SwitchWithValue(Fiber* curFiber, Fiber* toFiber, void* payload)
+		{
+			api_internal::t_currentFiber = toFiber;
+
+			if constexpr (!!(Opts & Options::SHARED_STACK))
+			{
+				return api_internal::SharedStackApi<Opts>::SwitchWithValue(curFiber, toFiber, payload);
+			}
+
+			uintptr_t* const toStackHead = api_internal::ToStackHead(toFiber);
+			const uintptr_t* const curStackHead = api_internal::ToStackHead(curFiber);
+
+			toStackHead[-1] = curStackHead[-1]; // copy around the return stack frame pointer
+
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+			if constexpr (!!(Opts & Options::MINIMAL_SAVE))
+			{
+				return reinterpret_cast<void*>(api_internal::MinimalSaveCall(reinterpret_cast<const void*>(SwitchWithValueASM), reinterpret_cast<uintptr_t>(curFiber), reinterpret_cast<uintptr_t>(toFiber), reinterpret_cast<uintptr_t>(payload), 0));
+			}
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+			return SwitchWithValueASM(curFiber, toFiber, payload);
+		}
+
+		static void SwitchOnTop(Fiber* curFiber, Fiber* toFiber, FiberFunc onTop, void* arg)
+		{
+			api_internal::t_currentFiber = toFiber;
+
+			if constexpr (!!(Opts & Options::SHARED_STACK))
+			{
+				api_internal::SharedStackApi<Opts>::SwitchOnTop(curFiber, toFiber, onTop, arg);
+				return;
+			}
+
+			uintptr_t* const toStackHead = api_internal::ToStackHead(toFiber);
+			const uintptr_t* const curStackHead = api_internal::ToStackHead(curFiber);
+
+			toStackHead[-1] = curStackHead[-1]; // copy around the return stack frame pointer
+
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+			if constexpr (!!(Opts & Options::MINIMAL_SAVE))
+			{
+				api_internal::MinimalSaveCall(reinterpret_cast<const void*>(SwitchOnTopASM), reinterpret_cast<uintptr_t>(curFiber), reinterpret_cast<uintptr_t>(toFiber), reinterpret_cast<uintptr_t>(onTop), reinterpret_cast<uintptr_t>(arg));
+				return;
+			}
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+			SwitchOnTopASM(curFiber, toFiber, onTop, arg);
+		}
+
+	private:
+		static void (* const StartASM)(uintptr_t* sp);
+		static void (* const SwitchASM)(Fiber* curFiber, Fiber* toFiber);
+		static void* (* const SwitchWithValueASM)(Fiber* curFiber, Fiber* toFiber, void* payload);
+		static void (* const SwitchOnTopASM)(Fiber* curFiber, Fiber* toFiber, FiberFunc onTop, void* arg);
+	};
+
+	extern template struct Api<Options::NONE>;
+	extern template struct Api<Options::OS_API_SAFETY>;
+	extern template struct Api<Options::PRESERVE_FPU_CONTROL>;
+	extern template struct Api<Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>;
+	extern template struct Api<Options::SHARED_STACK>;
+	extern template struct Api<Options::SHARED_STACK | Options::OS_API_SAFETY>;
+	extern template struct Api<Options::SHARED_STACK | Options::PRESERVE_FPU_CONTROL>;
+	extern template struct Api<Options::SHARED_STACK | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>;
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+	extern template struct Api<Options::MINIMAL_SAVE>;
+	extern template struct Api<Options::MINIMAL_SAVE | Options::OS_API_SAFETY>;
+	extern template struct Api<Options::MINIMAL_SAVE | Options::PRESERVE_FPU_CONTROL>;
+	extern template struct Api<Options::MINIMAL_SAVE | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>;
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
 }
\ No newline at end of file
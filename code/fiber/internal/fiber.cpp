@@ -1,4 +1,6 @@
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include "platform.h"
 #include "sanity.h"
 #include "register_definitions.h"
@@ -14,6 +16,7 @@
 # include <setjmp.h>
 # include <signal.h>
 # include <ucontext.h>
+# include <xmmintrin.h>
 # undef _FORTIFY_SOURCE
 #endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
 
@@ -29,24 +32,23 @@
 # error Unknown processor.
 #endif //#else //#elif USING(PROC_ARM) //#elif USING(PROC_ARM64) //#elif USING(PROC_X86) //#if USING(PROC_X64)
 
-namespace fiber
-{
-	struct Fiber
-	{
-		uintptr_t* sp;
-	};
-}
-
 namespace
 {
 	using StartASMProc = void(void*);
 	using SwitchASMProc = void(void*, void*);
+	using SwitchWithValueASMProc = void*(void*, void*, void*);
+	using SwitchOnTopASMProc = void(void*, void*, void(*)(void*), void*);
 
 	static uintptr_t GetStackStartPlaceholder()
 	{
 		return 0xBAADF00DDEADBEEFull;
 	}
 
+	static uintptr_t GetStackPaintPattern()
+	{
+		return 0xFEEDFACECAFEF00Dull;
+	}
+
 	static constexpr uint8_t B1(uint32_t val) { return val & 0xFF; }
 	static constexpr uint8_t B2(uint32_t val) { return (val >> 8) & 0xFF; }
 	static constexpr uint8_t B3(uint32_t val) { return (val >> 16) & 0xFF; }
@@ -62,6 +64,7 @@ namespace
 	{
 #undef OPT_OS_API_SAFETY
 #undef OPT_PRESERVE_FPU_CONTROL
+#undef OPT_MINIMAL_SAVE
 #include BYTECODE_INL
 	};
 
@@ -91,99 +94,542 @@ namespace
 #undef OPT_PRESERVE_FPU_CONTROL
 	};
 
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+	template<>
+	struct FiberASMAPI<fiber::Options::MINIMAL_SAVE>
+	{
+#define OPT_MINIMAL_SAVE 1
+#include BYTECODE_INL
+#undef OPT_MINIMAL_SAVE
+	};
+
+	template<>
+	struct FiberASMAPI<fiber::Options::MINIMAL_SAVE | fiber::Options::OS_API_SAFETY>
+	{
+#define OPT_MINIMAL_SAVE 1
+#define OPT_OS_API_SAFETY 1
+#include BYTECODE_INL
+#undef OPT_MINIMAL_SAVE
+#undef OPT_OS_API_SAFETY
+	};
+
+	template<>
+	struct FiberASMAPI<fiber::Options::MINIMAL_SAVE | fiber::Options::PRESERVE_FPU_CONTROL>
+	{
+#define OPT_MINIMAL_SAVE 1
+#define OPT_PRESERVE_FPU_CONTROL 1
+#include BYTECODE_INL
+#undef OPT_MINIMAL_SAVE
+#undef OPT_PRESERVE_FPU_CONTROL
+	};
+
+	template<>
+	struct FiberASMAPI<fiber::Options::MINIMAL_SAVE | fiber::Options::OS_API_SAFETY | fiber::Options::PRESERVE_FPU_CONTROL>
+	{
+#define OPT_MINIMAL_SAVE 1
+#define OPT_OS_API_SAFETY 1
+#define OPT_PRESERVE_FPU_CONTROL 1
+#include BYTECODE_INL
+#undef OPT_MINIMAL_SAVE
+#undef OPT_OS_API_SAFETY
+#undef OPT_PRESERVE_FPU_CONTROL
+	};
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+
 #undef TO_BYTES
 
-	static uintptr_t* ToStackHead(fiber::Fiber* fiber)
+	using fiber::api_internal::ToStackHead;
+
+	static_assert(fiber::api_internal::STACK_ALIGN == STACK_ALIGN);
+
+	template<fiber::Options Opts>
+	using BytecodeFor = FiberASMAPI<Opts & ~fiber::Options::SHARED_STACK>; // Shared stacks switch with the plain bytecode
+
+	// Options::SHARED_STACK. The fiber whose frames are on a shared stack is its owner. Loading another
+	// fiber copies the owner's live frames out to the heap first. Copying the current fiber out from
+	// under itself isn't possible, so switches between two fibers of the same stack go through the
+	// stack's copier fiber, which runs on a small stack of its own at the top of the shared one.
+	static constexpr size_t COPIER_STACK_SIZE = 8 * 1024;
+
+	static uintptr_t GetSharedStackMagic()
+	{
+		return 0x5EA7ED57AC4C0DE5ull;
+	}
+
+	struct SharedFiber;
+
+	enum class SharedSwitch : unsigned
+	{
+		SWITCH,
+		SWITCH_WITH_VALUE,
+		SWITCH_ON_TOP
+	};
+
+	// Lives at the top of the shared stack memory
+	struct SharedStack
 	{
-		static constexpr size_t ALIGN_STACK_ENTRIES = STACK_ALIGN / sizeof(uintptr_t);
-		static constexpr size_t FIBER_STACK_ENTRIES = (sizeof(fiber::Fiber) + (sizeof(uintptr_t)-1)) / sizeof(uintptr_t);
+		uintptr_t magic;
+		SharedStack* self; // With magic, tells an already set up shared stack from fresh memory
+		SharedFiber* owner;
+		fiber::Fiber* copier;
+		uintptr_t* stackHead;
+		size_t stackSize;
+		size_t commitedStackSize;
+
+		// Handed from the switching fiber to the copier
+		struct
+		{
+			SharedFiber* to;
+			uintptr_t returnSP;
+			SharedSwitch op;
+			void* payload;
+			fiber::FiberFunc onTop;
+			void* arg;
+		} pending;
+	};
 
-		static_assert((STACK_ALIGN % sizeof(uintptr_t)) == 0);
+	struct SharedFiber
+	{
+		fiber::Fiber fiber; // First, the bytecode reads and writes sp through the fiber pointer
+		SharedStack* stack;
+		uint8_t* saved;
+		size_t savedSize;
+		size_t savedCapacity;
+		fiber::FiberFunc startAddress;
+		void* userData;
+	};
 
-		return reinterpret_cast<uintptr_t*>(fiber) - (ALIGN_STACK_ENTRIES - FIBER_STACK_ENTRIES);
+	static SharedFiber* ToSharedFiber(fiber::Fiber* fiber)
+	{
+		return reinterpret_cast<SharedFiber*>(fiber);
+	}
+
+	// Where Create puts things in a stack. Only depends on the stack's address modulo STACK_ALIGN, so a pool
+	// with an aligned stride lays every stack out the same, shifted by the stride.
+	struct StackLayout
+	{
+		uintptr_t* stackBase;
+		uintptr_t* stackCeil;
+		fiber::Fiber* fiber;
+		size_t trueStackSize;
+		size_t commitedStackSize;
+	};
+
+	static StackLayout LayoutStack(void* stack, size_t stackSize, size_t commitedStackSize)
+	{
+		static constexpr uintptr_t STACK_ALIGN_MASK = fiber::api_internal::STACK_ALIGN - 1;
+
+		sanity(stackSize);
+		sanity(commitedStackSize <= stackSize);
+
+		// The stack grows down, so the commited pages are the top of the stack memory block
+		const uintptr_t stackAddr = reinterpret_cast<uintptr_t>(stack);
+		const uintptr_t alignedStackAddr = (stackAddr + STACK_ALIGN_MASK) & ~STACK_ALIGN_MASK;
+		const uintptr_t alignedStackTopAddr = (stackAddr + stackSize) & ~STACK_ALIGN_MASK;
+		const uintptr_t alignedCommitedStackAddr = (stackAddr + (stackSize - commitedStackSize) + STACK_ALIGN_MASK) & ~STACK_ALIGN_MASK;
+		uintptr_t* const stackTop = reinterpret_cast<uintptr_t*>(alignedStackTopAddr);
+		uintptr_t* const stackBase = stackTop - (fiber::api_internal::FIBER_HEAD_SIZE/sizeof(uintptr_t));
+		StackLayout layout;
+
+		layout.stackBase = stackBase;
+		layout.stackCeil = reinterpret_cast<uintptr_t*>(alignedCommitedStackAddr);
+		layout.fiber = reinterpret_cast<fiber::Fiber*>(stackTop - sizeof(fiber::Fiber)/sizeof(uintptr_t));
+		layout.trueStackSize = reinterpret_cast<uintptr_t>(stackBase) - alignedStackAddr;
+		layout.commitedStackSize = reinterpret_cast<uintptr_t>(stackBase) - alignedCommitedStackAddr;
+
+		sanity(stackBase == fiber::api_internal::ToStackHead(layout.fiber));
+
+		return layout;
 	}
 
 	template<fiber::Options Opts>
 	struct FiberAPIImpl
 	{
-		static fiber::Fiber* Create(void* stack, size_t stackSize, size_t commitedStackSize, fiber::FiberFunc startAddress, void* userData)
+		static void Start(fiber::Fiber* toFiber)
+		{
+			if constexpr (!(Opts & fiber::Options::SHARED_STACK)) // Shared stacks aren't loaded until started
+			{
+				const uintptr_t* const stackHead = ToStackHead(toFiber);
+
+				sanity(stackHead[-1] == GetStackStartPlaceholder());
+			}
+
+			fiber::Api<Opts>::Start(toFiber);
+		}
+
+		static fiber::FiberAPI GetAPI()
+		{
+			fiber::FiberAPI api{};
+			api.Create = &fiber::Api<Opts>::Create;
+			api.CreateMany = &fiber::Api<Opts>::CreateMany;
+			api.Start = &Start;
+			api.Switch = &fiber::Api<Opts>::Switch;
+			api.SwitchWithValue = &fiber::Api<Opts>::SwitchWithValue;
+			api.SwitchOnTop = &fiber::Api<Opts>::SwitchOnTop;
+			return api;
+		}
+	};
+}
+
+namespace fiber
+{
+	template<Options Opts>
+	Fiber* Api<Opts>::Create(void* stack, size_t stackSize, size_t commitedStackSize, FiberFunc startAddress, void* userData)
+	{
+		if constexpr (!!(Opts & Options::SHARED_STACK))
 		{
-			static constexpr unsigned STACK_ALIGN_MASK = STACK_ALIGN - 1;
+			return api_internal::SharedStackApi<Opts>::Create(stack, stackSize, commitedStackSize, startAddress, userData);
+		}
 
-			if constexpr (!(Opts & fiber::Options::OS_API_SAFETY))
+		if (!commitedStackSize)
+		{
+			commitedStackSize = stackSize;
+		}
+
+#if USING(OS_WINDOWS)
+		// Windows only grows a stack through its guard page if the TIB describes that stack
+		if constexpr (!(Opts & Options::OS_API_SAFETY))
+		{
+			sanity(stackSize == commitedStackSize);
+		}
+#endif //#if USING(OS_WINDOWS)
+
+		const StackLayout layout = LayoutStack(stack, stackSize, commitedStackSize);
+		Fiber* const out = layout.fiber;
+
+		*out = Fiber{};
+		out->sp = BytecodeFor<Opts>::InitStackRegisters(layout.stackBase, startAddress, userData, layout.trueStackSize, layout.commitedStackSize);
+
+		sanity(out->sp >= layout.stackCeil && "Not enough stack space to hold base context");
+
+		return out;
+	}
+
+	template<Options Opts>
+	void Api<Opts>::CreateMany(void* stacks, size_t stackStride, size_t count, size_t stackSize, size_t commitedStackSize, FiberFunc startAddress, void* const* userData, Fiber** outFibers)
+	{
+		static constexpr uintptr_t STACK_ALIGN_MASK = STACK_ALIGN - 1;
+
+		uint8_t* stack = reinterpret_cast<uint8_t*>(stacks);
+
+		// Shared fibers are a heap allocation each, and a stride that breaks alignment lays out every stack differently
+		if (!!(Opts & Options::SHARED_STACK) || (stackStride & STACK_ALIGN_MASK))
+		{
+			for (size_t fiberIndex = 0; fiberIndex < count; ++fiberIndex, stack += stackStride)
+			{
+				outFibers[fiberIndex] = Create(stack, stackSize, commitedStackSize, startAddress, userData[fiberIndex]);
+			}
+
+			return;
+		}
+
+#if USING(OS_WINDOWS)
+		if constexpr (!(Opts & Options::OS_API_SAFETY))
+		{
+			sanity(!commitedStackSize || stackSize == commitedStackSize);
+		}
+#endif //#if USING(OS_WINDOWS)
+
+		// Lay out the first stack, every other one is the same shifted by the stride
+		const StackLayout layout = LayoutStack(stack, stackSize, commitedStackSize ? commitedStackSize : stackSize);
+
+		for (size_t fiberIndex = 0; fiberIndex < count; ++fiberIndex)
+		{
+			const ptrdiff_t offset = static_cast<ptrdiff_t>(stackStride * fiberIndex);
+			Fiber* const out = reinterpret_cast<Fiber*>(reinterpret_cast<uint8_t*>(layout.fiber) + offset);
+			uintptr_t* const stackBase = reinterpret_cast<uintptr_t*>(reinterpret_cast<uint8_t*>(layout.stackBase) + offset);
+
+			*out = Fiber{};
+			out->sp = BytecodeFor<Opts>::InitStackRegisters(stackBase, startAddress, userData[fiberIndex], layout.trueStackSize, layout.commitedStackSize);
+			outFibers[fiberIndex] = out;
+		}
+
+		sanity((count == 0 || layout.stackBase - outFibers[0]->sp <= layout.stackBase - layout.stackCeil) && "Not enough stack space to hold base context");
+	}
+
+	template<Options Opts>
+	void (* const Api<Opts>::StartASM)(uintptr_t* sp) = reinterpret_cast<void(*)(uintptr_t*)>(BytecodeFor<Opts>::StartASM);
+
+	template<Options Opts>
+	void (* const Api<Opts>::SwitchASM)(Fiber* curFiber, Fiber* toFiber) = reinterpret_cast<void(*)(Fiber*, Fiber*)>(BytecodeFor<Opts>::SwitchFiberASM);
+
+	template<Options Opts>
+	void* (* const Api<Opts>::SwitchWithValueASM)(Fiber* curFiber, Fiber* toFiber, void* payload) = reinterpret_cast<void*(*)(Fiber*, Fiber*, void*)>(BytecodeFor<Opts>::SwitchWithValueFiberASM);
+
+	template<Options Opts>
+	void (* const Api<Opts>::SwitchOnTopASM)(Fiber* curFiber, Fiber* toFiber, FiberFunc onTop, void* arg) = reinterpret_cast<void(*)(Fiber*, Fiber*, FiberFunc, void*)>(BytecodeFor<Opts>::SwitchOnTopFiberASM);
+
+	template struct Api<Options::NONE>;
+	template struct Api<Options::OS_API_SAFETY>;
+	template struct Api<Options::PRESERVE_FPU_CONTROL>;
+	template struct Api<Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>;
+	template struct Api<Options::SHARED_STACK>;
+	template struct Api<Options::SHARED_STACK | Options::OS_API_SAFETY>;
+	template struct Api<Options::SHARED_STACK | Options::PRESERVE_FPU_CONTROL>;
+	template struct Api<Options::SHARED_STACK | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>;
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+	template struct Api<Options::MINIMAL_SAVE>;
+	template struct Api<Options::MINIMAL_SAVE | Options::OS_API_SAFETY>;
+	template struct Api<Options::MINIMAL_SAVE | Options::PRESERVE_FPU_CONTROL>;
+	template struct Api<Options::MINIMAL_SAVE | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>;
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+}
+
+namespace fiber
+{
+	namespace api_internal
+	{
+		template<Options Opts>
+		struct SharedStackImpl
+		{
+			static constexpr Options BASE_OPTS = Opts & ~Options::SHARED_STACK;
+			using ASM = BytecodeFor<Opts>;
+
+			static_assert(!(Opts & Options::MINIMAL_SAVE), "Shared stacks switch from C++, which can't clobber registers");
+
+			static void Evict(SharedStack* stack)
 			{
-				if (!commitedStackSize)
+				SharedFiber* const owner = stack->owner;
+
+				if (!owner)
 				{
-					commitedStackSize = stackSize;
+					return;
 				}
-				else
+
+				const size_t liveSize = static_cast<size_t>(stack->stackHead - owner->fiber.sp) * sizeof(uintptr_t);
+
+				// Keep the buffer right sized, fibers that were deep once shouldn't hold onto it
+				if (liveSize > owner->savedCapacity || liveSize < owner->savedCapacity / 4)
 				{
-					sanity(stackSize == commitedStackSize);
+					owner->saved = reinterpret_cast<uint8_t*>(realloc(owner->saved, liveSize));
+					owner->savedCapacity = liveSize;
+
+					sanity(owner->saved);
 				}
+
+				memcpy(owner->saved, owner->fiber.sp, liveSize);
+				owner->savedSize = liveSize;
+				stack->owner = nullptr;
 			}
 
-			static_assert(sizeof(fiber::Fiber) <= STACK_ALIGN);
+			// Must not be called from to's stack, unless it's already the owner
+			static void Load(SharedFiber* to, uintptr_t returnSP)
+			{
+				SharedStack* const stack = to->stack;
+
+				if (stack->owner != to)
+				{
+					Evict(stack);
+
+					if (to->fiber.sp)
+					{
+						memcpy(to->fiber.sp, to->saved, to->savedSize);
+					}
+					else
+					{
+						to->fiber.sp = ASM::InitStackRegisters(stack->stackHead, &FiberMain, to, stack->stackSize, stack->commitedStackSize);
+					}
+
+					stack->owner = to;
+				}
+
+				stack->stackHead[-1] = returnSP; // copy around the return stack frame pointer
+			}
+
+			static void FiberMain(void* userData)
+			{
+				SharedFiber* const self = reinterpret_cast<SharedFiber*>(userData);
+
+				self->startAddress(self->userData);
+				self->stack->owner = nullptr; // Finished, nothing left to copy out. EndFiber still reads the return pointer.
+			}
+
+			static void* Resume(SharedFiber* from, SharedFiber* to, SharedSwitch op, void* payload, FiberFunc onTop, void* arg)
+			{
+				switch (op)
+				{
+				case SharedSwitch::SWITCH:
+					ASM::SwitchFiberASM(from, to);
+					return nullptr;
+				case SharedSwitch::SWITCH_WITH_VALUE:
+					return ASM::SwitchWithValueFiberASM(from, to, payload);
+				case SharedSwitch::SWITCH_ON_TOP:
+					ASM::SwitchOnTopFiberASM(from, to, onTop, arg);
+					return nullptr;
+				}
+
+				sanity(0 && "Unknown switch");
+
+				return nullptr;
+			}
+
+			static void CopierMain(void* userData)
+			{
+				SharedStack* const stack = reinterpret_cast<SharedStack*>(userData);
+
+				for (;;)
+				{
+					const auto pending = stack->pending;
+
+					Load(pending.to, pending.returnSP);
+					Resume(reinterpret_cast<SharedFiber*>(stack->copier), pending.to, pending.op, pending.payload, pending.onTop, pending.arg);
+				}
+			}
+
+			static void* SwitchTo(Fiber* curFiber, Fiber* toFiber, SharedSwitch op, void* payload, FiberFunc onTop, void* arg)
+			{
+				SharedFiber* const cur = ToSharedFiber(curFiber);
+				SharedFiber* const to = ToSharedFiber(toFiber);
+				SharedStack* const stack = to->stack;
+				const uintptr_t returnSP = cur->stack->stackHead[-1];
+
+				sanity(cur != to);
+				sanity(cur->stack->owner == cur && "Switching from a fiber that isn't running");
+
+				if (stack != cur->stack)
+				{
+					Load(to, returnSP);
+
+					return Resume(cur, to, op, payload, onTop, arg);
+				}
+
+				stack->pending = { to, returnSP, op, payload, onTop, arg };
+
+				// The value switch, so whoever resumes us with a payload has it returned
+				return ASM::SwitchWithValueFiberASM(cur, stack->copier, nullptr);
+			}
+		};
+
+		template<Options Opts>
+		Fiber* SharedStackApi<Opts>::Create(void* stack, size_t stackSize, size_t commitedStackSize, FiberFunc startAddress, void* userData)
+		{
+			static constexpr uintptr_t STACK_ALIGN_MASK = STACK_ALIGN - 1;
+			static constexpr size_t SHARED_STACK_ENTRIES = (sizeof(SharedStack) + STACK_ALIGN_MASK) / sizeof(uintptr_t) & ~(STACK_ALIGN_MASK / sizeof(uintptr_t));
+
+			if (!commitedStackSize)
+			{
+				commitedStackSize = stackSize;
+			}
 
 			const uintptr_t stackAddr = reinterpret_cast<uintptr_t>(stack);
-			const uintptr_t alignedStackAddr = (stackAddr + STACK_ALIGN_MASK) & ~STACK_ALIGN_MASK;
-			const size_t alignedStackMemSize = commitedStackSize - (alignedStackAddr - stackAddr);
-			uintptr_t* const stackCeil = reinterpret_cast<uintptr_t*>(alignedStackAddr);
-			const size_t stackMemEntries = alignedStackMemSize / sizeof(uintptr_t);
-			const size_t stackEntries = stackMemEntries - (STACK_ALIGN/sizeof(uintptr_t));
-			const size_t alignedTrueStackSize = stackSize & ~(sizeof(uintptr_t) - 1);
-			uintptr_t* const stackBase = stackCeil + stackEntries;
-			fiber::Fiber* out = reinterpret_cast<fiber::Fiber*>(stackCeil + stackMemEntries - sizeof(fiber::Fiber)/sizeof(uintptr_t));
+			uintptr_t* const stackTop = reinterpret_cast<uintptr_t*>((stackAddr + stackSize) & ~STACK_ALIGN_MASK);
+			SharedStack* const sharedStack = reinterpret_cast<SharedStack*>(stackTop - SHARED_STACK_ENTRIES);
+
+			if (sharedStack->magic != GetSharedStackMagic() || sharedStack->self != sharedStack)
+			{
+				uint8_t* const copierStack = reinterpret_cast<uint8_t*>(sharedStack) - COPIER_STACK_SIZE;
+				const size_t topSize = static_cast<size_t>(reinterpret_cast<uint8_t*>(stackTop) - copierStack);
+
+				sanity(commitedStackSize > topSize + STACK_ALIGN && "Shared stack too small for the copier");
+
+				memset(sharedStack, 0, sizeof(*sharedStack));
+				sharedStack->copier = Api<SharedStackImpl<Opts>::BASE_OPTS>::Create(copierStack, COPIER_STACK_SIZE, 0, &SharedStackImpl<Opts>::CopierMain, sharedStack);
+				sharedStack->stackHead = reinterpret_cast<uintptr_t*>(copierStack) - STACK_ALIGN / sizeof(uintptr_t);
+				sanity((reinterpret_cast<uintptr_t>(sharedStack->stackHead) & STACK_ALIGN_MASK) == 0);
+				sharedStack->stackSize = static_cast<size_t>(copierStack - reinterpret_cast<uint8_t*>(stack));
+				sharedStack->commitedStackSize = commitedStackSize - topSize;
+				sharedStack->self = sharedStack;
+				sharedStack->magic = GetSharedStackMagic();
+			}
 
-			sanity(stackBase == ToStackHead(out));
-			sanity(stackSize);
+			SharedFiber* const out = reinterpret_cast<SharedFiber*>(malloc(sizeof(SharedFiber)));
 
-			out->sp = FiberASMAPI<Opts>::InitStackRegisters(stackBase, startAddress, userData, alignedTrueStackSize, stackEntries*sizeof(uintptr_t));
+			sanity(out);
 
-			sanity(out->sp >= stackCeil && "Not enough stack space to hold base context");
+			*out = SharedFiber{ { nullptr, {} }, sharedStack, nullptr, 0, 0, startAddress, userData };
 
-			return out;
+			return &out->fiber;
 		}
 
-		static void Start(fiber::Fiber* toFiber)
+		template<Options Opts>
+		void SharedStackApi<Opts>::Start(Fiber* toFiber)
 		{
-			const uintptr_t* const stackHead = ToStackHead(toFiber);
+			SharedFiber* const to = ToSharedFiber(toFiber);
 
-			sanity(stackHead[-1] == GetStackStartPlaceholder());
+			sanity(!to->fiber.sp && "Fiber already started");
 
-			FiberASMAPI<Opts>::StartASM(toFiber->sp);
+			SharedStackImpl<Opts>::Load(to, GetStackStartPlaceholder());
+			SharedStackImpl<Opts>::ASM::StartASM(to->fiber.sp);
 		}
 
-		static void Switch(fiber::Fiber* curFiber, fiber::Fiber* toFiber)
+		template<Options Opts>
+		void SharedStackApi<Opts>::Switch(Fiber* curFiber, Fiber* toFiber)
 		{
-			uintptr_t* const toStackHead = ToStackHead(toFiber);
-			const uintptr_t* const curStackHead = ToStackHead(curFiber);
+			SharedStackImpl<Opts>::SwitchTo(curFiber, toFiber, SharedSwitch::SWITCH, nullptr, nullptr, nullptr);
+		}
 
-			toStackHead[-1] = curStackHead[-1]; // copy around the return stack frame pointer
+		template<Options Opts>
+		void* SharedStackApi<Opts>::SwitchWithValue(Fiber* curFiber, Fiber* toFiber, void* payload)
+		{
+			return SharedStackImpl<Opts>::SwitchTo(curFiber, toFiber, SharedSwitch::SWITCH_WITH_VALUE, payload, nullptr, nullptr);
+		}
 
-			FiberASMAPI<Opts>::SwitchFiberASM(curFiber, toFiber);
+		template<Options Opts>
+		void SharedStackApi<Opts>::SwitchOnTop(Fiber* curFiber, Fiber* toFiber, FiberFunc onTop, void* arg)
+		{
+			SharedStackImpl<Opts>::SwitchTo(curFiber, toFiber, SharedSwitch::SWITCH_ON_TOP, nullptr, onTop, arg);
 		}
 
-		static fiber::FiberAPI GetAPI()
+		template struct SharedStackApi<Options::SHARED_STACK>;
+		template struct SharedStackApi<Options::SHARED_STACK | Options::OS_API_SAFETY>;
+		template struct SharedStackApi<Options::SHARED_STACK | Options::PRESERVE_FPU_CONTROL>;
+		template struct SharedStackApi<Options::SHARED_STACK | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>;
+	}
+
+	void DestroySharedStackFiber(Fiber* fiber)
+	{
+		SharedFiber* const sharedFiber = ToSharedFiber(fiber);
+
+		if (sharedFiber->stack->owner == sharedFiber)
 		{
-			fiber::FiberAPI api{};
-			api.Create = &Create;
-			api.Start = &Start;
-			api.Switch = &Switch;
-			return api;
+			sharedFiber->stack->owner = nullptr;
 		}
-	};
+
+		free(sharedFiber->saved);
+		free(sharedFiber);
+	}
 }
 
 namespace fiber
 {
+	void PaintStack(Fiber* fiber, size_t paintSize)
+	{
+		uintptr_t* const stackHead = ToStackHead(fiber);
+		uintptr_t* const paintStart = stackHead - paintSize / sizeof(uintptr_t);
+
+		sanity(paintStart <= fiber->sp && "Paint size doesn't cover the initial context");
+
+		std::fill(paintStart, fiber->sp, GetStackPaintPattern());
+	}
+
+	size_t GetStackHighWaterMark(Fiber* fiber, size_t paintSize)
+	{
+		const uintptr_t* const stackHead = ToStackHead(fiber);
+		const uintptr_t* const paintStart = stackHead - paintSize / sizeof(uintptr_t);
+		const uintptr_t paint = GetStackPaintPattern();
+		const uintptr_t* const deepest = std::find_if(paintStart, stackHead, [paint](uintptr_t entry) { return entry != paint; });
+
+		return static_cast<size_t>(stackHead - deepest) * sizeof(uintptr_t);
+	}
+
 	FiberAPI GetAPI(Options opts)
 	{
-		switch (opts)
+		switch (static_cast<unsigned>(opts)) // Combinations of flags aren't enumerators
 		{
-			case Options::NONE: return FiberAPIImpl<Options::NONE>::GetAPI();
-			case Options::OS_API_SAFETY: return FiberAPIImpl<Options::OS_API_SAFETY>::GetAPI();
-			case Options::PRESERVE_FPU_CONTROL: return FiberAPIImpl<Options::PRESERVE_FPU_CONTROL>::GetAPI();
-			case Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL: return FiberAPIImpl<Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>::GetAPI();
+			case static_cast<unsigned>(Options::NONE): return FiberAPIImpl<Options::NONE>::GetAPI();
+			case static_cast<unsigned>(Options::OS_API_SAFETY): return FiberAPIImpl<Options::OS_API_SAFETY>::GetAPI();
+			case static_cast<unsigned>(Options::PRESERVE_FPU_CONTROL): return FiberAPIImpl<Options::PRESERVE_FPU_CONTROL>::GetAPI();
+			case static_cast<unsigned>(Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL): return FiberAPIImpl<Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>::GetAPI();
+			case static_cast<unsigned>(Options::SHARED_STACK): return FiberAPIImpl<Options::SHARED_STACK>::GetAPI();
+			case static_cast<unsigned>(Options::SHARED_STACK | Options::OS_API_SAFETY): return FiberAPIImpl<Options::SHARED_STACK | Options::OS_API_SAFETY>::GetAPI();
+			case static_cast<unsigned>(Options::SHARED_STACK | Options::PRESERVE_FPU_CONTROL): return FiberAPIImpl<Options::SHARED_STACK | Options::PRESERVE_FPU_CONTROL>::GetAPI();
+			case static_cast<unsigned>(Options::SHARED_STACK | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL): return FiberAPIImpl<Options::SHARED_STACK | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>::GetAPI();
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+			case static_cast<unsigned>(Options::MINIMAL_SAVE): return FiberAPIImpl<Options::MINIMAL_SAVE>::GetAPI();
+			case static_cast<unsigned>(Options::MINIMAL_SAVE | Options::OS_API_SAFETY): return FiberAPIImpl<Options::MINIMAL_SAVE | Options::OS_API_SAFETY>::GetAPI();
+			case static_cast<unsigned>(Options::MINIMAL_SAVE | Options::PRESERVE_FPU_CONTROL): return FiberAPIImpl<Options::MINIMAL_SAVE | Options::PRESERVE_FPU_CONTROL>::GetAPI();
+			case static_cast<unsigned>(Options::MINIMAL_SAVE | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL): return FiberAPIImpl<Options::MINIMAL_SAVE | Options::OS_API_SAFETY | Options::PRESERVE_FPU_CONTROL>::GetAPI();
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
 		}
 
 		sanity(0 && "Unknown options");
@@ -2,6 +2,9 @@
 #define SAVE_TIB_STACK   USE_IF(USING(OS_WINDOWS) && OPT_OS_API_SAFETY)
 #define SAVE_TIB_SEH     USE_IF(USING(OS_WINDOWS) && USING(PROC_X86) && OPT_OS_API_SAFETY)
 #define SAVE_FPU_CONTROL USE_IF(OPT_PRESERVE_FPU_CONTROL)
+#define SAVE_CALLEE_REGS USE_IF(!OPT_MINIMAL_SAVE) // With minimal save, the caller's inline asm clobbers them instead
+#define SAVE_XMM_REGS    USE_IF(USING(OS_WINDOWS) && USING(SAVE_CALLEE_REGS))
+#define EMIT_UNWIND_INFO USE_IF(USING(OS_LINUX)) // For perf and friends. Windows would need RtlAddFunctionTable instead.
 
 private:
 #if USING(SAVE_TIB_SEH)
@@ -22,14 +25,27 @@ private:
 	static constexpr unsigned FPU_CONTROL_ENTRIES = 0;
 #endif //#else //#if USING(SAVE_FPU_CONTROL)
 
+#if USING(SAVE_CALLEE_REGS)
+	static constexpr unsigned SAVED_CPU_REG_COUNT = CPU_REG_COUNT;
+#else //#if USING(SAVE_CALLEE_REGS)
+	static constexpr unsigned SAVED_CPU_REG_COUNT = 1; // rbp, which can't be clobbered while it's the frame pointer
+#endif //#else //#if USING(SAVE_CALLEE_REGS)
+
+#if USING(SAVE_XMM_REGS)
+	static constexpr unsigned SAVED_FPU_REG_COUNT = FPU_REG_COUNT;
+#else //#if USING(SAVE_XMM_REGS)
+	static constexpr unsigned SAVED_FPU_REG_COUNT = 0;
+#endif //#else //#if USING(SAVE_XMM_REGS)
+
 	static constexpr uint32_t TIB_ENTRIES = TIB_SEH_ENTRIES + TIB_STACK_ENTRIES;
-	static constexpr uint32_t PUSH_ENTRIES = CPU_REG_COUNT + TIB_ENTRIES;
+	static constexpr uint32_t PUSH_ENTRIES = SAVED_CPU_REG_COUNT + TIB_ENTRIES;
 	static constexpr uint32_t PUSH_SIZE = PUSH_ENTRIES * CPU_REG_WIDTH;
 
 	static constexpr bool MOV_MISALIGNMENT = (PUSH_SIZE & (FPU_REG_WIDTH - 1)) == 0; // Stack grows down, so we need the fpu reg alignment to not divide equally into the current stack offset
 	static constexpr uint32_t MOV_FPU_CONTROL_SIZE = FPU_CONTROL_ENTRIES * 4;
-	static constexpr uint32_t MOV_FPU_SIZE_RAW = FPU_REG_COUNT * FPU_REG_WIDTH;
-	static constexpr uint32_t MOV_SIZE_RAW = (MOV_MISALIGNMENT ? std::max(MOV_FPU_CONTROL_SIZE, FPU_REG_WIDTH / CPU_REG_WIDTH) : MOV_FPU_CONTROL_SIZE) + MOV_FPU_SIZE_RAW;
+	static constexpr uint32_t MOV_FPU_SIZE_RAW = SAVED_FPU_REG_COUNT * FPU_REG_WIDTH;
+	static constexpr bool MOV_NEEDED = (MOV_FPU_CONTROL_SIZE + MOV_FPU_SIZE_RAW) != 0; // Linux has no callee saved xmm registers, so without the fpu control there's nothing to move
+	static constexpr uint32_t MOV_SIZE_RAW = MOV_NEEDED ? (MOV_MISALIGNMENT ? std::max(MOV_FPU_CONTROL_SIZE, FPU_REG_WIDTH / CPU_REG_WIDTH) : MOV_FPU_CONTROL_SIZE) + MOV_FPU_SIZE_RAW : 0;
 	static constexpr uint32_t MOV_SIZE_ALIGNED = (MOV_SIZE_RAW + (STACK_ALIGN - 1)) & ~(STACK_ALIGN - 1);
 	static constexpr uint32_t FPU_CONTROL_POS = MOV_SIZE_ALIGNED - CPU_REG_WIDTH;
 
@@ -58,23 +74,25 @@ private:
 		0x65, 0xFF, 0x34, 0x25, 0x78, 0x14, 0x00, 0x00,    //push QWORD PTR gs:[1478h]
 		0x65, 0xFF, 0x34, 0x25, 0x48, 0x17, 0x00, 0x00,    //push QWORD PTR gs:[1748h]
 	#endif //#if USING(SAVE_TIB_STACK)					   
-	#if USING(OS_WINDOWS)								   
+	#if USING(OS_WINDOWS) && USING(SAVE_CALLEE_REGS)
 		0x56,                                              //push rsi
 		0x57,                                              //push rdi
-	#endif //#if USING(OS_WINDOWS)						   
+	#endif //#if USING(OS_WINDOWS) && USING(SAVE_CALLEE_REGS)
 		0x55,                                              //push rbp
+	#if USING(SAVE_CALLEE_REGS)
 		0x53,                                              //push rbx
 		0x41, 0x54,                                        //push r12
 		0x41, 0x55,                                        //push r13
 		0x41, 0x56,                                        //push r14
 		0x41, 0x57,                                        //push r15
-	#if USING(OS_WINDOWS) || USING(SAVE_FPU_CONTROL)
+	#endif //#if USING(SAVE_CALLEE_REGS)
+	#if USING(SAVE_XMM_REGS) || USING(SAVE_FPU_CONTROL)
 		0x48, 0x81, 0xEC, TO_BYTES(MOV_SIZE_ALIGNED),      //sub rsp, xmmRegSize; for xmm6 - xmm15
-	#endif //#if USING(OS_WINDOWS) || USING(SAVE_FPU_CONTROL)
+	#endif //#if USING(SAVE_XMM_REGS) || USING(SAVE_FPU_CONTROL)
 	#if USING(SAVE_FPU_CONTROL)
 		0x0F, 0xAE, 0x9C, 0x24, TO_BYTES(FPU_CONTROL_POS), //stmxcsr[rsp + A8h]
 	#endif //#if USING(SAVE_FPU_CONTROL)
-	#if USING(OS_WINDOWS)
+	#if USING(SAVE_XMM_REGS)
 		0x0F, 0x29, 0xB4, 0x24, 0x98, 0x00, 0x00, 0x00,    //movaps[rsp + 98h], xmm6
 		0x0F, 0x29, 0xBC, 0x24, 0x88, 0x00, 0x00, 0x00,    //movaps[rsp + 88h], xmm7
 		0x44, 0x0F, 0x29, 0x44, 0x24, 0x78,                //movaps[rsp + 78h], xmm8
@@ -85,24 +103,28 @@ private:
 		0x44, 0x0F, 0x29, 0x6C, 0x24, 0x28,                //movaps[rsp + 28h], xmm13
 		0x44, 0x0F, 0x29, 0x74, 0x24, 0x18,                //movaps[rsp + 18h], xmm14
 		0x44, 0x0F, 0x29, 0x7C, 0x24, 0x08,                //movaps[rsp + 08h], xmm15
-	#endif //#if USING(OS_WINDOWS)					       
+	#endif //#if USING(SAVE_XMM_REGS)					       
 		0xFF, 0xE0,                                        //jmp rax; return
 	};
 
 	static constexpr const uint8_t InitFiberASM[] = {
+	#if USING(OS_WINDOWS)
 		0x59,       //pop rcx; Startup userdata
+	#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		0x5F,       //pop rdi; Startup userdata
+	#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
 		0x58,       //pop rax; Startup function
 		0xFF, 0xD0, //call rax; Call the startup function.When it returns, it will hit EndFiber
 	};
 
 	static_assert(STACK_RESERVE_SIZE <= 0x7F, "Can't use a byte add. Need a word or dword add.");
 	static constexpr const uint8_t EndFiberASM[] = {
-		0x48, 0x83, 0xC4, B1(STACK_RESERVE_SIZE), //add rsp, stackReserve; Remove the shadow space
+		0x48, 0x83, 0xC4, B1(STACK_RESERVE_SIZE), //add rsp, stackReserve; Remove the shadow space (windows) and start placeholder alignment
 		0x5C,                                     //pop rsp
 	};
 
 	static constexpr const uint8_t LoadContextASM[] = {
-	#if USING(OS_WINDOWS)
+	#if USING(SAVE_XMM_REGS)
 		0x44, 0x0F, 0x28, 0x7C, 0x24, 0x08,                //movaps xmm15,[rsp + 08h]
 		0x44, 0x0F, 0x28, 0x74, 0x24, 0x18,                //movaps xmm14,[rsp + 18h]
 		0x44, 0x0F, 0x28, 0x6C, 0x24, 0x28,                //movaps xmm13,[rsp + 28h]
@@ -113,23 +135,25 @@ private:
 		0x44, 0x0F, 0x28, 0x44, 0x24, 0x78,                //movaps xmm8,[rsp + 78h]
 		0x0F, 0x28, 0xBC, 0x24, 0x88, 0x00, 0x00, 0x00,    //movaps xmm7,[rsp + 88h]
 		0x0F, 0x28, 0xB4, 0x24, 0x98, 0x00, 0x00, 0x00,    //movaps xmm6,[rsp + 98h]
-	#endif //#if USING(OS_WINDOWS)
+	#endif //#if USING(SAVE_XMM_REGS)
 	#if USING(SAVE_FPU_CONTROL)
 		0x0F, 0xAE, 0x94, 0x24, TO_BYTES(FPU_CONTROL_POS), //ldmxcsr [rsp + A8h]
 	#endif //# if USING(SAVE_FPU_CONTROL)
-	#if USING(OS_WINDOWS) || USING(SAVE_FPU_CONTROL)
+	#if USING(SAVE_XMM_REGS) || USING(SAVE_FPU_CONTROL)
 		0x48, 0x81, 0xC4, TO_BYTES(MOV_SIZE_ALIGNED),      //add rsp, stackRsrve
-	#endif //#if USING(OS_WINDOWS) || USING(SAVE_FPU_CONTROL)
+	#endif //#if USING(SAVE_XMM_REGS) || USING(SAVE_FPU_CONTROL)
+	#if USING(SAVE_CALLEE_REGS)
 		0x41, 0x5F,                                        //pop r15
 		0x41, 0x5E,                                        //pop r14
 		0x41, 0x5D,                                        //pop r13
 		0x41, 0x5C,                                        //pop r12
 		0x5B,                                              //pop rbx
+	#endif //#if USING(SAVE_CALLEE_REGS)
 		0x5D,                                              //pop rbp
-	#if USING(OS_WINDOWS)								   
+	#if USING(OS_WINDOWS) && USING(SAVE_CALLEE_REGS)
 		0x5F,                                              //pop rdi
 		0x5E,                                              //pop rsi
-	#endif //#if USING(OS_WINDOWS)
+	#endif //#if USING(OS_WINDOWS) && USING(SAVE_CALLEE_REGS)
 	#if USING(SAVE_TIB_STACK)
 		0x65, 0x8F, 0x04, 0x25, 0x48, 0x17, 0x00, 0x00,    //pop QWORD PTR gs:[1748h]
 		0x65, 0x8F, 0x04, 0x25, 0x78, 0x14, 0x00, 0x00,    //pop QWORD PTR gs:[1478h]
@@ -142,31 +166,101 @@ private:
 		0xC3,                                              //ret
 	};
 
-	// Order StoreContextASM, StartFiberASM, SwitchToFiberASM, InitFiberASM, EndFiberASM, LoadContextASM
+	// Order StoreContextASM, StartFiberASM, SwitchOnTopToFiberASM, SwitchWithValueToFiberASM, SwitchToFiberASM, InitFiberASM, EndFiberASM, LoadContextASM
+#if USING(OS_WINDOWS)
+	static constexpr uint32_t SwitchOnTopToFiberASM_Size = 33;
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+	static constexpr uint32_t SwitchOnTopToFiberASM_Size = 28;
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+	static constexpr uint32_t SwitchWithValueToFiberASM_Size = 16;
 	static constexpr uint32_t SwitchToFiberASM_Size = 13;
 	static constexpr uint32_t StoreContextASM_Offset = 0;
 	static constexpr uint32_t StartFiberASM_Offset = StoreContextASM_Offset + sizeof(StoreContextASM);
 
 	static constexpr uint32_t StartFiberASM_CallEnd_Offset = StartFiberASM_Offset + 5;
 	static constexpr uint32_t StartFiber_Call_StoreContext_Offset = static_cast<unsigned>(-static_cast<int>(StartFiberASM_CallEnd_Offset - StoreContextASM_Offset));
-	static constexpr uint32_t StartFiberASM_Jmp_LoadContext_Offset = SwitchToFiberASM_Size + sizeof(InitFiberASM) + sizeof(EndFiberASM);
+	static constexpr uint32_t StartFiberASM_Jmp_LoadContext_Offset = SwitchOnTopToFiberASM_Size + SwitchWithValueToFiberASM_Size + SwitchToFiberASM_Size + sizeof(InitFiberASM) + sizeof(EndFiberASM);
 	static_assert(StartFiberASM_Jmp_LoadContext_Offset <= 0x7F, "Jump won't fit in a byte jump (EB), needs to use a dword jump (E9) instead");
 	static constexpr const uint8_t StartFiberASM[] = {
 		0xE8, TO_BYTES(StartFiber_Call_StoreContext_Offset), //call StoreContext
+	#if USING(OS_WINDOWS)
 		0x48, 0x89, 0xA1, TO_BYTES(INIT_STACK_SIZE),         //mov[rcx + totalInitStackSize], rsp; Put current stack in initial fiber state
 		0x48, 0x89, 0xCC,                                    //mov rsp, rcx; Switch out to new stackframe
+	#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		0x48, 0x89, 0xA7, TO_BYTES(INIT_STACK_SIZE),         //mov[rdi + totalInitStackSize], rsp; Put current stack in initial fiber state
+		0x48, 0x89, 0xFC,                                    //mov rsp, rdi; Switch out to new stackframe
+	#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
 		0xEB, B1(StartFiberASM_Jmp_LoadContext_Offset),      //jmp LoadContext
 	};
 
-	static constexpr uint32_t SwitchToFiberASM_Offset = StartFiberASM_Offset + sizeof(StartFiberASM);
+	// Calls onTop(arg) on the destination stack, under its saved context, before loading that context.
+	// Minimal save contexts are saved wherever the caller's inline asm left the stack, so the stack is
+	// realigned for the call. rbx is free to hold the saved context's stack pointer: the current fiber's
+	// rbx is already saved (or clobbered) and the destination's is restored by LoadContext.
+	static constexpr uint32_t SwitchOnTopToFiberASM_Offset = StartFiberASM_Offset + sizeof(StartFiberASM);
+	static constexpr uint32_t SwitchOnTopToFiberASM_CallEnd_Offset = SwitchOnTopToFiberASM_Offset + 5;
+	static constexpr uint32_t SwitchOnTopToFiber_Call_StoreContext_Offset = static_cast<unsigned>(-static_cast<int>(SwitchOnTopToFiberASM_CallEnd_Offset - StoreContextASM_Offset));
+	static constexpr uint32_t SwitchOnTopToFiberASM_Jmp_LoadContext_Offset = SwitchWithValueToFiberASM_Size + SwitchToFiberASM_Size + sizeof(InitFiberASM) + sizeof(EndFiberASM);
+	static_assert(SwitchOnTopToFiberASM_Jmp_LoadContext_Offset <= 0x7F, "Won't fit in byte jump (EB), needs dword jump (E9)");
+	static constexpr const uint8_t SwitchOnTopToFiberASM[] = {
+		0xE8, TO_BYTES(SwitchOnTopToFiber_Call_StoreContext_Offset), //call StoreContext
+	#if USING(OS_WINDOWS)
+		0x48, 0x89, 0x21,                                            //mov[rcx], rsp; Store the current stackframe
+		0x48, 0x8B, 0x22,                                            //mov rsp,[rdx]; Switch to the new stackframe
+		0x4C, 0x89, 0xC9,                                            //mov rcx, r9; onTop argument
+		0x48, 0x89, 0xE3,                                            //mov rbx, rsp
+		0x48, 0x83, 0xE4, 0xF0,                                      //and rsp, -16; Alignment
+		0x48, 0x83, 0xEC, 0x20,                                      //sub rsp, 20h; Shadow space
+		0x41, 0xFF, 0xD0,                                            //call r8; onTop(arg)
+	#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		0x48, 0x89, 0x27,                                            //mov[rdi], rsp; Store the current stackframe
+		0x48, 0x8B, 0x26,                                            //mov rsp,[rsi]; Switch to the new stackframe
+		0x48, 0x89, 0xCF,                                            //mov rdi, rcx; onTop argument
+		0x48, 0x89, 0xE3,                                            //mov rbx, rsp
+		0x48, 0x83, 0xE4, 0xF0,                                      //and rsp, -16; Alignment
+		0xFF, 0xD2,                                                  //call rdx; onTop(arg)
+	#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		0x48, 0x89, 0xDC,                                            //mov rsp, rbx
+		0xEB, B1(SwitchOnTopToFiberASM_Jmp_LoadContext_Offset),      //jmp LoadContext
+	};
+	static_assert(sizeof(SwitchOnTopToFiberASM) == SwitchOnTopToFiberASM_Size);
+
+	// The payload rides through StoreContext and LoadContext untouched in the third argument register, and
+	// is moved to rax after StoreContext (which clobbers rax) so the resumed SwitchWithValue call returns it.
+	static constexpr uint32_t SwitchWithValueToFiberASM_Offset = SwitchOnTopToFiberASM_Offset + sizeof(SwitchOnTopToFiberASM);
+	static constexpr uint32_t SwitchWithValueToFiberASM_CallEnd_Offset = SwitchWithValueToFiberASM_Offset + 5;
+	static constexpr uint32_t SwitchWithValueToFiber_Call_StoreContext_Offset = static_cast<unsigned>(-static_cast<int>(SwitchWithValueToFiberASM_CallEnd_Offset - StoreContextASM_Offset));
+	static constexpr uint32_t SwitchWithValueToFiberASM_Jmp_LoadContext_Offset = SwitchToFiberASM_Size + sizeof(InitFiberASM) + sizeof(EndFiberASM);
+	static_assert(SwitchWithValueToFiberASM_Jmp_LoadContext_Offset <= 0x7F, "Won't fit in byte jump (EB), needs dword jump (E9)");
+	static constexpr const uint8_t SwitchWithValueToFiberASM[] = {
+		0xE8, TO_BYTES(SwitchWithValueToFiber_Call_StoreContext_Offset), //call StoreContext
+	#if USING(OS_WINDOWS)
+		0x4C, 0x89, 0xC0,                                                //mov rax, r8; Payload is the return value of the resumed switch
+		0x48, 0x89, 0x21,                                                //mov[rcx], rsp; Store the current stackframe
+		0x48, 0x8B, 0x22,                                                //mov rsp,[rdx]; Switch to the new stackframe
+	#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		0x48, 0x89, 0xD0,                                                //mov rax, rdx; Payload is the return value of the resumed switch
+		0x48, 0x89, 0x27,                                                //mov[rdi], rsp; Store the current stackframe
+		0x48, 0x8B, 0x26,                                                //mov rsp,[rsi]; Switch to the new stackframe
+	#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		0xEB, B1(SwitchWithValueToFiberASM_Jmp_LoadContext_Offset),      //jmp LoadContext
+	};
+	static_assert(sizeof(SwitchWithValueToFiberASM) == SwitchWithValueToFiberASM_Size);
+
+	static constexpr uint32_t SwitchToFiberASM_Offset = SwitchWithValueToFiberASM_Offset + sizeof(SwitchWithValueToFiberASM);
 	static constexpr uint32_t SwitchToFiberASM_CallEnd_Offset = SwitchToFiberASM_Offset + 5;
 	static constexpr uint32_t SwitchToFiber_Call_StoreConetxt_Offset = static_cast<unsigned>(-static_cast<int>(SwitchToFiberASM_CallEnd_Offset - StoreContextASM_Offset));
 	static constexpr uint32_t SwitchToFiberASM_Jmp_LoadContext_Offset = sizeof(InitFiberASM) + sizeof(EndFiberASM);
 	static_assert(SwitchToFiberASM_Jmp_LoadContext_Offset <= 0x7F, "Won't fit in byte jump (EB), needs dword jump (E9)");
 	static constexpr const uint8_t SwitchToFiberASM[] = {
 		0xE8, TO_BYTES(SwitchToFiber_Call_StoreConetxt_Offset), //call StoreContext
+	#if USING(OS_WINDOWS)
 		0x48, 0x89, 0x21,                                       //mov[rcx], rsp; Store the current stackframe
 		0x48, 0x8B, 0x22,                                       //mov rsp,[rdx]; Switch to the new stackframe
+	#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		0x48, 0x89, 0x27,                                       //mov[rdi], rsp; Store the current stackframe
+		0x48, 0x8B, 0x26,                                       //mov rsp,[rsi]; Switch to the new stackframe
+	#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
 		0xEB, B1(SwitchToFiberASM_Jmp_LoadContext_Offset),      //jmp LoadContext
 	};
 	static_assert(sizeof(SwitchToFiberASM) == SwitchToFiberASM_Size);
@@ -174,11 +268,13 @@ private:
 	static constexpr uint32_t InitFiberASM_Offset = SwitchToFiberASM_Offset + sizeof(SwitchToFiberASM);
 
 	CODE_SEG_START
-	static constexpr CODE_SEG_ATTR auto ASMBlob = concat_arrays(StoreContextASM, StartFiberASM, SwitchToFiberASM, InitFiberASM, EndFiberASM, LoadContextASM); // This concat order is important and cannot change.
+	static constexpr CODE_SEG_ATTR auto ASMBlob = concat_arrays(StoreContextASM, StartFiberASM, SwitchOnTopToFiberASM, SwitchWithValueToFiberASM, SwitchToFiberASM, InitFiberASM, EndFiberASM, LoadContextASM); // This concat order is important and cannot change.
 
 public:
 	static inline StartASMProc* const StartASM = reinterpret_cast<StartASMProc*>(ASMBlob.data() + StartFiberASM_Offset);
 	static inline SwitchASMProc* const SwitchFiberASM = reinterpret_cast<SwitchASMProc*>(ASMBlob.data() + SwitchToFiberASM_Offset);
+	static inline SwitchOnTopASMProc* const SwitchOnTopFiberASM = reinterpret_cast<SwitchOnTopASMProc*>(ASMBlob.data() + SwitchOnTopToFiberASM_Offset);
+	static inline SwitchWithValueASMProc* const SwitchWithValueFiberASM = reinterpret_cast<SwitchWithValueASMProc*>(ASMBlob.data() + SwitchWithValueToFiberASM_Offset);
 
 	static uintptr_t* InitStackRegisters(uintptr_t* const spBase, void(*StartAddress)(void*), void* userData, size_t stackSize, size_t committedStackSize)
 	{
@@ -210,8 +306,8 @@ public:
 		((void)committedStackSize);
 #endif //#else //#if USING(SAVE_TIB_STACK)
 
-		sp -= CPU_REG_COUNT;
-		memset(sp, 0, CPU_REG_COUNT * sizeof(*sp));
+		sp -= SAVED_CPU_REG_COUNT;
+		memset(sp, 0, SAVED_CPU_REG_COUNT * sizeof(*sp));
 
 		size_t fpuEntries = MOV_SIZE_ALIGNED / sizeof(*sp);
 #if USING(SAVE_FPU_CONTROL)
@@ -225,7 +321,140 @@ public:
 		return sp;
 	}
 
+#if USING(EMIT_UNWIND_INFO)
+private:
+	// Which variant this is, for the symbol names
+	static constexpr unsigned OPTIONS_ID = 0
+	#if OPT_OS_API_SAFETY
+		| 1u
+	#endif //#if OPT_OS_API_SAFETY
+	#if OPT_PRESERVE_FPU_CONTROL
+		| 2u
+	#endif //#if OPT_PRESERVE_FPU_CONTROL
+	#if OPT_MINIMAL_SAVE
+		| 4u
+	#endif //#if OPT_MINIMAL_SAVE
+		;
+	static constexpr uint32_t CONTEXT_CFA = CPU_REG_WIDTH + PUSH_SIZE + MOV_SIZE_ALIGNED; // Saved sp to the caller's frame
+	static constexpr uint32_t LoadContextASM_Offset = InitFiberASM_Offset + sizeof(InitFiberASM) + sizeof(EndFiberASM);
+	static_assert(LoadContextASM_Offset + sizeof(LoadContextASM) == sizeof(ASMBlob));
+	static_assert(SwitchOnTopToFiberASM_Size == 28, "SwitchOnTop unwind rules assume the linux stub layout");
+
+	/* The blob is data as far as the toolchain knows, so profilers and debuggers can neither name it
+	*  nor unwind through it. This gives each stub a function symbol, and hand writes the .eh_frame
+	*  entries the assembler would have made from .cfi directives. Samples inside a switch unwind
+	*  through whichever context is on the stack at the time. InitFiber and EndFiber, along with the
+	*  last byte before InitFiber, mark the return address undefined, which ends the chain at the
+	*  fiber's root. The initial context's return address is InitFiber, so an unwinder looking up
+	*  the byte before it stops there too. Frame pointer unwinders already stop, the initial rbp is 0.
+	*/
+	__attribute__((used)) static void EmitUnwindInfo()
+	{
+	#if USING(SAVE_CALLEE_REGS)
+	# define FIBER_CFI_SAVED_REGS ".byte 0x86, 2, 0x83, 3, 0x8c, 4, 0x8d, 5, 0x8e, 6, 0x8f, 7\n\t"                      /* rbp, rbx, r12-r15 at cfa-16 down */
+	# define FIBER_CFI_PUSHES     ".byte 0x41, 0x0e, 16, 0x86, 2, 0x41, 0x0e, 24, 0x83, 3, 0x42, 0x0e, 32, 0x8c, 4\n\t" \
+	                              ".byte 0x42, 0x0e, 40, 0x8d, 5, 0x42, 0x0e, 48, 0x8e, 6, 0x42, 0x0e, 56, 0x8f, 7\n\t"
+	# define FIBER_CFI_POPS       ".byte 0x42, 0x0e, 48, 0xcf, 0x42, 0x0e, 40, 0xce, 0x42, 0x0e, 32, 0xcd\n\t"              \
+	                              ".byte 0x42, 0x0e, 24, 0xcc, 0x41, 0x0e, 16, 0xc3, 0x41, 0x0e, 8, 0xc6\n\t"
+	#else //#if USING(SAVE_CALLEE_REGS)
+	# define FIBER_CFI_SAVED_REGS ".byte 0x86, 2\n\t"
+	# define FIBER_CFI_PUSHES     ".byte 0x41, 0x0e, 16, 0x86, 2\n\t"
+	# define FIBER_CFI_POPS       ".byte 0x41, 0x0e, 8, 0xc6\n\t"
+	#endif //#else //#if USING(SAVE_CALLEE_REGS)
+	#if USING(SAVE_FPU_CONTROL)
+	# define FIBER_CFI_FPU_SUB    ".byte 0x47, 0x0e\n\t.uleb128 %c1\n\t"              /* after sub rsp */
+	# define FIBER_CFI_FPU_ADD    ".byte 0x50, 0x0e\n\t.uleb128 %c1 - %c2\n\t"        /* after ldmxcsr, add rsp */
+	#else //#if USING(SAVE_FPU_CONTROL)
+	# define FIBER_CFI_FPU_SUB
+	# define FIBER_CFI_FPU_ADD
+	#endif //#else //#if USING(SAVE_FPU_CONTROL)
+
+	// The CIE starts out as at a call: cfa = rsp + 8, return address at cfa - 8
+	#define FIBER_FUNC(NAME, BEGIN, END)                       \
+		".set fiber_" NAME "_opts%c3, %c0 + " BEGIN "\n\t"      \
+		".type fiber_" NAME "_opts%c3, @function\n\t"           \
+		".size fiber_" NAME "_opts%c3, " END " - " BEGIN "\n\t"
+	#define FIBER_FDE(NAME, BEGIN, END, PROGRAM)                                \
+		".long .Lfiber_fde_end_" NAME "%= - .Lfiber_fde_" NAME "%=\n"            \
+		".Lfiber_fde_" NAME "%=:\n\t"                                            \
+		".long .Lfiber_fde_" NAME "%= - .Lfiber_cie%=\n\t"                       \
+		".long %c0 + " BEGIN " - .\n\t"                                          \
+		".long " END " - " BEGIN "\n\t"                                          \
+		".uleb128 0\n\t"                                                         \
+		PROGRAM                                                                  \
+		".balign 8\n"                                                            \
+		".Lfiber_fde_end_" NAME "%=:\n\t"
+
+		__asm__(
+			FIBER_FUNC("store_context", "0", "%c4")
+			FIBER_FUNC("start", "%c4", "%c5")
+			FIBER_FUNC("switch_on_top", "%c5", "%c6")
+			FIBER_FUNC("switch_with_value", "%c6", "%c7")
+			FIBER_FUNC("switch", "%c7", "%c8")
+			FIBER_FUNC("init", "%c8", "%c9")
+			FIBER_FUNC("load_context", "%c9", "%c10")
+
+			".pushsection .eh_frame, \"a\", @unwind\n"
+			".Lfiber_cie%=:\n\t"
+			".long .Lfiber_cie_end%= - .Lfiber_cie_id%=\n"
+			".Lfiber_cie_id%=:\n\t"
+			".long 0\n\t"
+			".byte 1\n\t"                        // version
+			".string \"zR\"\n\t"
+			".uleb128 1\n\t"                     // code alignment
+			".sleb128 -8\n\t"                    // data alignment
+			".uleb128 16\n\t"                    // return address column, rip
+			".uleb128 1\n\t"
+			".byte 0x1b\n\t"                     // pc relative sdata4 addresses
+			".byte 0x0c, 7, 8, 0x90, 1\n\t"      // def_cfa rsp, 8; offset rip, cfa-8
+			".balign 8\n"
+			".Lfiber_cie_end%=:\n\t"
+
+			// Called from a stub, pops that return address then pushes the context
+			FIBER_FDE("store_context", "0", "%c4",
+				".byte 0x0e, 16, 0x41, 0x0e, 8\n\t"
+				FIBER_CFI_PUSHES
+				FIBER_CFI_FPU_SUB)
+			// Every switch stub has the context stored after the call, and from the stack switch on it's the destination's
+			FIBER_FDE("start", "%c4", "%c5",
+				".byte 0x45, 0x0e\n\t.uleb128 %c1\n\t"
+				FIBER_CFI_SAVED_REGS)
+			FIBER_FDE("switch_on_top", "%c5", "%c6",
+				".byte 0x45, 0x0e\n\t.uleb128 %c1\n\t"
+				FIBER_CFI_SAVED_REGS
+				".byte 0x4c, 0x0d, 3, 0x49, 0x0d, 7\n\t") // cfa off rbx across the realigned onTop call
+			FIBER_FDE("switch_with_value", "%c6", "%c7",
+				".byte 0x45, 0x0e\n\t.uleb128 %c1\n\t"
+				FIBER_CFI_SAVED_REGS)
+			FIBER_FDE("switch", "%c7", "%c8 - 1",
+				".byte 0x45, 0x0e\n\t.uleb128 %c1\n\t"
+				FIBER_CFI_SAVED_REGS)
+			FIBER_FDE("root", "%c8 - 1", "%c9",
+				".byte 0x07, 16\n\t")                     // undefined rip, end of the chain
+			FIBER_FDE("load_context", "%c9", "%c10",
+				".byte 0x0e\n\t.uleb128 %c1\n\t"
+				FIBER_CFI_SAVED_REGS
+				FIBER_CFI_FPU_ADD
+				FIBER_CFI_POPS)
+			".popsection\n\t"
+			:
+			: "i"(ASMBlob.data()), "i"(CONTEXT_CFA), "i"(CONTEXT_CFA - CPU_REG_WIDTH - PUSH_SIZE), "i"(OPTIONS_ID),
+			  "i"(StartFiberASM_Offset), "i"(SwitchOnTopToFiberASM_Offset), "i"(SwitchWithValueToFiberASM_Offset), "i"(SwitchToFiberASM_Offset),
+			  "i"(InitFiberASM_Offset), "i"(LoadContextASM_Offset), "i"(sizeof(ASMBlob)));
+
+	#undef FIBER_FDE
+	#undef FIBER_FUNC
+	#undef FIBER_CFI_FPU_ADD
+	#undef FIBER_CFI_FPU_SUB
+	#undef FIBER_CFI_POPS
+	#undef FIBER_CFI_PUSHES
+	#undef FIBER_CFI_SAVED_REGS
+	}
+#endif //#if USING(EMIT_UNWIND_INFO)
 
 #undef SAVE_TIB_STACK 
 #undef SAVE_TIB_SEH   
-#undef SAVE_FPU_CONTROL
\ No newline at end of file
+#undef SAVE_FPU_CONTROL
+#undef SAVE_CALLEE_REGS
+#undef SAVE_XMM_REGS
+#undef EMIT_UNWIND_INFO
\ No newline at end of file
@@ -1,11 +1,69 @@
+#include "platform.h"
 #include "../fiber/fiber.h"
 #include <cstdio>
-#define WIN32_LEAN_AND_MEAN
-#define NOMINMAX
-#include <Windows.h>
+#include <cstring>
+#if USING(OS_WINDOWS)
+# define WIN32_LEAN_AND_MEAN
+# define NOMINMAX
+# include <Windows.h>
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+# include <sys/mman.h>
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+
+// Pinning values to callee saved registers needs GNU style register variables
+#if defined(__GNUC__) && USING(PROC_X64)
+# define FIBER_TEST_REGISTERS 1
+# include <cstdint>
+# include <emmintrin.h>
+#else //#if defined(__GNUC__) && USING(PROC_X64)
+# define FIBER_TEST_REGISTERS 0
+#endif //#else //#if defined(__GNUC__) && USING(PROC_X64)
+
+// The switch bytecode only carries unwind info on linux
+#if USING(OS_LINUX)
+# define FIBER_TEST_UNWIND 1
+# include <unwind.h>
+#else //#if USING(OS_LINUX)
+# define FIBER_TEST_UNWIND 0
+#endif //#else //#if USING(OS_LINUX)
+
 
 fiber::FiberAPI s_fiberAPI;
 
+// Wraps the runtime api so the tests can be run against both it and fiber::Api<Opts>
+struct RuntimeApi
+{
+	static fiber::Fiber* Create(void* stack, size_t stackSize, size_t commitedStackSize, fiber::FiberFunc startAddress, void* userData)
+	{
+		return s_fiberAPI.Create(stack, stackSize, commitedStackSize, startAddress, userData);
+	}
+
+	static void CreateMany(void* stacks, size_t stackStride, size_t count, size_t stackSize, size_t commitedStackSize, fiber::FiberFunc startAddress, void* const* userData, fiber::Fiber** outFibers)
+	{
+		s_fiberAPI.CreateMany(stacks, stackStride, count, stackSize, commitedStackSize, startAddress, userData, outFibers);
+	}
+
+	static void Start(fiber::Fiber* toFiber)
+	{
+		s_fiberAPI.Start(toFiber);
+	}
+
+	static void Switch(fiber::Fiber* curFiber, fiber::Fiber* toFiber)
+	{
+		s_fiberAPI.Switch(curFiber, toFiber);
+	}
+
+	static void* SwitchWithValue(fiber::Fiber* curFiber, fiber::Fiber* toFiber, void* payload)
+	{
+		return s_fiberAPI.SwitchWithValue(curFiber, toFiber, payload);
+	}
+
+	static void SwitchOnTop(fiber::Fiber* curFiber, fiber::Fiber* toFiber, fiber::FiberFunc onTop, void* arg)
+	{
+		s_fiberAPI.SwitchOnTop(curFiber, toFiber, onTop, arg);
+	}
+};
+
 struct FiberData
 {
 	unsigned numFibers;
@@ -13,73 +71,951 @@ struct FiberData
 	unsigned value;
 };
 
+static char s_trace[64];
+static unsigned s_traceLen;
+
+static void TraceChar(char c)
+{
+	s_trace[s_traceLen++] = c;
+	s_trace[s_traceLen] = '\0';
+}
+
+static void Trace(const char* funcName, unsigned value)
+{
+	printf("In %s with fiberIndex %u\n", funcName, value);
+
+	TraceChar(static_cast<char>('0' + value));
+}
+
+template<typename API>
 static void Func1(void* dataPtr)
 {
 	const FiberData* const data = reinterpret_cast<FiberData*>(dataPtr);
 
-	printf("In func1 with fiberIndex %u\n", data->value);
-	s_fiberAPI.Switch(data->fibers[0], data->fibers[1]);
-	printf("In func1 with fiberIndex %u\n", data->value);
-	s_fiberAPI.Switch(data->fibers[0], data->fibers[3]);
+	Trace("func1", data->value);
+	API::Switch(data->fibers[0], data->fibers[1]);
+	Trace("func1", data->value);
+	API::Switch(data->fibers[0], data->fibers[3]);
 }
 
+template<typename API>
 static void Func2(void* dataPtr)
 {
 	const FiberData* const data = reinterpret_cast<FiberData*>(dataPtr);
 
-	printf("In func2 with fiberIndex %u\n", data->value);
-	s_fiberAPI.Switch(data->fibers[1], data->fibers[2]);
-	printf("In func2 with fiberIndex %u\n", data->value);
+	Trace("func2", data->value);
+	API::Switch(data->fibers[1], data->fibers[2]);
+	Trace("func2", data->value);
 }
 
+template<typename API>
 static void Func3(void* dataPtr)
 {
 	const FiberData* const data = reinterpret_cast<FiberData*>(dataPtr);
 
-	printf("In func3 with fiberIndex %u\n", data->value);
-	s_fiberAPI.Switch(data->fibers[2], data->fibers[0]);
+	Trace("func3", data->value);
+	API::Switch(data->fibers[2], data->fibers[0]);
 }
 
+template<typename API>
 static void Func4(void* dataPtr)
 {
 	const FiberData* const data = reinterpret_cast<FiberData*>(dataPtr);
 
-	printf("In func4 with fiberIndex %u\n", data->value);
+	Trace("func4", data->value);
 }
 
-int main()
+// Runs Func1 to Func4 by value, so one batch of fibers can play every part of the chain
+template<typename API>
+static void ChainFunc(void* dataPtr)
+{
+	static const fiber::FiberFunc s_chainFuncs[] = { Func1<API>, Func2<API>, Func3<API>, Func4<API> };
+
+	s_chainFuncs[reinterpret_cast<FiberData*>(dataPtr)->value - 1](dataPtr);
+}
+
+static void* ReserveStack(size_t size)
+{
+#if USING(OS_WINDOWS)
+	return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+	return mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+}
+
+static void CommitStack(void* mem, size_t size)
+{
+#if USING(OS_WINDOWS)
+	VirtualAlloc(mem, size, MEM_COMMIT, PAGE_READWRITE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+	mprotect(mem, size, PROT_READ | PROT_WRITE);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+}
+
+static void ReleaseStack(void* mem, size_t size)
+{
+#if USING(OS_WINDOWS)
+	((void)size);
+	VirtualFree(mem, 0, MEM_RELEASE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+	munmap(mem, size);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+}
+
+template<fiber::Options Opts, typename API>
+static bool RunTest(const char* optsName)
 {
 	constexpr unsigned pageSize = 4 * 1024;
 	constexpr unsigned stackSize = pageSize * 4;
-	fiber::FiberFunc fiberFuncs[] = { Func1, Func2, Func3, Func4 };
+	fiber::FiberFunc fiberFuncs[] = { Func1<API>, Func2<API>, Func3<API>, Func4<API> };
 	constexpr unsigned numFibers = sizeof(fiberFuncs) / sizeof(fiberFuncs[0]);
 	void* stackMemBase[numFibers];
 	void* stackBase[numFibers];
-	void* stackCeil[numFibers];
 	fiber::Fiber *fibers[numFibers];
 	FiberData data[numFibers];
 
-	s_fiberAPI = fiber::GetAPI(fiber::Options::OS_API_SAFETY | fiber::Options::PRESERVE_FPU_CONTROL);
+	printf("Options: %s\n", optsName);
+
+	s_traceLen = 0;
 
 	for (unsigned fiberIndex = 0; fiberIndex < numFibers; ++fiberIndex)
 	{
 		// Protection from underflows and overflows
-		stackMemBase[fiberIndex] = VirtualAlloc(nullptr, stackSize + pageSize * 2, MEM_RESERVE, PAGE_NOACCESS);
+		stackMemBase[fiberIndex] = ReserveStack(stackSize + pageSize * 2);
 		stackBase[fiberIndex] = reinterpret_cast<uint8_t*>(stackMemBase[fiberIndex]) + pageSize;
-		stackCeil[fiberIndex] = reinterpret_cast<uint8_t*>(stackBase[fiberIndex]) + stackSize;
 
-		VirtualAlloc(stackBase[fiberIndex], stackSize, MEM_COMMIT, PAGE_READWRITE);
+		CommitStack(stackBase[fiberIndex], stackSize);
 
 		data[fiberIndex].numFibers = numFibers;
 		data[fiberIndex].fibers = fibers;
 		data[fiberIndex].value = fiberIndex + 1;
 
-		fibers[fiberIndex] = s_fiberAPI.Create(stackBase[fiberIndex], stackSize, 0, fiberFuncs[fiberIndex], &data[fiberIndex]);
+		fibers[fiberIndex] = API::Create(stackBase[fiberIndex], stackSize, 0, fiberFuncs[fiberIndex], &data[fiberIndex]);
 	}
-	
-	s_fiberAPI.Start(fibers[0]);
+
+	API::Start(fibers[0]);
 
 	printf("Back to main\n");
 
-	return 0;
+	for (unsigned fiberIndex = 0; fiberIndex < numFibers; ++fiberIndex)
+	{
+		if constexpr (!!(Opts & fiber::Options::SHARED_STACK))
+		{
+			fiber::DestroySharedStackFiber(fibers[fiberIndex]);
+		}
+
+		ReleaseStack(stackMemBase[fiberIndex], stackSize + pageSize * 2);
+	}
+
+	static const char expectedTrace[] = "12314";
+	const bool passed = strcmp(s_trace, expectedTrace) == 0;
+
+	printf("%s: trace %s, expected %s\n\n", passed ? "PASSED" : "FAILED", s_trace, expectedTrace);
+
+	return passed;
+}
+
+struct ValueData
+{
+	fiber::Fiber* driver;
+	fiber::Fiber* generator;
+	unsigned mismatches;
+};
+
+static constexpr uintptr_t VALUE_ROUNDS = 5;
+
+// Doubles every payload it's handed and sends it back
+template<typename API>
+static void ValueGenerator(void* dataPtr)
+{
+	const ValueData* const data = reinterpret_cast<ValueData*>(dataPtr);
+	uintptr_t value = 0;
+
+	for (;;)
+	{
+		value = reinterpret_cast<uintptr_t>(API::SwitchWithValue(data->generator, data->driver, reinterpret_cast<void*>(value * 2)));
+	}
+}
+
+template<typename API>
+static void ValueDriver(void* dataPtr)
+{
+	ValueData* const data = reinterpret_cast<ValueData*>(dataPtr);
+
+	// First switch starts the generator, which gets its userData rather than a payload
+	if (API::SwitchWithValue(data->driver, data->generator, nullptr) != nullptr)
+	{
+		++data->mismatches;
+	}
+
+	for (uintptr_t round = 1; round <= VALUE_ROUNDS; ++round)
+	{
+		const uintptr_t doubled = reinterpret_cast<uintptr_t>(API::SwitchWithValue(data->driver, data->generator, reinterpret_cast<void*>(round)));
+
+		printf("Sent %u, got back %u\n", static_cast<unsigned>(round), static_cast<unsigned>(doubled));
+
+		if (doubled != round * 2)
+		{
+			++data->mismatches;
+		}
+	}
+}
+
+template<fiber::Options Opts, typename API>
+static bool RunValueTest(const char* optsName)
+{
+	constexpr unsigned pageSize = 4 * 1024;
+	constexpr unsigned stackSize = pageSize * 4;
+	ValueData data{ nullptr, nullptr, 0 };
+	void* const driverMem = ReserveStack(stackSize + pageSize * 2);
+	void* const generatorMem = ReserveStack(stackSize + pageSize * 2);
+	void* const driverStack = reinterpret_cast<uint8_t*>(driverMem) + pageSize;
+	void* const generatorStack = reinterpret_cast<uint8_t*>(generatorMem) + pageSize;
+
+	printf("Switch with value, options: %s\n", optsName);
+
+	CommitStack(driverStack, stackSize);
+	CommitStack(generatorStack, stackSize);
+
+	data.driver = API::Create(driverStack, stackSize, 0, ValueDriver<API>, &data);
+	data.generator = API::Create(generatorStack, stackSize, 0, ValueGenerator<API>, &data);
+
+	API::Start(data.driver);
+
+	// The generator never returns, it's left switched out
+	if constexpr (!!(Opts & fiber::Options::SHARED_STACK))
+	{
+		fiber::DestroySharedStackFiber(data.driver);
+		fiber::DestroySharedStackFiber(data.generator);
+	}
+
+	ReleaseStack(driverMem, stackSize + pageSize * 2);
+	ReleaseStack(generatorMem, stackSize + pageSize * 2);
+
+	const bool passed = data.mismatches == 0;
+
+	printf("%s: %u mismatched payloads\n\n", passed ? "PASSED" : "FAILED", data.mismatches);
+
+	return passed;
+}
+
+struct OnTopData
+{
+	fiber::Fiber* first;
+	fiber::Fiber* second;
+	const uint8_t* secondStackLo;
+	const uint8_t* secondStackHi;
+	bool ranOnSecondStack;
+};
+
+static void OnTop(void* dataPtr)
+{
+	OnTopData* const data = reinterpret_cast<OnTopData*>(dataPtr);
+	const uint8_t local = 0;
+
+	printf("On top of second fiber\n");
+	TraceChar('t');
+
+	data->ranOnSecondStack = &local >= data->secondStackLo && &local < data->secondStackHi;
+}
+
+template<typename API>
+static void OnTopFirst(void* dataPtr)
+{
+	OnTopData* const data = reinterpret_cast<OnTopData*>(dataPtr);
+
+	TraceChar('a');
+	API::Switch(data->first, data->second);
+	API::SwitchOnTop(data->first, data->second, OnTop, data);
+}
+
+template<typename API>
+static void OnTopSecond(void* dataPtr)
+{
+	OnTopData* const data = reinterpret_cast<OnTopData*>(dataPtr);
+
+	TraceChar('b');
+	API::Switch(data->second, data->first);
+	TraceChar('B');
+}
+
+template<fiber::Options Opts, typename API>
+static bool RunOnTopTest(const char* optsName)
+{
+	constexpr unsigned pageSize = 4 * 1024;
+	constexpr unsigned stackSize = pageSize * 4;
+	void* const firstMem = ReserveStack(stackSize + pageSize * 2);
+	void* const secondMem = ReserveStack(stackSize + pageSize * 2);
+	uint8_t* const firstStack = reinterpret_cast<uint8_t*>(firstMem) + pageSize;
+	uint8_t* const secondStack = reinterpret_cast<uint8_t*>(secondMem) + pageSize;
+	OnTopData data{ nullptr, nullptr, secondStack, secondStack + stackSize, false };
+
+	printf("Switch on top, options: %s\n", optsName);
+
+	CommitStack(firstStack, stackSize);
+	CommitStack(secondStack, stackSize);
+
+	data.first = API::Create(firstStack, stackSize, 0, OnTopFirst<API>, &data);
+	data.second = API::Create(secondStack, stackSize, 0, OnTopSecond<API>, &data);
+
+	s_traceLen = 0;
+	API::Start(data.first);
+
+	if constexpr (!!(Opts & fiber::Options::SHARED_STACK))
+	{
+		fiber::DestroySharedStackFiber(data.first);
+		fiber::DestroySharedStackFiber(data.second);
+	}
+
+	ReleaseStack(firstMem, stackSize + pageSize * 2);
+	ReleaseStack(secondMem, stackSize + pageSize * 2);
+
+	static const char expectedTrace[] = "abtB";
+	const bool passed = strcmp(s_trace, expectedTrace) == 0 && data.ranOnSecondStack;
+
+	printf("%s: trace %s, expected %s, %s the second fiber's stack\n\n", passed ? "PASSED" : "FAILED", s_trace, expectedTrace, data.ranOnSecondStack ? "ran on" : "did not run on");
+
+	return passed;
+}
+
+static constexpr size_t STACK_PROFILE_DEPTH = 8 * 1024;
+
+static void DeepStack(void*)
+{
+	volatile uint8_t deep[STACK_PROFILE_DEPTH];
+
+	for (size_t index = 0; index < STACK_PROFILE_DEPTH; ++index)
+	{
+		deep[index] = static_cast<uint8_t>(index);
+	}
+
+	TraceChar(deep[0] == 0 ? 'd' : '?');
+}
+
+static void ShallowStack(void*)
+{
+	TraceChar('s');
+}
+
+template<typename API>
+static bool RunStackProfileTest(const char* optsName)
+{
+	constexpr unsigned pageSize = 4 * 1024;
+	constexpr unsigned stackSize = pageSize * 4;
+	constexpr size_t paintSize = stackSize - pageSize;
+	constexpr size_t slack = 1024; // Frames around the measured function
+	void* const deepMem = ReserveStack(stackSize + pageSize * 2);
+	void* const shallowMem = ReserveStack(stackSize + pageSize * 2);
+	uint8_t* const deepStack = reinterpret_cast<uint8_t*>(deepMem) + pageSize;
+	uint8_t* const shallowStack = reinterpret_cast<uint8_t*>(shallowMem) + pageSize;
+
+	printf("Stack high water mark, options: %s\n", optsName);
+
+	CommitStack(deepStack, stackSize);
+	CommitStack(shallowStack, stackSize);
+
+	fiber::Fiber* const deepFiber = API::Create(deepStack, stackSize, 0, DeepStack, nullptr);
+	fiber::Fiber* const shallowFiber = API::Create(shallowStack, stackSize, 0, ShallowStack, nullptr);
+
+	fiber::PaintStack(deepFiber, paintSize);
+	fiber::PaintStack(shallowFiber, paintSize);
+
+	const size_t unusedDepth = fiber::GetStackHighWaterMark(deepFiber, paintSize);
+
+	s_traceLen = 0;
+	API::Start(deepFiber);
+	API::Start(shallowFiber);
+
+	const size_t deepDepth = fiber::GetStackHighWaterMark(deepFiber, paintSize);
+	const size_t shallowDepth = fiber::GetStackHighWaterMark(shallowFiber, paintSize);
+
+	ReleaseStack(deepMem, stackSize + pageSize * 2);
+	ReleaseStack(shallowMem, stackSize + pageSize * 2);
+
+	const bool passed = unusedDepth < slack && deepDepth >= STACK_PROFILE_DEPTH && deepDepth < STACK_PROFILE_DEPTH + slack && shallowDepth < slack;
+
+	printf("%s: unused %zu bytes, deep %zu bytes (expected %zu to %zu), shallow %zu bytes\n\n", passed ? "PASSED" : "FAILED", unusedDepth, deepDepth, STACK_PROFILE_DEPTH, STACK_PROFILE_DEPTH + slack, shallowDepth);
+
+	return passed;
+}
+
+#if FIBER_TEST_UNWIND
+// One _Unwind_Backtrace from inside a fiber, counting the frames found below the fiber's own function
+struct UnwindWalk
+{
+	uintptr_t fiberFunc;
+	bool reachedFiberFunc;
+	unsigned framesBelow;
+	bool reachedRoot; // Ended on the undefined return address InitFiber's unwind info gives
+	_Unwind_Reason_Code result;
+};
+
+struct UnwindData
+{
+	fiber::Fiber* first;
+	fiber::Fiber* second;
+	UnwindWalk walks[3]; // First fiber from Start, second fiber from Start, first fiber switched back to
+};
+
+static _Unwind_Reason_Code VisitFrame(_Unwind_Context* context, void* walkPtr)
+{
+	UnwindWalk* const walk = reinterpret_cast<UnwindWalk*>(walkPtr);
+
+	if (_Unwind_GetIP(context) == 0)
+	{
+		walk->reachedRoot = true;
+	}
+	else if (walk->reachedFiberFunc)
+	{
+		++walk->framesBelow;
+	}
+	else
+	{
+		walk->reachedFiberFunc = _Unwind_GetRegionStart(context) == walk->fiberFunc;
+	}
+
+	return _URC_NO_REASON;
+}
+
+__attribute__((noinline)) static void WalkStack(UnwindWalk* walk)
+{
+	walk->result = _Unwind_Backtrace(VisitFrame, walk);
+}
+
+template<typename API>
+static void UnwindFirst(void* dataPtr)
+{
+	UnwindData* const data = reinterpret_cast<UnwindData*>(dataPtr);
+
+	WalkStack(&data->walks[0]);
+	API::Switch(data->first, data->second);
+	WalkStack(&data->walks[2]);
+	TraceChar('a'); // Keeps the last walk from being a tail call, which would take this frame off the stack
+}
+
+template<typename API>
+static void UnwindSecond(void* dataPtr)
+{
+	UnwindData* const data = reinterpret_cast<UnwindData*>(dataPtr);
+
+	WalkStack(&data->walks[1]);
+	API::Switch(data->second, data->first);
+}
+
+// Every walk from inside a fiber has to get past the fiber function into the bytecode's InitFiber, and end there.
+// Without unwind info for the bytecode, the walk still stops, but on the bytecode frame it can't step out of.
+template<fiber::Options Opts, typename API>
+static bool RunUnwindTest(const char* optsName)
+{
+	constexpr unsigned pageSize = 4 * 1024;
+	constexpr unsigned stackSize = pageSize * 4;
+	void* const firstMem = ReserveStack(stackSize + pageSize * 2);
+	void* const secondMem = ReserveStack(stackSize + pageSize * 2);
+	uint8_t* const firstStack = reinterpret_cast<uint8_t*>(firstMem) + pageSize;
+	uint8_t* const secondStack = reinterpret_cast<uint8_t*>(secondMem) + pageSize;
+	const uintptr_t firstFunc = reinterpret_cast<uintptr_t>(&UnwindFirst<API>);
+	const uintptr_t secondFunc = reinterpret_cast<uintptr_t>(&UnwindSecond<API>);
+	UnwindData data{ nullptr, nullptr, { { firstFunc, false, 0, false, _URC_NO_REASON }, { secondFunc, false, 0, false, _URC_NO_REASON }, { firstFunc, false, 0, false, _URC_NO_REASON } } };
+
+	printf("Unwind from fibers, options: %s\n", optsName);
+
+	CommitStack(firstStack, stackSize);
+	CommitStack(secondStack, stackSize);
+
+	data.first = API::Create(firstStack, stackSize, 0, UnwindFirst<API>, &data);
+	data.second = API::Create(secondStack, stackSize, 0, UnwindSecond<API>, &data);
+
+	s_traceLen = 0;
+	API::Start(data.first); // The second fiber is left suspended
+
+	if constexpr (!!(Opts & fiber::Options::SHARED_STACK))
+	{
+		fiber::DestroySharedStackFiber(data.first);
+		fiber::DestroySharedStackFiber(data.second);
+	}
+
+	ReleaseStack(firstMem, stackSize + pageSize * 2);
+	ReleaseStack(secondMem, stackSize + pageSize * 2);
+
+	bool passed = strcmp(s_trace, "a") == 0;
+
+	for (const UnwindWalk& walk : data.walks)
+	{
+		passed &= walk.result == _URC_END_OF_STACK && walk.reachedFiberFunc && walk.framesBelow > 0 && walk.reachedRoot;
+	}
+
+	printf("%s: frames below the fiber function %u %u %u, root %s %s %s\n\n", passed ? "PASSED" : "FAILED",
+		data.walks[0].framesBelow, data.walks[1].framesBelow, data.walks[2].framesBelow,
+		data.walks[0].reachedRoot ? "reached" : "missed", data.walks[1].reachedRoot ? "reached" : "missed", data.walks[2].reachedRoot ? "reached" : "missed");
+
+	return passed;
+}
+#endif //#if FIBER_TEST_UNWIND
+
+#if FIBER_TEST_REGISTERS
+#if USING(OS_WINDOWS)
+static bool SameXmm(__m128i a, __m128i b)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xFFFF;
+}
+#endif //#if USING(OS_WINDOWS)
+
+struct RegisterSwitch
+{
+	fiber::Fiber* curFiber; // nullptr to start toFiber
+	fiber::Fiber* toFiber;
+	bool withValue;
+};
+
+// Out of line, so the registers belong to the caller like they would for any function that switches. With
+// MINIMAL_SAVE, it's this function's spills around the switch's inline asm that have to give them back.
+template<typename API>
+__attribute__((noinline)) static void DoRegisterSwitch(const RegisterSwitch* registerSwitch)
+{
+	if (!registerSwitch->curFiber)
+	{
+		API::Start(registerSwitch->toFiber);
+	}
+	else if (registerSwitch->withValue)
+	{
+		API::SwitchWithValue(registerSwitch->curFiber, registerSwitch->toFiber, nullptr);
+	}
+	else
+	{
+		API::Switch(registerSwitch->curFiber, registerSwitch->toFiber);
+	}
+}
+
+// Holds a distinct value in every callee saved register across the switch, and checks they all come back. The
+// empty asm statements make the compiler have the values in those registers on either side of it.
+template<typename API>
+static bool KeepsRegisters(uint64_t seed, const RegisterSwitch& registerSwitch)
+{
+	register uint64_t rbx asm("rbx") = seed + 1;
+	register uint64_t r12 asm("r12") = seed + 2;
+	register uint64_t r13 asm("r13") = seed + 3;
+	register uint64_t r14 asm("r14") = seed + 4;
+	register uint64_t r15 asm("r15") = seed + 5;
+#if USING(OS_WINDOWS)
+	register uint64_t rdi asm("rdi") = seed + 6;
+	register uint64_t rsi asm("rsi") = seed + 7;
+	register __m128i xmm6 asm("xmm6") = _mm_set1_epi64x(static_cast<long long>(seed + 8));
+	register __m128i xmm7 asm("xmm7") = _mm_set1_epi64x(static_cast<long long>(seed + 9));
+	register __m128i xmm8 asm("xmm8") = _mm_set1_epi64x(static_cast<long long>(seed + 10));
+	register __m128i xmm9 asm("xmm9") = _mm_set1_epi64x(static_cast<long long>(seed + 11));
+	register __m128i xmm10 asm("xmm10") = _mm_set1_epi64x(static_cast<long long>(seed + 12));
+	register __m128i xmm11 asm("xmm11") = _mm_set1_epi64x(static_cast<long long>(seed + 13));
+	register __m128i xmm12 asm("xmm12") = _mm_set1_epi64x(static_cast<long long>(seed + 14));
+	register __m128i xmm13 asm("xmm13") = _mm_set1_epi64x(static_cast<long long>(seed + 15));
+	register __m128i xmm14 asm("xmm14") = _mm_set1_epi64x(static_cast<long long>(seed + 16));
+	register __m128i xmm15 asm("xmm15") = _mm_set1_epi64x(static_cast<long long>(seed + 17));
+
+	asm volatile("" : "+r"(rdi), "+r"(rsi), "+x"(xmm6), "+x"(xmm7), "+x"(xmm8), "+x"(xmm9), "+x"(xmm10), "+x"(xmm11), "+x"(xmm12), "+x"(xmm13), "+x"(xmm14), "+x"(xmm15));
+#endif //#if USING(OS_WINDOWS)
+	asm volatile("" : "+r"(rbx), "+r"(r12), "+r"(r13), "+r"(r14), "+r"(r15));
+
+	DoRegisterSwitch<API>(&registerSwitch);
+
+	asm volatile("" : "+r"(rbx), "+r"(r12), "+r"(r13), "+r"(r14), "+r"(r15));
+
+	bool kept = rbx == seed + 1 && r12 == seed + 2 && r13 == seed + 3 && r14 == seed + 4 && r15 == seed + 5;
+
+#if USING(OS_WINDOWS)
+	asm volatile("" : "+r"(rdi), "+r"(rsi), "+x"(xmm6), "+x"(xmm7), "+x"(xmm8), "+x"(xmm9), "+x"(xmm10), "+x"(xmm11), "+x"(xmm12), "+x"(xmm13), "+x"(xmm14), "+x"(xmm15));
+
+	kept &= rdi == seed + 6 && rsi == seed + 7;
+	kept &= SameXmm(xmm6, _mm_set1_epi64x(static_cast<long long>(seed + 8))) && SameXmm(xmm7, _mm_set1_epi64x(static_cast<long long>(seed + 9)));
+	kept &= SameXmm(xmm8, _mm_set1_epi64x(static_cast<long long>(seed + 10))) && SameXmm(xmm9, _mm_set1_epi64x(static_cast<long long>(seed + 11)));
+	kept &= SameXmm(xmm10, _mm_set1_epi64x(static_cast<long long>(seed + 12))) && SameXmm(xmm11, _mm_set1_epi64x(static_cast<long long>(seed + 13)));
+	kept &= SameXmm(xmm12, _mm_set1_epi64x(static_cast<long long>(seed + 14))) && SameXmm(xmm13, _mm_set1_epi64x(static_cast<long long>(seed + 15)));
+	kept &= SameXmm(xmm14, _mm_set1_epi64x(static_cast<long long>(seed + 16))) && SameXmm(xmm15, _mm_set1_epi64x(static_cast<long long>(seed + 17)));
+#endif //#if USING(OS_WINDOWS)
+
+	return kept;
+}
+
+struct RegistersData
+{
+	fiber::Fiber** fibers;
+	bool kept[3]; // Fiber 0 over its switch, fiber 1 over its switch, fiber 0 over switch with value
+};
+
+static constexpr uint64_t REGISTER_SEED_MAIN = 0x0123456789AB0000ull;
+static constexpr uint64_t REGISTER_SEED_0 = 0x1032547698BA0000ull;
+static constexpr uint64_t REGISTER_SEED_1 = 0x2301674523010000ull;
+
+// Both fibers fill the registers with their own values, so a switch that loses one hands over the other's
+template<typename API>
+static void RegistersFunc0(void* dataPtr)
+{
+	RegistersData* const data = reinterpret_cast<RegistersData*>(dataPtr);
+
+	data->kept[0] = KeepsRegisters<API>(REGISTER_SEED_0, { data->fibers[0], data->fibers[1], false });
+	data->kept[2] = KeepsRegisters<API>(REGISTER_SEED_0 + 0x100, { data->fibers[0], data->fibers[1], true });
+	API::Switch(data->fibers[0], data->fibers[1]);
+}
+
+template<typename API>
+static void RegistersFunc1(void* dataPtr)
+{
+	RegistersData* const data = reinterpret_cast<RegistersData*>(dataPtr);
+
+	data->kept[1] = KeepsRegisters<API>(REGISTER_SEED_1, { data->fibers[1], data->fibers[0], false });
+	KeepsRegisters<API>(REGISTER_SEED_1 + 0x100, { data->fibers[1], data->fibers[0], true });
+}
+
+// rbx and r12 to r15, plus rdi, rsi and xmm6 to xmm15 on windows, must survive every switch and Start
+template<fiber::Options Opts, typename API>
+static bool RunRegistersTest(const char* optsName)
+{
+	constexpr unsigned pageSize = 4 * 1024;
+	constexpr unsigned stackSize = pageSize * 4;
+	constexpr unsigned numFibers = 2;
+	void* stackMemBase[numFibers];
+	fiber::Fiber* fibers[numFibers];
+	RegistersData data{ fibers, { false, false, false } };
+	const fiber::FiberFunc fiberFuncs[numFibers] = { RegistersFunc0<API>, RegistersFunc1<API> };
+
+	printf("Callee saved registers, options: %s\n", optsName);
+
+	for (unsigned fiberIndex = 0; fiberIndex < numFibers; ++fiberIndex)
+	{
+		stackMemBase[fiberIndex] = ReserveStack(stackSize + pageSize * 2);
+		CommitStack(reinterpret_cast<uint8_t*>(stackMemBase[fiberIndex]) + pageSize, stackSize);
+		fibers[fiberIndex] = API::Create(reinterpret_cast<uint8_t*>(stackMemBase[fiberIndex]) + pageSize, stackSize, 0, fiberFuncs[fiberIndex], &data);
+	}
+
+	// Fiber 1 finishes, fiber 0 is left suspended
+	const bool mainKept = KeepsRegisters<API>(REGISTER_SEED_MAIN, { nullptr, fibers[0], false });
+
+	for (unsigned fiberIndex = 0; fiberIndex < numFibers; ++fiberIndex)
+	{
+		if constexpr (!!(Opts & fiber::Options::SHARED_STACK))
+		{
+			fiber::DestroySharedStackFiber(fibers[fiberIndex]);
+		}
+
+		ReleaseStack(stackMemBase[fiberIndex], stackSize + pageSize * 2);
+	}
+
+	const bool passed = mainKept && data.kept[0] && data.kept[1] && data.kept[2];
+
+	printf("%s: start %s, switch %s %s, switch with value %s\n\n", passed ? "PASSED" : "FAILED", mainKept ? "kept" : "lost",
+		data.kept[0] ? "kept" : "lost", data.kept[1] ? "kept" : "lost", data.kept[2] ? "kept" : "lost");
+
+	return passed;
+}
+#endif //#if FIBER_TEST_REGISTERS
+
+
+static constexpr unsigned SHARED_FIBER_COUNT = 3;
+static constexpr unsigned SHARED_ROUNDS = 4;
+static constexpr size_t SHARED_LOCAL_SIZE = 1024;
+
+struct SharedData
+{
+	fiber::Fiber** fibers;
+	unsigned index;
+	uintptr_t* counter;
+	bool intact;
+};
+
+template<typename API>
+static void SharedStackFunc(void* dataPtr)
+{
+	SharedData* const data = reinterpret_cast<SharedData*>(dataPtr);
+	volatile uint8_t local[SHARED_LOCAL_SIZE]; // Has to survive being copied out and back in
+
+	for (size_t index = 0; index < SHARED_LOCAL_SIZE; ++index)
+	{
+		local[index] = static_cast<uint8_t>(index + data->index);
+	}
+
+	for (unsigned round = 0; round < SHARED_ROUNDS; ++round)
+	{
+		TraceChar(static_cast<char>('0' + data->index));
+
+		fiber::Fiber* const next = data->fibers[(data->index + 1) % SHARED_FIBER_COUNT];
+		const uintptr_t received = reinterpret_cast<uintptr_t>(API::SwitchWithValue(data->fibers[data->index], next, reinterpret_cast<void*>(*data->counter + 1)));
+
+		// Every switch in the ring hands over the counter, one more than it was
+		*data->counter = received;
+
+		for (size_t index = 0; index < SHARED_LOCAL_SIZE; ++index)
+		{
+			data->intact &= local[index] == static_cast<uint8_t>(index + data->index);
+		}
+	}
+}
+
+template<fiber::Options Opts>
+static bool RunSharedStackTest(const char* optsName)
+{
+	using API = fiber::Api<Opts>;
+
+	constexpr unsigned pageSize = 4 * 1024;
+	constexpr unsigned stackSize = pageSize * 4;
+	void* const stackMem = ReserveStack(stackSize + pageSize * 2);
+	uint8_t* const stack = reinterpret_cast<uint8_t*>(stackMem) + pageSize;
+	fiber::Fiber* fibers[SHARED_FIBER_COUNT];
+	SharedData data[SHARED_FIBER_COUNT];
+	uintptr_t counter = 0;
+
+	printf("Shared stack, options: %s\n", optsName);
+
+	CommitStack(stack, stackSize);
+
+	for (unsigned fiberIndex = 0; fiberIndex < SHARED_FIBER_COUNT; ++fiberIndex)
+	{
+		data[fiberIndex] = SharedData{ fibers, fiberIndex, &counter, true };
+		fibers[fiberIndex] = API::Create(stack, stackSize, 0, SharedStackFunc<API>, &data[fiberIndex]);
+	}
+
+	s_traceLen = 0;
+	API::Start(fibers[0]); // Fiber 0 finishes first, leaving the other two parked mid ring
+
+	bool intact = true;
+
+	for (unsigned fiberIndex = 0; fiberIndex < SHARED_FIBER_COUNT; ++fiberIndex)
+	{
+		intact &= data[fiberIndex].intact;
+		fiber::DestroySharedStackFiber(fibers[fiberIndex]);
+	}
+
+	ReleaseStack(stackMem, stackSize + pageSize * 2);
+
+	static const char expectedTrace[] = "012012012012";
+	static constexpr uintptr_t expectedCounter = SHARED_FIBER_COUNT * (SHARED_ROUNDS - 1) + 1;
+	const bool passed = strcmp(s_trace, expectedTrace) == 0 && counter == expectedCounter && intact;
+
+	printf("%s: trace %s, expected %s, counter %zu, expected %zu, locals %s\n\n", passed ? "PASSED" : "FAILED", s_trace, expectedTrace,
+		static_cast<size_t>(counter), static_cast<size_t>(expectedCounter), intact ? "intact" : "corrupted");
+
+	return passed;
+}
+
+struct LocalsData
+{
+	fiber::Fiber** fibers;
+	unsigned index;
+	bool passed;
+};
+
+template<typename API>
+static void LocalsFunc(void* dataPtr)
+{
+	LocalsData* const data = reinterpret_cast<LocalsData*>(dataPtr);
+	fiber::Fiber* const self = data->fibers[data->index];
+	fiber::Fiber* const other = data->fibers[data->index ^ 1];
+
+	data->passed &= fiber::GetCurrentFiber() == self;
+	data->passed &= fiber::GetFiberLocal(0) == data; // Set before starting
+
+	for (size_t slot = 1; slot < fiber::FIBER_LOCAL_SLOT_COUNT; ++slot)
+	{
+		data->passed &= fiber::GetFiberLocal(slot) == nullptr;
+		fiber::SetFiberLocal(slot, reinterpret_cast<void*>(slot * 16 + data->index));
+	}
+
+	TraceChar(static_cast<char>('0' + data->index));
+	API::Switch(self, other);
+
+	data->passed &= fiber::GetCurrentFiber() == self;
+
+	for (size_t slot = 1; slot < fiber::FIBER_LOCAL_SLOT_COUNT; ++slot)
+	{
+		data->passed &= fiber::GetFiberLocal(slot) == reinterpret_cast<void*>(slot * 16 + data->index);
+	}
+
+	TraceChar(static_cast<char>('0' + data->index));
+
+	if (data->index == 0)
+	{
+		API::Switch(self, other);
+	}
+}
+
+template<fiber::Options Opts, typename API>
+static bool RunFiberLocalTest(const char* optsName)
+{
+	constexpr unsigned pageSize = 4 * 1024;
+	constexpr unsigned stackSize = pageSize * 4;
+	constexpr unsigned numFibers = 2;
+	void* stackMemBase[numFibers];
+	fiber::Fiber* fibers[numFibers];
+	LocalsData data[numFibers];
+
+	printf("Fiber locals, options: %s\n", optsName);
+
+	for (unsigned fiberIndex = 0; fiberIndex < numFibers; ++fiberIndex)
+	{
+		stackMemBase[fiberIndex] = ReserveStack(stackSize + pageSize * 2);
+		CommitStack(reinterpret_cast<uint8_t*>(stackMemBase[fiberIndex]) + pageSize, stackSize);
+
+		data[fiberIndex] = LocalsData{ fibers, fiberIndex, true };
+		fibers[fiberIndex] = API::Create(reinterpret_cast<uint8_t*>(stackMemBase[fiberIndex]) + pageSize, stackSize, 0, LocalsFunc<API>, &data[fiberIndex]);
+		fibers[fiberIndex]->locals[0] = &data[fiberIndex];
+	}
+
+	s_traceLen = 0;
+	API::Start(fibers[0]); // 0 runs, 1 runs, 0 resumes, 1 resumes and finishes
+
+	const bool restored = fiber::GetCurrentFiber() == nullptr;
+
+	for (unsigned fiberIndex = 0; fiberIndex < numFibers; ++fiberIndex)
+	{
+		if constexpr (!!(Opts & fiber::Options::SHARED_STACK))
+		{
+			fiber::DestroySharedStackFiber(fibers[fiberIndex]);
+		}
+
+		ReleaseStack(stackMemBase[fiberIndex], stackSize + pageSize * 2);
+	}
+
+	static const char expectedTrace[] = "0101";
+	const bool passed = strcmp(s_trace, expectedTrace) == 0 && data[0].passed && data[1].passed && restored;
+
+	printf("%s: trace %s, expected %s, slots %s, current fiber %s\n\n", passed ? "PASSED" : "FAILED", s_trace, expectedTrace,
+		data[0].passed && data[1].passed ? "intact" : "corrupted", restored ? "restored" : "left set");
+
+	return passed;
+}
+
+// Same chain as RunTest, but all the stacks come out of one reservation with a guard page under each
+template<fiber::Options Opts, typename API>
+static bool RunCreateManyTest(const char* optsName)
+{
+	constexpr unsigned pageSize = 4 * 1024;
+	constexpr unsigned stackSize = pageSize * 4;
+	constexpr unsigned stackStride = stackSize + pageSize;
+	constexpr unsigned numFibers = 4; // One per part of the chain, see ChainFunc
+	void* const stackMem = ReserveStack(stackStride * numFibers + pageSize);
+	fiber::Fiber* fibers[numFibers];
+	FiberData data[numFibers];
+	void* userData[numFibers];
+
+	printf("Create many, options: %s\n", optsName);
+
+	s_traceLen = 0;
+
+	for (unsigned fiberIndex = 0; fiberIndex < numFibers; ++fiberIndex)
+	{
+		CommitStack(reinterpret_cast<uint8_t*>(stackMem) + pageSize + stackStride * fiberIndex, stackSize);
+
+		data[fiberIndex].numFibers = numFibers;
+		data[fiberIndex].fibers = fibers;
+		data[fiberIndex].value = fiberIndex + 1;
+		userData[fiberIndex] = &data[fiberIndex];
+	}
+
+	API::CreateMany(reinterpret_cast<uint8_t*>(stackMem) + pageSize, stackStride, numFibers, stackSize, 0, ChainFunc<API>, userData, fibers);
+
+	API::Start(fibers[0]);
+
+	static const char expectedChainTrace[] = "12314";
+	const bool chainPassed = strcmp(s_trace, expectedChainTrace) == 0;
+
+	printf("%s: trace %s, expected %s\n", chainPassed ? "PASSED" : "FAILED", s_trace, expectedChainTrace);
+
+	// And the pool case proper, one function in one pass. Reuses the stacks, the fibers above are done with.
+	fiber::Fiber* poolFibers[numFibers];
+
+	s_traceLen = 0;
+	API::CreateMany(reinterpret_cast<uint8_t*>(stackMem) + pageSize, stackStride, numFibers, stackSize, 0, Func4<API>, userData, poolFibers);
+
+	for (unsigned fiberIndex = 0; fiberIndex < numFibers; ++fiberIndex)
+	{
+		API::Start(poolFibers[fiberIndex]);
+
+		if constexpr (!!(Opts & fiber::Options::SHARED_STACK))
+		{
+			fiber::DestroySharedStackFiber(fibers[fiberIndex]);
+			fiber::DestroySharedStackFiber(poolFibers[fiberIndex]);
+		}
+	}
+
+	ReleaseStack(stackMem, stackStride * numFibers + pageSize);
+
+	static const char expectedPoolTrace[] = "1234";
+	const bool poolPassed = strcmp(s_trace, expectedPoolTrace) == 0;
+	const bool passed = chainPassed && poolPassed;
+
+	printf("%s: trace %s, expected %s\n\n", poolPassed ? "PASSED" : "FAILED", s_trace, expectedPoolTrace);
+
+	return passed;
+}
+
+template<fiber::Options Opts>
+static bool RunTests(const char* optsName)
+{
+	bool passed = true;
+
+	s_fiberAPI = fiber::GetAPI(Opts);
+
+	printf("Runtime api, ");
+	passed &= RunTest<Opts, RuntimeApi>(optsName);
+	printf("Static api, ");
+	passed &= RunTest<Opts, fiber::Api<Opts>>(optsName);
+	printf("Runtime api, ");
+	passed &= RunValueTest<Opts, RuntimeApi>(optsName);
+	printf("Static api, ");
+	passed &= RunValueTest<Opts, fiber::Api<Opts>>(optsName);
+	printf("Runtime api, ");
+	passed &= RunOnTopTest<Opts, RuntimeApi>(optsName);
+	printf("Static api, ");
+	passed &= RunOnTopTest<Opts, fiber::Api<Opts>>(optsName);
+	printf("Runtime api, ");
+	passed &= RunFiberLocalTest<Opts, RuntimeApi>(optsName);
+	printf("Static api, ");
+	passed &= RunFiberLocalTest<Opts, fiber::Api<Opts>>(optsName);
+	printf("Runtime api, ");
+	passed &= RunCreateManyTest<Opts, RuntimeApi>(optsName);
+	printf("Static api, ");
+	passed &= RunCreateManyTest<Opts, fiber::Api<Opts>>(optsName);
+#if FIBER_TEST_REGISTERS
+	printf("Runtime api, ");
+	passed &= RunRegistersTest<Opts, RuntimeApi>(optsName);
+	printf("Static api, ");
+	passed &= RunRegistersTest<Opts, fiber::Api<Opts>>(optsName);
+#endif //#if FIBER_TEST_REGISTERS
+#if FIBER_TEST_UNWIND
+	printf("Runtime api, ");
+	passed &= RunUnwindTest<Opts, RuntimeApi>(optsName);
+	printf("Static api, ");
+	passed &= RunUnwindTest<Opts, fiber::Api<Opts>>(optsName);
+#endif //#if FIBER_TEST_UNWIND
+
+	if constexpr (!!(Opts & fiber::Options::SHARED_STACK))
+	{
+		passed &= RunSharedStackTest<Opts>(optsName);
+	}
+	else
+	{
+		printf("Static api, ");
+		passed &= RunStackProfileTest<fiber::Api<Opts>>(optsName);
+	}
+
+	return passed;
+}
+
+int main()
+{
+	bool passed = true;
+
+	passed &= RunTests<fiber::Options::NONE>("NONE");
+	passed &= RunTests<fiber::Options::OS_API_SAFETY>("OS_API_SAFETY");
+	passed &= RunTests<fiber::Options::PRESERVE_FPU_CONTROL>("PRESERVE_FPU_CONTROL");
+	passed &= RunTests<fiber::Options::OS_API_SAFETY | fiber::Options::PRESERVE_FPU_CONTROL>("OS_API_SAFETY | PRESERVE_FPU_CONTROL");
+	passed &= RunTests<fiber::Options::SHARED_STACK>("SHARED_STACK");
+	passed &= RunTests<fiber::Options::SHARED_STACK | fiber::Options::OS_API_SAFETY>("SHARED_STACK | OS_API_SAFETY");
+	passed &= RunTests<fiber::Options::SHARED_STACK | fiber::Options::PRESERVE_FPU_CONTROL>("SHARED_STACK | PRESERVE_FPU_CONTROL");
+	passed &= RunTests<fiber::Options::SHARED_STACK | fiber::Options::OS_API_SAFETY | fiber::Options::PRESERVE_FPU_CONTROL>("SHARED_STACK | OS_API_SAFETY | PRESERVE_FPU_CONTROL");
+#if FIBER_MINIMAL_SAVE_SUPPORTED
+	passed &= RunTests<fiber::Options::MINIMAL_SAVE>("MINIMAL_SAVE");
+	passed &= RunTests<fiber::Options::MINIMAL_SAVE | fiber::Options::OS_API_SAFETY>("MINIMAL_SAVE | OS_API_SAFETY");
+	passed &= RunTests<fiber::Options::MINIMAL_SAVE | fiber::Options::PRESERVE_FPU_CONTROL>("MINIMAL_SAVE | PRESERVE_FPU_CONTROL");
+	passed &= RunTests<fiber::Options::MINIMAL_SAVE | fiber::Options::OS_API_SAFETY | fiber::Options::PRESERVE_FPU_CONTROL>("MINIMAL_SAVE | OS_API_SAFETY | PRESERVE_FPU_CONTROL");
+#endif //#if FIBER_MINIMAL_SAVE_SUPPORTED
+
+	return passed ? 0 : 1;
 }
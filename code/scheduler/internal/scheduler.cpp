@@ -5,7 +5,16 @@
 # define WIN32_LEAN_AND_MEAN
 # define NOMINMAX
 # include <Windows.h>
-#endif //#if USING(OS_WINDOWS)
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <signal.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <alloca.h>
+# include <linux/futex.h>
+# include <sched.h>
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
 
 #include "../scheduler/scheduler.h"
 #include "../scheduler/thread.h"
@@ -13,6 +22,7 @@
 
 #include "spsc_ring_buffer.h"
 #include "spsc_queue.h"
+#include "ws_deque.h"
 
 #include "fiber.h"
 
@@ -21,10 +31,46 @@
 #include <atomic>
 #include <optional>
 #include <algorithm>
-
-#ifndef GUARD_UNUSED_STACKS
-# define GUARD_UNUSED_STACK IN_USE
-#endif
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+
+// Decommits returned task stacks so stray accesses to them fault. Costs syscalls on every task, so debug only.
+#ifndef GUARD_UNUSED_STACK
+# ifdef NDEBUG
+#  define GUARD_UNUSED_STACK NOT_IN_USE
+# else //#ifdef NDEBUG
+#  define GUARD_UNUSED_STACK IN_USE
+# endif //#else //#ifdef NDEBUG
+#endif //#ifndef GUARD_UNUSED_STACK
+
+// Depth of a recycled task stack kept resident. Deeper pages are handed back when the stack is returned.
+#ifndef TASK_STACK_HOT_SIZE
+# define TASK_STACK_HOT_SIZE (64*1024)
+#endif //#ifndef TASK_STACK_HOT_SIZE
+
+// Depth of a task stack commited before its task first runs on it, so shallow tasks never fault. On linux deeper pages
+// are grown by stack_grow::OnSegv, which never sees the kernel's own accesses, see scheduler::StackSize.
+#ifndef TASK_STACK_MIN_COMMIT
+# define TASK_STACK_MIN_COMMIT (16*1024)
+#endif //#ifndef TASK_STACK_MIN_COMMIT
+
+// Backs the whole Options::STACK_ARENA reservation with transparent huge pages. Stack slots are smaller than a huge
+// page, so every touched slot ends up fully resident. Only worth it with many deep tasks running at once.
+#ifndef STACK_ARENA_HUGE_PAGES
+# define STACK_ARENA_HUGE_PAGES NOT_IN_USE
+#endif //#ifndef STACK_ARENA_HUGE_PAGES
+
+// Fibers suspended in task::Wait longer than this get the stack below their live frames decommited. See stack_trim.
+// Linux only, windows fibers carry a TIB stack limit that __chkstk trusts over the page state.
+#define TRIM_PARKED_STACKS USE_IF(USING(OS_LINUX))
+#ifndef PARKED_STACK_TRIM_MS
+# define PARKED_STACK_TRIM_MS 1000
+#endif //#ifndef PARKED_STACK_TRIM_MS
 
 /* Basic approach is to try to only use SPSC queues, which, with work stealing,
  * is a bit complex. Whenever any task creates a new task, the new task is added
@@ -46,12 +92,11 @@
 namespace
 {
 	static constexpr unsigned THREAD_WAIT_QUEUE_SIZE_LG2 = 3;
+	static constexpr unsigned STACK_CLASS_COUNT = 4; // scheduler::StackSize TINY through LARGE
+	static constexpr unsigned TASK_INLINE_PAYLOAD_SIZE = 48; // Payloads up to this size are copied into the Task itself
+	static constexpr unsigned TASK_INLINE_PAYLOAD_ALIGN = 16;
 
-	union TaskRef
-	{
-		uintptr_t users;
-		TaskRef* next;
-	};
+	struct TaskRef;
 
 	struct Task
 	{
@@ -59,11 +104,25 @@ namespace
 		TaskRef* taskRef;
 		struct
 		{
-			uintptr_t userDataPtr : sizeof(uintptr_t) * 8 - 1;
+			uintptr_t userDataPtr : sizeof(uintptr_t) * 8 - 3;
+			uintptr_t inlinePayload : 1; // userData is payload, userDataPtr is unused
+			uintptr_t slabPtr : 1; // An owned userDataPtr came from task_alloc rather than _aligned_malloc
 			uintptr_t ownedPtr : 1;
 		};
+		size_t stackSize; // As given to task::Create, mapped to a stack class when the task starts
+		alignas(TASK_INLINE_PAYLOAD_ALIGN) uint8_t payload[TASK_INLINE_PAYLOAD_SIZE];
 	};
 
+	// A task on its way through the pump, see schedule::AssignNewTasksToThreads
+	struct QueuedTask
+	{
+		Task task;
+		unsigned threadIndex; // ANY_TASK_THREAD, or the task thread it has to run on. See task::Run's optThread.
+		uint8_t _padding[12];
+	};
+
+	static constexpr unsigned ANY_TASK_THREAD = ~0u;
+
 	struct ScheduledFiber
 	{
 		fiber::Fiber* fiber;
@@ -76,29 +135,175 @@ namespace
 		FreeList* next;
 	};
 
+	// A TaskHandle's slot in the scheduler's TaskSlotTable, allocated from the creating thread's TaskAlloc
+	struct TaskRef
+	{
+		FreeList freeLink; // Only used while the slot is free, so state survives it
+		std::atomic_uint64_t state; // Generation in the high 32 bits, task_ref::TASK_* in the low
+		std::atomic_uint64_t waiters; // TaskWaiter list tagged with the generation, see task_wait
+		Task task; // Until the task is handed to a thread
+	};
+
+	// A task fiber suspended in task::Wait, on its own stack
+	struct TaskWaiter
+	{
+		TaskWaiter* next;
+		fiber::Fiber* fiber;
+		unsigned threadId;
+		uint8_t _padding[4];
+	};
+
+	// A task thread's free stacks of one class
+	struct FreeStacks
+	{
+		FreeList* list;
+		unsigned count;
+		uint8_t _padding[4];
+	};
+
+	// Free stacks spilled by one task thread for others to take, linked through the first stack's free list node.
+	// See stack_exchange.
+	struct StackBatch
+	{
+		StackBatch* nextBatch;
+		size_t count;
+		FreeList stacks;
+	};
+
+	// Lock free stack of StackBatch, one per stack class shared by all task threads. The low 48 bits are the top
+	// batch, the rest a tag bumped on every change so a pop can't be fooled by the same batch coming back.
+	struct alignas(64) StackExchange
+	{
+		std::atomic_uint64_t top;
+	};
+
+	// Stacks carved out of one reservation at thread start, see stack_alloc::CreatePool
+	struct StackPool
+	{
+		uint8_t* mem;
+		size_t size;
+		unsigned untouchedCount; // Stacks at the top of the pool never handed out yet
+		uint8_t _padding[4];
+	};
+
+	// One read-write reservation per task thread, carved into fixed size stack slots. See Options::STACK_ARENA.
+	struct StackArena
+	{
+		uint8_t* mem;
+		size_t size;
+		uint64_t* freeSlots; // Bit per slot, set while free
+		uint64_t* dirtySlots; // Bit per free slot that ran a task since the last stack_alloc::TrimArena
+		unsigned slotCount;
+		uint8_t _padding[4];
+	};
+
+	struct NumaTopology
+	{
+		std::vector<unsigned> cpus; // Ids the process may run on, ascending. Can be sparse.
+		std::vector<uint8_t> cpuNodes; // Node of each cpu id, up to the highest in cpus
+		unsigned nodeCount;
+		bool simulated; // Nodes made up through SCHEDULER_NUMA_NODES, see numa::Discover
+		uint8_t _padding[3];
+	};
+
+	using StackProfileMap = std::unordered_map<void(*)(void*), scheduler::StackProfile>;
+
+	// A task thread's profiles. Locked, since GetStackProfiles reads them from other threads while tasks finish.
+	struct StackProfiles
+	{
+		StackProfileMap byTask{};
+		std::atomic_bool lock{ false };
+		uint8_t _padding[7]{};
+	};
+
+	static constexpr unsigned STACK_DEPTH_TABLE_SIZE_LG2 = 8;
+
+	struct StackDepth
+	{
+		void(*TaskFunc)(void*);
+		size_t depth; // Commited stack size the task function has needed
+		unsigned quietRuns; // Runs since it last grew past what it started with, see stack_depth::Record
+		uint8_t _padding[4];
+	};
+
+	// Direct mapped by task function, a collision evicts. See stack_depth.
+	struct StackDepths
+	{
+		StackDepth entries[1u << STACK_DEPTH_TABLE_SIZE_LG2];
+	};
+
+	struct TaskAlloc;
+
+	// Header of a TaskAlloc page, in place of its first block. Pages are PAGE_SIZE aligned, so a block finds its
+	// page, and through it the allocator that owns it, by masking.
+	struct TaskPage
+	{
+		TaskAlloc* owner;
+		TaskPage* nextChunk; // Only on the first page of each chunk, see task_alloc::ReleaseAll
+		unsigned blockClass;
+		uint8_t _padding[4];
+	};
+
+	// One reservation all TaskRefs are carved from, so a TaskHandle can name its slot by index. Handed out to
+	// TaskAllocs a chunk at a time and only released by scheduler::Destroy, so a stale handle can always read its
+	// slot's generation.
+	struct TaskSlotTable
+	{
+		uint8_t* mem;
+		size_t size;
+		uint8_t* reserved; // mem is aligned up from here
+		size_t reservedSize;
+		std::atomic_size_t usedChunks;
+	};
+
+	// Per thread slab allocator for TaskRefs and heap task payloads. See task_alloc.
 	struct TaskAlloc
 	{
 		static constexpr const unsigned PAGE_SIZE = 8 * 1024;
 		static constexpr const unsigned PAGE_MASK = PAGE_SIZE - 1;
-		FreeList* unusedTasks;
-		TaskRef* taskMem;
-		unsigned size;
-		uint16_t totalPageCapacity;
-		uint16_t curPageCapacity;
+		static constexpr const unsigned CHUNK_PAGE_COUNT = 64; // Pages mapped from the OS at a time
+		static constexpr const unsigned BLOCK_CLASS_COUNT = 5; // TaskRef, then payloads by size
+
+		FreeList* unusedBlocks[BLOCK_CLASS_COUNT];
+		TaskSlotTable* slotTable; // TaskRef chunks come from here, payload chunks straight from the OS
+		TaskPage* chunks; // Payload chunks only
+		uint8_t* freshPages[BLOCK_CLASS_COUNT]; // Pages of the class's newest chunk not yet carved into blocks
+		unsigned freshPageCount[BLOCK_CLASS_COUNT];
+
+		// Blocks freed by other threads. Pushed lock free, only ever emptied whole by the owner.
+		alignas(64) std::atomic<FreeList*> remoteFreed[BLOCK_CLASS_COUNT];
 	};
 
+	// Thread::parkState. A Wake while the thread is busy leaves THREAD_NOTIFIED for its next Sleep to take.
+	static constexpr uint32_t THREAD_RUNNING = 0;
+	static constexpr uint32_t THREAD_NOTIFIED = 1;
+	static constexpr uint32_t THREAD_PARKED = ~0u; // THREAD_RUNNING - 1, see thread::PrepareSleep
+
 	struct Thread
 	{
 		std::thread thread{};
+		TaskAlloc taskAlloc{};
 
 		unsigned id;
-		std::atomic_bool hasData = false;
-		uint8_t _padding[3];
+		std::atomic_uint32_t parkState = THREAD_RUNNING;
 	};
 
 	struct TaskThread : public Thread
 	{
-		FreeList* freeStacks = nullptr;
+		FreeStacks freeStacks[STACK_CLASS_COUNT] = {}; // One list per stack class, see task_thread::StackClassFor
+		unsigned numaNode = 0;
+		StackPool stackPool{};
+		StackArena stackArena{};
+
+		// Peak stack depth per task function, only filled when profiling stacks
+		StackProfiles stackProfiles{};
+
+		// How much stack each task function has needed commited, so its next run starts with that much. Linux only.
+		StackDepths stackDepths{};
+
+		// Fibers of this thread suspended in task::Wait. Only touched by this thread, see stack_trim.
+		std::vector<fiber::Fiber*> parkedFibers{};
+		uint64_t lastParkedScan = 0;
 
 		// These are tasks that have been assigned to run on this
 		// thread, but haven't yet started. This list should probably
@@ -108,7 +313,7 @@ namespace
 
 		// This is the list of new tasks created by this thread. They
 		// have the potential to be run on any thread
-		spsc::fifo_queue<Task> unassignedTasks{};
+		spsc::fifo_queue<QueuedTask> unassignedTasks{};
 
 		// These are active tasks that were started on this thread, 
 		// but which hit a wait or yield, and now are scheduled to
@@ -119,6 +324,10 @@ namespace
 		// rescheduled for execution on the appropriate reactor thread
 		// in the case of a wait, or this thread in case of a yield
 		spsc::fifo_queue<ScheduledFiber> stalledTasks{};
+
+		// Options::WORK_STEALING only. Tasks this thread's tasks have run, popped
+		// newest first here and stolen oldest first by idle threads.
+		ws::work_deque<TaskRef*> localTasks{};
 	};
 
 	struct ReactorThread : public Thread
@@ -137,7 +346,8 @@ namespace scheduler
 {
 	struct Scheduler
 	{
-		fiber::FiberAPI fiberAPI;
+		fiber::Options fiberOpts;
+		Options opts;
 		TaskThread* taskThreads;
 		ReactorThread* reactorThreads;
 		std::atomic_uint32_t* activeTaskThreads;
@@ -146,6 +356,29 @@ namespace scheduler
 		std::atomic_bool running;
 		uint8_t _cachePad1[64 - sizeof(running)];
 		std::atomic_bool workPumpLock;
+		std::atomic_bool workPumpRequested; // Set by a thread that found the pump busy, the holder goes round again
+
+		// Task threads asleep or on their way to it, so Run knows when a steal target wants waking
+		std::atomic_uint32_t idleTaskThreads;
+
+		// Totals over every task thread, see stack_trim
+		std::atomic_size_t parkedTrims;
+		std::atomic_size_t parkedTrimmedBytes;
+
+		// STACK_CLASS_COUNT per NUMA node, so stacks only move between threads on the same node
+		StackExchange* stackExchanges;
+		NumaTopology numa;
+
+		TaskSlotTable taskSlots;
+
+		// Threads the scheduler didn't start create and run tasks through these, one at a time. See task_alloc::Alloc
+		// and task::Run.
+		std::atomic_bool foreignLock{ false };
+		TaskAlloc foreignAlloc{};
+		spsc::fifo_queue<QueuedTask> foreignTasks{};
+
+		// Pinned tasks whose thread had a full tasksAwaitingExecution. Only touched under workPumpLock.
+		std::vector<QueuedTask> pinnedBacklog{};
 	};
 }
 
@@ -158,7 +391,7 @@ namespace
 
 	constexpr bool operator!(scheduler::Options a)
 	{
-		return a != scheduler::Options::NONE;
+		return a == scheduler::Options::NONE;
 	}
 
 	namespace thread
@@ -170,20 +403,86 @@ namespace
 			fiber::Fiber* rootFiber;
 		};
 
+		// Blocks while the 32 bits at address hold expected. Can return early, callers recheck.
+		static void WaitOnWord(const void* address, uint32_t expected)
+		{
+#if USING(OS_WINDOWS)
+			WaitOnAddress(const_cast<void*>(address), &expected, sizeof(expected), INFINITE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		}
+
+		static void WakeOnWord(const void* address, bool wakeAll)
+		{
+#if USING(OS_WINDOWS)
+			wakeAll ? WakeByAddressAll(const_cast<void*>(address)) : WakeByAddressSingle(const_cast<void*>(address));
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, wakeAll ? INT_MAX : 1, nullptr, nullptr, 0);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		}
+
+		// Only a thread that's actually parked costs a syscall. Releases whatever was queued for it before.
 		static void Wake(Thread* thread)
 		{
-			if (!thread->hasData.exchange(true))
+			if (thread->parkState.exchange(THREAD_NOTIFIED, std::memory_order_release) == THREAD_PARKED)
+			{
+				WakeOnWord(&thread->parkState, false);
+			}
+		}
+
+		// Sleep in halves, so a caller can recheck for work once any Wake is sure to see it parked. False if a
+		// Wake came in while busy, that's taken and the thread shouldn't sleep.
+		static bool PrepareSleep(Thread* thread)
+		{
+			// THREAD_NOTIFIED -> THREAD_RUNNING, or THREAD_RUNNING -> THREAD_PARKED
+			return thread->parkState.fetch_sub(1, std::memory_order_seq_cst) != THREAD_NOTIFIED;
+		}
+
+		// Dropping a Wake that came in since is fine, the caller goes back round for work anyway
+		static void CancelSleep(Thread* thread)
+		{
+			thread->parkState.exchange(THREAD_RUNNING, std::memory_order_acquire);
+		}
+
+		static void FinishSleep(Thread* thread)
+		{
+			for (;;)
 			{
-				WakeByAddressSingle(&thread->hasData);
+				WaitOnWord(&thread->parkState, THREAD_PARKED);
+
+				uint32_t notified = THREAD_NOTIFIED;
+
+				if (thread->parkState.compare_exchange_strong(notified, THREAD_RUNNING, std::memory_order_acquire, std::memory_order_relaxed))
+				{
+					break;
+				}
 			}
 		}
 
 		static void Sleep(Thread* thread)
 		{
-			bool trueVal = true;
+			if (PrepareSleep(thread))
+			{
+				FinishSleep(thread);
+			}
+		}
+
+		// For the few things threads outside the scheduler share, held for a handful of instructions
+		static void Lock(std::atomic_bool* lock)
+		{
+			while (lock->exchange(true, std::memory_order_acquire))
+			{
+				while (lock->load(std::memory_order_relaxed))
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
 
-			thread->hasData.store(false, std::memory_order_release);
-			WaitOnAddress(&thread->hasData, &trueVal, sizeof(trueVal), INFINITE);
+		static void Unlock(std::atomic_bool* lock)
+		{
+			lock->store(false, std::memory_order_release);
 		}
 	}
 
@@ -194,144 +493,1800 @@ namespace
 		static constexpr const size_t PAGE_ALLOC_ALIGN = 64 * 1024;
 		static constexpr const size_t PAGE_ALLOC_MASK = PAGE_ALLOC_ALIGN-1;
 
-		static void* CreateAcquire(size_t totalStackSize, size_t initialStackSize, FreeList** freeStackList)
+		// Sits at the very top of every stack reservation, above the fiber. Windows tracks the commited
+		// region in the page tables, linux grows it by hand in stack_grow::OnSegv.
+		struct StackHeader
+		{
+			uint8_t* reserveLow;
+			uint8_t* commitedLow;
+			uint64_t parkedAt; // Non-zero while suspended in task::Wait, see stack_trim
+			uint32_t parkedIndex;
+			uint32_t parkedTrimmed;
+		};
+
+		static constexpr const size_t STACK_HEADER_SIZE = sizeof(StackHeader);
+		static constexpr const size_t STACK_HEAD_OFFSET = STACK_HEADER_SIZE + fiber::api_internal::FIBER_HEAD_SIZE; // Top of the reservation to the fiber's stack head
+
+		static_assert((STACK_HEADER_SIZE & (fiber::api_internal::STACK_ALIGN - 1)) == 0);
+
+		static StackHeader* ToHeader(void* stack, size_t realTotalStackSize)
+		{
+			return reinterpret_cast<StackHeader*>(reinterpret_cast<uint8_t*>(stack) + realTotalStackSize) - 1;
+		}
+
+		// Create puts the fiber at the top of the memory it's given, just under the header
+		static StackHeader* ToHeader(fiber::Fiber* fiber)
+		{
+			return reinterpret_cast<StackHeader*>(fiber + 1);
+		}
+
+		static uint8_t* FromFiber(fiber::Fiber* fiber, size_t realTotalStackSize)
+		{
+			return reinterpret_cast<uint8_t*>(ToHeader(fiber) + 1) - realTotalStackSize;
+		}
+
+		// Free stacks are linked through their top page, which is always commited.
+		static FreeList* ToFreeListNode(void* stack, size_t realTotalStackSize)
+		{
+			return reinterpret_cast<FreeList*>(ToHeader(stack, realTotalStackSize)) - 1;
+		}
+
+		static uint8_t* FromFreeListNode(FreeList* node, size_t realTotalStackSize)
+		{
+			return reinterpret_cast<uint8_t*>(node + 1) + STACK_HEADER_SIZE - realTotalStackSize;
+		}
+
+		static constexpr const unsigned COMMITED_SEARCH_DEPTH = 4; // Free stacks CreateAcquire looks through for one commited deep enough
+
+		// With no free stack, a pool's untouched stacks are taken before reserving another
+		static void* CreateAcquire(size_t totalStackSize, size_t initialStackSize, FreeList** freeStackList, StackPool* pool)
 		{
 			const size_t realTotalStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
 			const size_t realInitialStackSize = (initialStackSize + PAGE_MASK) & ~PAGE_MASK;
-			uint8_t* stackMem = reinterpret_cast<uint8_t*>(*freeStackList);
+			const bool recycled = *freeStackList != nullptr;
+			uint8_t* stackMem;
+
+			if (recycled)
+			{
+				FreeList** takeFrom = freeStackList;
+
+				// Rather a stack that's already commited as deep as asked, so it needs no commit at all
+				if (realInitialStackSize > PAGE_ALIGN)
+				{
+					FreeList** searchFrom = freeStackList;
+
+					for (unsigned searchIndex = 0; *searchFrom && searchIndex < COMMITED_SEARCH_DEPTH; ++searchIndex, searchFrom = &(*searchFrom)->next)
+					{
+						StackHeader* const header = reinterpret_cast<StackHeader*>(*searchFrom + 1);
+
+						if (static_cast<size_t>(reinterpret_cast<uint8_t*>(header + 1) - header->commitedLow) >= realInitialStackSize)
+						{
+							takeFrom = searchFrom;
+							break;
+						}
+					}
+				}
 
-			if (stackMem)
+				stackMem = FromFreeListNode(*takeFrom, realTotalStackSize);
+				*takeFrom = (*takeFrom)->next;
+			}
+			else if (pool && pool->untouchedCount)
 			{
-				*freeStackList = (*freeStackList)->next;
+				sanity(realTotalStackSize * pool->untouchedCount <= pool->size);
+
+				// Low to high, like the free list used to hand them out
+				stackMem = pool->mem + (pool->size - realTotalStackSize * pool->untouchedCount);
+				--pool->untouchedCount;
 			}
 			else
 			{
+#if USING(OS_WINDOWS)
 				stackMem = (uint8_t*)VirtualAlloc(nullptr, realTotalStackSize, MEM_RESERVE, PAGE_NOACCESS);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				void* const reserved = mmap(nullptr, realTotalStackSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+				stackMem = reserved != MAP_FAILED ? reinterpret_cast<uint8_t*>(reserved) : nullptr;
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
 			}
 
 			sanity(stackMem);
 			sanity(initialStackSize <= totalStackSize);
+			sanity(realInitialStackSize < realTotalStackSize && "The bottom page is reserved as the overflow guard");
 
 			uint8_t* const readWriteMem = stackMem + (realTotalStackSize - realInitialStackSize);
 
 			sanity((reinterpret_cast<uintptr_t>(readWriteMem) & PAGE_MASK) == 0);
-			VirtualAlloc(readWriteMem, realInitialStackSize, MEM_COMMIT, PAGE_READWRITE);
 
-			if (realInitialStackSize < realTotalStackSize)
+#if USING(OS_WINDOWS)
+#if USING(GUARD_UNUSED_STACK)
+			const bool commit = true;
+#else //#if USING(GUARD_UNUSED_STACK)
+			// Recycled stacks were left commited, guard page and all. Only recommit when asked for more than that.
+			const bool commit = !recycled || readWriteMem < ToHeader(stackMem, realTotalStackSize)->commitedLow;
+#endif //#else //#if USING(GUARD_UNUSED_STACK)
+
+			if (commit)
 			{
-				uint8_t* const guardPageMem = readWriteMem - PAGE_ALIGN;
+				VirtualAlloc(readWriteMem, realInitialStackSize, MEM_COMMIT, PAGE_READWRITE);
+
+				{
+					uint8_t* const guardPageMem = readWriteMem - PAGE_ALIGN;
 
-				sanity((reinterpret_cast<uintptr_t>(guardPageMem) & PAGE_MASK) == 0);
-				VirtualAlloc(guardPageMem, PAGE_ALIGN, MEM_COMMIT, PAGE_READONLY | PAGE_GUARD);
+					sanity((reinterpret_cast<uintptr_t>(guardPageMem) & PAGE_MASK) == 0);
+					VirtualAlloc(guardPageMem, PAGE_ALIGN, MEM_COMMIT, PAGE_READONLY | PAGE_GUARD);
+				}
+
+				StackHeader* const header = ToHeader(stackMem, realTotalStackSize);
+
+				header->reserveLow = stackMem;
+				header->commitedLow = readWriteMem;
+			}
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			// Nothing below the commited region is accessible, so the first touch of it faults into stack_grow::OnSegv.
+			// Unguarded recycled stacks are still commited past the initial size, so they take no syscalls here.
+			uint8_t* const commitedLow = recycled ? ToHeader(stackMem, realTotalStackSize)->commitedLow : stackMem + realTotalStackSize;
+
+			if (readWriteMem < commitedLow)
+			{
+				mprotect(readWriteMem, static_cast<size_t>(commitedLow - readWriteMem), PROT_READ | PROT_WRITE);
 			}
 
+			StackHeader* const header = ToHeader(stackMem, realTotalStackSize);
+
+			header->reserveLow = stackMem;
+			header->commitedLow = std::min(readWriteMem, commitedLow);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+
 			return stackMem;
 		}
 
-		static void Return(void* stack, size_t totalStackSize, FreeList** freeStackList)
+		// Reserves stackCount stacks at once. Nothing is commited: a stack's top is made read-write by CreateAcquire
+		// when it's first handed out, and the rest of the reservation stays inaccessible, guarding each stack from
+		// the one below. One syscall at thread start, and no commit for stacks a thread never gets to use.
+		static StackPool CreatePool(unsigned stackCount, size_t totalStackSize)
 		{
-			FreeList* const freeStack = reinterpret_cast<FreeList*>(stack);
+			const size_t realTotalStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+			StackPool pool{ nullptr, realTotalStackSize * stackCount, stackCount, {} };
 
-			{ // Make sure we can do freelist operations
-				DWORD oldProtect;
-				VirtualProtect(stack, PAGE_ALIGN, PAGE_READWRITE, &oldProtect);
-			}
+#if USING(OS_WINDOWS)
+			pool.mem = (uint8_t*)VirtualAlloc(nullptr, pool.size, MEM_RESERVE, PAGE_NOACCESS);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			void* const reserved = mmap(nullptr, pool.size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+			pool.mem = reserved != MAP_FAILED ? reinterpret_cast<uint8_t*>(reserved) : nullptr;
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+
+			sanity(pool.mem);
+
+			return pool;
+		}
+
+		static bool InPool(const StackPool& pool, const void* stack)
+		{
+			return stack >= pool.mem && stack < pool.mem + pool.size;
+		}
+
+		// Must not be called from the stack being returned. Switch off of it with SwitchOnTop first.
+		// Unless guarding unused stacks, the top hotStackSize of the stack stays commited for the next task, so
+		// tasks that stay within it never make a syscall. On linux, pages a task grew below that are handed back
+		// with MADV_FREE, which the kernel only acts on under memory pressure, and made inaccessible again so the
+		// next deep task regrows through stack_grow::OnSegv.
+		static void Return(void* stack, size_t totalStackSize, size_t hotStackSize, FreeList** freeStackList)
+		{
+			const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+			FreeList* const freeStack = ToFreeListNode(stack, realStackSize);
 
 			freeStack->next = *freeStackList;
 			*freeStackList = freeStack;
 
 #if USING(GUARD_UNUSED_STACK)
-			{ // Mark as much of the stack as we can as no access.
-				uint8_t* const noaccessStart = reinterpret_cast<uint8_t*>(stack) + PAGE_ALIGN;
-				const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+			{ // Decommit everything but the freelist page, so stray accesses to unused stacks fault.
 				const size_t noaccessSize = realStackSize - PAGE_ALIGN;
-				DWORD oldProtect;
 
-				sanity((reinterpret_cast<uintptr_t>(noaccessStart) & PAGE_MASK) == 0);
-				VirtualProtect(noaccessStart, noaccessSize, PAGE_NOACCESS, &oldProtect);
+#if USING(OS_WINDOWS)
+				VirtualFree(stack, noaccessSize, MEM_DECOMMIT);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				mprotect(stack, noaccessSize, PROT_NONE);
+				madvise(stack, noaccessSize, MADV_DONTNEED);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+
+				ToHeader(stack, realStackSize)->commitedLow = reinterpret_cast<uint8_t*>(stack) + noaccessSize;
 			}
-#else //#if USING(GUARD_UNUSED_STACK)
-			((void)totalStackSize);
-#endif //#else //#if USING(GUARD_UNUSED_STACK)
+			((void)hotStackSize);
+#elif USING(OS_LINUX) //#if USING(GUARD_UNUSED_STACK)
+			{
+				const size_t realHotStackSize = std::min((hotStackSize + PAGE_MASK) & ~PAGE_MASK, realStackSize); // Small stacks are all hot
+				uint8_t* const hotLow = reinterpret_cast<uint8_t*>(stack) + (realStackSize - realHotStackSize);
+				StackHeader* const header = ToHeader(stack, realStackSize);
+				uint8_t* const commitedLow = header->commitedLow;
+
+				if (commitedLow < hotLow)
+				{
+					const size_t coldSize = static_cast<size_t>(hotLow - commitedLow);
+
+					// MADV_FREE needs linux 4.5
+					if (madvise(commitedLow, coldSize, MADV_FREE) != 0)
+					{
+						madvise(commitedLow, coldSize, MADV_DONTNEED);
+					}
+
+					mprotect(commitedLow, coldSize, PROT_NONE);
+					header->commitedLow = hotLow;
+				}
+			}
+#else //#elif USING(OS_LINUX) //#if USING(GUARD_UNUSED_STACK)
+			((void)hotStackSize);
+#endif //#else //#elif USING(OS_LINUX) //#if USING(GUARD_UNUSED_STACK)
+		}
+
+		// Size of the commited top of the stack, including pages commited by guard page growth
+		static size_t CommitedSize(void* stack, size_t totalStackSize)
+		{
+			const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+			uint8_t* const stackMem = reinterpret_cast<uint8_t*>(stack);
+
+#if USING(OS_WINDOWS)
+			size_t commitedSize = 0;
+
+			while (commitedSize < realStackSize)
+			{
+				MEMORY_BASIC_INFORMATION pageInfo;
+
+				VirtualQuery(stackMem + (realStackSize - commitedSize - PAGE_ALIGN), &pageInfo, sizeof(pageInfo));
+				if (pageInfo.State != MEM_COMMIT || (pageInfo.Protect & PAGE_GUARD))
+				{
+					break;
+				}
+
+				commitedSize += PAGE_ALIGN;
+			}
+
+			return commitedSize;
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			return static_cast<size_t>((stackMem + realStackSize) - ToHeader(stack, realStackSize)->commitedLow);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		}
+
+		// For stacks from CreateAcquire that never go back on a free list
+		static void Release(void* stack, size_t totalStackSize)
+		{
+			const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+
+#if USING(OS_WINDOWS)
+			((void)realStackSize);
+			VirtualFree(stack, 0, MEM_RELEASE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			munmap(stack, realStackSize);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		}
+
+#if USING(TRIM_PARKED_STACKS)
+		// Decommits everything below the page holding sp, the lowest live byte of a switched out fiber. Stack
+		// pages go back to PROT_NONE, so the next touch faults into stack_grow::OnSegv as on a fresh stack.
+		// Arena slots only drop their pages, a mprotect would split the arena mapping. Returns bytes released.
+		static size_t DecommitBelow(StackHeader* header, const void* sp, bool arenaSlot)
+		{
+			uint8_t* const keepLow = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(sp) & ~PAGE_MASK);
+			uint8_t* const decommitLow = arenaSlot ? header->reserveLow : header->commitedLow;
+
+			if (decommitLow >= keepLow)
+			{
+				return 0;
+			}
+
+			const size_t decommitSize = static_cast<size_t>(keepLow - decommitLow);
+
+			madvise(decommitLow, decommitSize, MADV_DONTNEED);
+
+			if (!arenaSlot)
+			{
+				mprotect(decommitLow, decommitSize, PROT_NONE);
+				header->commitedLow = keepLow;
+			}
+
+			return decommitSize;
 		}
+#endif //#if USING(TRIM_PARKED_STACKS)
 
-		static void ReleaseAll(FreeList* freeList)
+		// Pool stacks go with the pool, they can't be released one by one on windows
+		static void ReleaseAll(FreeList* freeList, size_t totalStackSize, const StackPool& pool)
 		{
+			const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+
 			while (freeList)
 			{
 				FreeList* const next = freeList->next;
+				uint8_t* const stackMem = FromFreeListNode(freeList, realStackSize);
+
+				if (!InPool(pool, stackMem))
+				{
+					Release(stackMem, totalStackSize);
+				}
 
-				VirtualFree(freeList, 0, MEM_DECOMMIT | MEM_RELEASE);
 				freeList = next;
 			}
 		}
-	}
 
-	namespace task_thread
-	{
-		static constexpr size_t TASK_TOTAL_STACK_SIZE = 1*1024*1024;
-		static constexpr size_t TASK_INITIAL_STACK_SIZE = 4096;
+		static void ReleasePool(const StackPool& pool)
+		{
+			if (pool.mem)
+			{
+#if USING(OS_WINDOWS)
+				VirtualFree(pool.mem, 0, MEM_RELEASE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				munmap(pool.mem, pool.size);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			}
+		}
 
-		struct TaskContext
+#if USING(OS_LINUX)
+		// Every stack with its own reservation and PROT_NONE tail is at least two VMAs, and tens of thousands of
+		// them run into vm.max_map_count. The arena is one read-write MAP_NORESERVE mapping with a PROT_NONE page
+		// under it, two VMAs however many stacks are live. The kernel commits slot pages on first touch, so there
+		// are no guard pages between slots, a guard per slot would be the two VMAs per stack again. An overflow is
+		// caught after the fact, by the slot's bottom word no longer being zero when it's returned. It has already
+		// trampled the slot below by then, so that aborts, in release builds too.
+		static StackArena CreateArena(unsigned slotCount, size_t totalStackSize)
 		{
-			fiber::Fiber* taskFiber;
-			fiber::Fiber* rootFiber;
-			FreeList** freeStacks;
-			const fiber::FiberAPI* fiberAPI;
-			Task task;
-		};
+			const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+			const unsigned wordCount = (slotCount + 63) / 64;
+			const size_t arenaSize = PAGE_ALIGN + realStackSize * slotCount;
+			StackArena arena{};
+			void* const reserved = mmap(nullptr, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+			// Strict overcommit refuses a read-write reservation this size. Tasks fall back to their own stacks.
+			if (reserved == MAP_FAILED)
+			{
+				return arena;
+			}
 
-		static void FiberTask(void* userData)
+			arena.mem = reinterpret_cast<uint8_t*>(reserved);
+			arena.size = arenaSize;
+			arena.slotCount = slotCount;
+			arena.freeSlots = new uint64_t[wordCount * 2];
+			arena.dirtySlots = arena.freeSlots + wordCount;
+
+			mprotect(arena.mem, PAGE_ALIGN, PROT_NONE);
+
+#if USING(STACK_ARENA_HUGE_PAGES)
+			madvise(arena.mem + PAGE_ALIGN, realStackSize * slotCount, MADV_HUGEPAGE);
+#endif //#if USING(STACK_ARENA_HUGE_PAGES)
+
+			for (unsigned wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+			{
+				const unsigned wordSlotCount = std::min(slotCount - wordIndex * 64, 64u);
+
+				arena.freeSlots[wordIndex] = wordSlotCount == 64 ? ~0ull : (1ull << wordSlotCount) - 1;
+				arena.dirtySlots[wordIndex] = 0;
+			}
+
+			return arena;
+		}
+
+		static uint8_t* ArenaSlot(const StackArena& arena, unsigned slotIndex, size_t realStackSize)
+		{
+			return arena.mem + PAGE_ALIGN + realStackSize * slotIndex;
+		}
+
+		static bool InArena(const StackArena& arena, const void* stack)
+		{
+			return stack >= arena.mem && stack < arena.mem + arena.size;
+		}
+
+		// Takes the lowest free slot, so the same few slots stay warm. Returns nullptr once the arena is full.
+		// Slots are always fully accessible, commitedLow only marks the top paintedStackSize for stack profiling.
+		static void* ArenaAcquire(StackArena* arena, size_t totalStackSize, size_t paintedStackSize)
 		{
-			TaskContext* const taskCtx = reinterpret_cast<TaskContext*>(userData);
-			fiber::Fiber* const taskFiber = taskCtx->taskFiber;
-			FreeList** const freeStacks = taskCtx->freeStacks;
-			const fiber::FiberAPI& api = *taskCtx->fiberAPI;
-			void* const taskUserData = reinterpret_cast<void*>(taskCtx->task.userDataPtr);
+			const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+			const unsigned wordCount = (arena->slotCount + 63) / 64;
+
+			for (unsigned wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+			{
+				const uint64_t freeWord = arena->freeSlots[wordIndex];
+
+				if (freeWord)
+				{
+					const unsigned bitIndex = static_cast<unsigned>(__builtin_ctzll(freeWord));
+					uint8_t* const stackMem = ArenaSlot(*arena, wordIndex * 64 + bitIndex, realStackSize);
+					StackHeader* const header = ToHeader(stackMem, realStackSize);
+
+					arena->freeSlots[wordIndex] = freeWord & (freeWord - 1);
+					arena->dirtySlots[wordIndex] &= ~(1ull << bitIndex);
+
+					header->reserveLow = stackMem;
+					header->commitedLow = stackMem + (realStackSize - ((paintedStackSize + PAGE_MASK) & ~PAGE_MASK));
+
+					return stackMem;
+				}
+			}
+
+			return nullptr;
+		}
+
+		// Must not be called from the stack being returned. Switch off of it with SwitchOnTop first.
+		static void ArenaReturn(StackArena* arena, void* stack, size_t totalStackSize)
+		{
+			const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+			const unsigned slotIndex = static_cast<unsigned>((reinterpret_cast<uint8_t*>(stack) - ArenaSlot(*arena, 0, realStackSize)) / realStackSize);
+			const uint64_t slotBit = 1ull << (slotIndex & 63);
+
+			if (*reinterpret_cast<const uint64_t*>(stack) != 0)
+			{
+				static const char overflowMsg[] = "Fiber stack overflowed its arena slot\n";
+
+				(void)!write(STDERR_FILENO, overflowMsg, sizeof(overflowMsg) - 1);
+				abort();
+			}
+
+			sanity(!(arena->freeSlots[slotIndex / 64] & slotBit));
+
+			arena->freeSlots[slotIndex / 64] |= slotBit;
+			arena->dirtySlots[slotIndex / 64] |= slotBit;
+		}
+
+		// Hands back all but the top hotStackSize of every slot that ran a task since the last trim. A madvise
+		// per slot, so this is for idle time rather than every return.
+		static void TrimArena(StackArena* arena, size_t totalStackSize, size_t hotStackSize)
+		{
+			const size_t realStackSize = (totalStackSize + PAGE_ALLOC_MASK) & ~PAGE_ALLOC_MASK;
+			const size_t coldSize = realStackSize - ((hotStackSize + PAGE_MASK) & ~PAGE_MASK);
+			const unsigned wordCount = (arena->slotCount + 63) / 64;
+
+			for (unsigned wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+			{
+				for (uint64_t dirtyWord = arena->dirtySlots[wordIndex]; dirtyWord; dirtyWord &= dirtyWord - 1)
+				{
+					uint8_t* const stackMem = ArenaSlot(*arena, wordIndex * 64 + static_cast<unsigned>(__builtin_ctzll(dirtyWord)), realStackSize);
+
+					if (madvise(stackMem, coldSize, MADV_FREE) != 0)
+					{
+						madvise(stackMem, coldSize, MADV_DONTNEED);
+					}
+				}
+
+				arena->dirtySlots[wordIndex] = 0;
+			}
+		}
+
+		static void ReleaseArena(const StackArena& arena)
+		{
+			if (arena.mem)
+			{
+				munmap(arena.mem, arena.size);
+				delete[] arena.freeSlots;
+			}
+		}
+#endif //#if USING(OS_LINUX)
+	}
+
+#if USING(OS_LINUX)
+	// Task threads are pinned to their node's cpus and prefer their node's memory, so their stacks, arenas, and the
+	// task payloads they allocate stay local. Straight syscalls rather than libnuma. SCHEDULER_NUMA_NODES=<n> splits
+	// the cpus into n simulated nodes, to exercise the per node paths on single node machines. Simulated nodes are
+	// still pinned, but set no memory policy.
+	namespace numa
+	{
+		static constexpr const int MPOL_PREFERRED_MODE = 1; // linux/mempolicy.h MPOL_PREFERRED
+		static constexpr const unsigned MAX_NODES = 64;
+
+		// Parses a sysfs cpu list, "0-3,8-11", calling OnCpu with each id
+		template<typename OnCpuT>
+		static void ParseCpuList(const char* cpuList, const OnCpuT& OnCpu)
+		{
+			while (*cpuList >= '0' && *cpuList <= '9')
+			{
+				char* end;
+				const unsigned long firstCpu = strtoul(cpuList, &end, 10);
+				unsigned long lastCpu = firstCpu;
+
+				if (*end == '-')
+				{
+					lastCpu = strtoul(end + 1, &end, 10);
+				}
+
+				for (unsigned long cpu = firstCpu; cpu <= lastCpu && cpu < CPU_SETSIZE; ++cpu)
+				{
+					OnCpu(static_cast<unsigned>(cpu));
+				}
+
+				cpuList = *end == ',' ? end + 1 : end;
+			}
+		}
+
+		static bool ReadCpuList(const char* path, char* cpuList, int cpuListSize)
+		{
+			bool read = false;
+
+			if (FILE* const file = fopen(path, "r"))
+			{
+				read = fgets(cpuList, cpuListSize, file) != nullptr;
+				fclose(file);
+			}
+
+			return read;
+		}
+
+		// Only the cpus the creating thread may run on, so a cpuset or taskset limits the scheduler too
+		static NumaTopology Discover()
+		{
+			NumaTopology topology{ {}, {}, 1, false, {} };
+			cpu_set_t allowedCpus;
+			char cpuList[1024];
+
+			CPU_ZERO(&allowedCpus);
+			if (sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) == 0)
+			{
+				for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+				{
+					if (CPU_ISSET(cpu, &allowedCpus))
+					{
+						topology.cpus.push_back(cpu);
+					}
+				}
+			}
+			else if (ReadCpuList("/sys/devices/system/cpu/online", cpuList, sizeof(cpuList)))
+			{
+				ParseCpuList(cpuList, [&topology](unsigned cpu) { topology.cpus.push_back(cpu); });
+			}
+
+			if (topology.cpus.empty())
+			{
+				topology.cpus.push_back(0);
+			}
+
+			topology.cpuNodes.assign(topology.cpus.back() + 1, 0);
+
+			if (const char* const simulateNodes = getenv("SCHEDULER_NUMA_NODES"))
+			{
+				topology.nodeCount = std::clamp(static_cast<unsigned>(strtoul(simulateNodes, nullptr, 10)), 1u, MAX_NODES);
+				topology.simulated = true;
+				return topology;
+			}
+
+			for (unsigned node = 0; node < MAX_NODES; ++node)
+			{
+				char path[64];
+
+				snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+				if (ReadCpuList(path, cpuList, sizeof(cpuList)))
+				{
+					std::vector<uint8_t>* const cpuNodes = &topology.cpuNodes;
+
+					ParseCpuList(cpuList, [cpuNodes, node](unsigned cpu)
+					{
+						if (cpu < cpuNodes->size())
+						{
+							(*cpuNodes)[cpu] = static_cast<uint8_t>(node);
+						}
+					});
+				}
+			}
+
+			// Nodes none of our cpus are on don't count, node ids can be sparse too
+			for (const unsigned cpu : topology.cpus)
+			{
+				topology.nodeCount = std::max(topology.nodeCount, topology.cpuNodes[cpu] + 1u);
+			}
+
+			return topology;
+		}
+
+		// Task thread i runs on the ith cpu we may use's node, as windows pins it to cpu i. Simulated nodes take
+		// threads in turn, however few cpus there are.
+		static unsigned NodeOf(const NumaTopology& topology, unsigned threadIndex)
+		{
+			if (topology.simulated)
+			{
+				return threadIndex % topology.nodeCount;
+			}
+
+			return topology.cpus.empty() ? 0 : topology.cpuNodes[topology.cpus[threadIndex % topology.cpus.size()]];
+		}
+
+		// On the task thread, before it allocates anything. Narrows the affinity it inherited to its node's share
+		// of it. Nothing to do on one node, or simulated ones, which have no real placement.
+		static void EnterNode(const NumaTopology& topology, unsigned node)
+		{
+			if (topology.nodeCount == 1 || topology.simulated)
+			{
+				return;
+			}
+
+			cpu_set_t nodeCpus;
+			unsigned nodeCpuCount = 0;
+
+			CPU_ZERO(&nodeCpus);
+			for (const unsigned cpu : topology.cpus)
+			{
+				if (topology.cpuNodes[cpu] == node)
+				{
+					CPU_SET(cpu, &nodeCpus);
+					++nodeCpuCount;
+				}
+			}
+
+			if (nodeCpuCount)
+			{
+				sched_setaffinity(0, sizeof(nodeCpus), &nodeCpus);
+			}
+
+			const unsigned long nodeMask = 1ul << node;
+
+			syscall(SYS_set_mempolicy, MPOL_PREFERRED_MODE, &nodeMask, MAX_NODES + 1);
+		}
+
+		// For memory other threads may fault in, which the thread policy doesn't cover
+		static void Bind(const NumaTopology& topology, void* mem, size_t size, unsigned node)
+		{
+			if (mem && !topology.simulated && topology.nodeCount > 1)
+			{
+				const unsigned long nodeMask = 1ul << node;
+
+				syscall(SYS_mbind, mem, size, MPOL_PREFERRED_MODE, &nodeMask, MAX_NODES + 1, 0);
+			}
+		}
+	}
+#endif //#if USING(OS_LINUX)
+
+	// Free stacks are per task thread, so a thread that burst through thousands of tasks would keep their stacks
+	// while the others reserve fresh ones. Threads over a high watermark spill a batch of their coldest stacks
+	// here, and threads that run dry take a batch before reserving. Pool stacks never move, they go with their
+	// thread's pool. Spilled stacks stay mapped until scheduler::Destroy, so a pop racing another thread can
+	// always read the batch it lost.
+	namespace stack_exchange
+	{
+		static constexpr const unsigned TAG_SHIFT = 48;
+		static constexpr const uint64_t BATCH_MASK = (1ull << TAG_SHIFT) - 1;
+
+		static StackBatch* ToBatch(uint64_t top)
+		{
+			return reinterpret_cast<StackBatch*>(top & BATCH_MASK);
+		}
+
+		static uint64_t NextTop(uint64_t top, StackBatch* batch)
+		{
+			sanity((reinterpret_cast<uintptr_t>(batch) & ~BATCH_MASK) == 0);
+
+			return ((top >> TAG_SHIFT) + 1) << TAG_SHIFT | reinterpret_cast<uintptr_t>(batch);
+		}
+
+		static void Push(StackExchange* exchange, StackBatch* batch)
+		{
+			uint64_t top = exchange->top.load(std::memory_order_relaxed);
+
+			do
+			{
+				batch->nextBatch = ToBatch(top);
+			} while (!exchange->top.compare_exchange_weak(top, NextTop(top, batch), std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		static StackBatch* Pop(StackExchange* exchange)
+		{
+			uint64_t top = exchange->top.load(std::memory_order_acquire);
+
+			while (StackBatch* const batch = ToBatch(top))
+			{
+				if (exchange->top.compare_exchange_weak(top, NextTop(top, batch->nextBatch), std::memory_order_acquire, std::memory_order_acquire))
+				{
+					return batch;
+				}
+			}
+
+			return nullptr;
+		}
+
+		// Leaves the keepCount most recently returned stacks, they're the warm ones, and spills up to batchSize of
+		// the rest. Unlinking walks the list, which is only ever a little past the watermark.
+		static void Spill(StackExchange* exchange, FreeStacks* freeStacks, unsigned keepCount, unsigned batchSize, size_t totalStackSize, const StackPool& pool)
+		{
+			const size_t realStackSize = (totalStackSize + stack_alloc::PAGE_ALLOC_MASK) & ~stack_alloc::PAGE_ALLOC_MASK;
+			FreeList** link = &freeStacks->list;
+			FreeList* batchStacks = nullptr;
+			unsigned batchCount = 0;
+
+			for (unsigned skipIndex = 0; *link && skipIndex < keepCount; ++skipIndex)
+			{
+				link = &(*link)->next;
+			}
+
+			while (*link && batchCount < batchSize)
+			{
+				FreeList* const freeStack = *link;
+
+				if (stack_alloc::InPool(pool, stack_alloc::FromFreeListNode(freeStack, realStackSize)))
+				{
+					link = &freeStack->next;
+					continue;
+				}
+
+				*link = freeStack->next;
+				freeStack->next = batchStacks;
+				batchStacks = freeStack;
+				++batchCount;
+			}
+
+			if (batchCount)
+			{
+				StackBatch* const batch = reinterpret_cast<StackBatch*>(reinterpret_cast<uint8_t*>(batchStacks) - offsetof(StackBatch, stacks));
+
+				batch->count = batchCount;
+				freeStacks->count -= batchCount;
+				Push(exchange, batch);
+			}
+		}
+
+		static bool Refill(StackExchange* exchange, FreeStacks* freeStacks)
+		{
+			StackBatch* const batch = Pop(exchange);
+
+			if (!batch)
+			{
+				return false;
+			}
+
+			FreeList** tail = &batch->stacks.next;
+
+			while (*tail)
+			{
+				tail = &(*tail)->next;
+			}
+
+			*tail = freeStacks->list;
+			freeStacks->list = &batch->stacks;
+			freeStacks->count += static_cast<unsigned>(batch->count);
+
+			return true;
+		}
+
+		// Once every task thread has exited
+		static void ReleaseAll(StackExchange* exchange, size_t totalStackSize)
+		{
+			while (StackBatch* const batch = Pop(exchange))
+			{
+				stack_alloc::ReleaseAll(&batch->stacks, totalStackSize, StackPool{});
+			}
+		}
+	}
+
+#if USING(OS_LINUX)
+	// Linux has no PAGE_GUARD, so task stacks are reserved PROT_NONE and grown from a SIGSEGV handler.
+	// The handler runs on a per thread sigaltstack, since the faulting stack is the one out of room.
+	namespace stack_grow
+	{
+		static constexpr const size_t ALT_STACK_SIZE = 64 * 1024;
+
+		static thread_local stack_alloc::StackHeader* t_runningStack = nullptr; // The task stack this thread is on, if any
+		static struct sigaction s_prevSegvAction;
+		static unsigned s_installCount = 0;
+
+		static void OnSegv(int sig, siginfo_t* info, void* ucontext)
+		{
+			stack_alloc::StackHeader* const stack = t_runningStack;
+			uint8_t* const faultAddr = reinterpret_cast<uint8_t*>(info->si_addr);
+
+			if (stack && faultAddr >= stack->reserveLow && faultAddr < stack->commitedLow)
+			{
+				if (faultAddr >= stack->reserveLow + stack_alloc::PAGE_ALIGN)
+				{
+					uint8_t* const faultPage = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(faultAddr) & ~stack_alloc::PAGE_MASK);
+
+					// Commit everything down to the fault, so the commited region stays contiguous
+					if (mprotect(faultPage, static_cast<size_t>(stack->commitedLow - faultPage), PROT_READ | PROT_WRITE) == 0)
+					{
+						stack->commitedLow = faultPage;
+						return; // Retry the faulting access
+					}
+				}
+				else
+				{
+					static const char overflowMsg[] = "Fiber stack overflow\n";
+
+					(void)!write(STDERR_FILENO, overflowMsg, sizeof(overflowMsg) - 1);
+				}
+			}
+
+			// Not a growth fault. Hand it to whoever was installed before us, or die on the retried access.
+			if (s_prevSegvAction.sa_flags & SA_SIGINFO)
+			{
+				s_prevSegvAction.sa_sigaction(sig, info, ucontext);
+			}
+			else if (s_prevSegvAction.sa_handler != SIG_DFL && s_prevSegvAction.sa_handler != SIG_IGN)
+			{
+				s_prevSegvAction.sa_handler(sig);
+			}
+			else
+			{
+				signal(SIGSEGV, SIG_DFL);
+			}
+		}
+
+		// Called by scheduler::Create and Destroy, from the main thread
+		static void Install()
+		{
+			if (s_installCount++ == 0)
+			{
+				struct sigaction action{};
+
+				action.sa_sigaction = &OnSegv;
+				action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+				sigemptyset(&action.sa_mask);
+				sigaction(SIGSEGV, &action, &s_prevSegvAction);
+			}
+		}
+
+		static void Uninstall()
+		{
+			sanity(s_installCount > 0);
+
+			if (--s_installCount == 0)
+			{
+				sigaction(SIGSEGV, &s_prevSegvAction, nullptr);
+			}
+		}
+
+		static void* AddAltStack()
+		{
+			void* const altStackMem = mmap(nullptr, ALT_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			stack_t altStack{};
+
+			sanity(altStackMem != MAP_FAILED);
+
+			altStack.ss_sp = altStackMem;
+			altStack.ss_size = ALT_STACK_SIZE;
+			sigaltstack(&altStack, nullptr);
+
+			return altStackMem;
+		}
+
+		static void RemoveAltStack(void* altStackMem)
+		{
+			stack_t altStack{};
+
+			altStack.ss_flags = SS_DISABLE;
+			sigaltstack(&altStack, nullptr);
+			munmap(altStackMem, ALT_STACK_SIZE);
+		}
+	}
+#endif //#if USING(OS_LINUX)
+
+	namespace stack_grow
+	{
+		// Tells the fault handler which stack to grow. Call with nullptr when switching back to the root fiber.
+		static void SetRunning(fiber::Fiber* taskFiber)
+		{
+#if USING(OS_LINUX)
+			t_runningStack = taskFiber ? stack_alloc::ToHeader(taskFiber) : nullptr;
+#else //#if USING(OS_LINUX)
+			((void)taskFiber); // PAGE_GUARD grows windows stacks
+#endif //#else //#if USING(OS_LINUX)
+		}
+	}
+
+#if USING(TRIM_PARKED_STACKS)
+	// A fiber suspended in task::Wait keeps its whole commited stack, however long the task it waits on takes. Each
+	// task thread tracks the fibers it suspends, and trims the ones that have waited past PARKED_STACK_TRIM_MS down
+	// to their live frames on its way round its loop. Only that thread resumes them, so trimming can't race a resume.
+	namespace stack_trim
+	{
+		static uint64_t Now()
+		{
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		// On the fiber's thread, once the fiber is on the waiter list
+		static void Park(TaskThread* thread, fiber::Fiber* fiber)
+		{
+			stack_alloc::StackHeader* const header = stack_alloc::ToHeader(fiber);
+
+			header->parkedAt = Now();
+			header->parkedIndex = static_cast<uint32_t>(thread->parkedFibers.size());
+			header->parkedTrimmed = 0;
+			thread->parkedFibers.push_back(fiber);
+		}
+
+		// On the fiber's thread, before switching to it. Yields and waits on finished tasks never parked.
+		static void Unpark(TaskThread* thread, fiber::Fiber* fiber)
+		{
+			stack_alloc::StackHeader* const header = stack_alloc::ToHeader(fiber);
+
+			if (!header->parkedAt)
+			{
+				return;
+			}
+
+			const uint32_t parkedIndex = header->parkedIndex;
+			fiber::Fiber* const last = thread->parkedFibers.back();
+
+			sanity(parkedIndex < thread->parkedFibers.size() && thread->parkedFibers[parkedIndex] == fiber);
+
+			thread->parkedFibers[parkedIndex] = last;
+			stack_alloc::ToHeader(last)->parkedIndex = parkedIndex;
+			thread->parkedFibers.pop_back();
+			header->parkedAt = 0; // Stacks go back to the free lists like this, so a reused header reads as not parked
+		}
+
+		// On the owning thread. Only scans a few times per threshold, parked fibers can number in the thousands.
+		static void TrimParked(scheduler::Scheduler* sch, TaskThread* thread)
+		{
+			if (thread->parkedFibers.empty())
+			{
+				return;
+			}
+
+			const uint64_t now = Now();
+
+			if (now - thread->lastParkedScan < PARKED_STACK_TRIM_MS / 4)
+			{
+				return;
+			}
+
+			thread->lastParkedScan = now;
+
+			for (fiber::Fiber* const parked : thread->parkedFibers)
+			{
+				stack_alloc::StackHeader* const header = stack_alloc::ToHeader(parked);
+
+				if (!header->parkedTrimmed && now - header->parkedAt >= PARKED_STACK_TRIM_MS)
+				{
+					const bool arenaSlot = stack_alloc::InArena(thread->stackArena, header->reserveLow);
+					const size_t trimmedBytes = stack_alloc::DecommitBelow(header, parked->sp, arenaSlot);
+
+					header->parkedTrimmed = 1;
+
+					sch->parkedTrims.fetch_add(1, std::memory_order_relaxed);
+					sch->parkedTrimmedBytes.fetch_add(trimmedBytes, std::memory_order_relaxed);
+				}
+			}
+		}
+	}
+#endif //#if USING(TRIM_PARKED_STACKS)
+
+	// How much stack each task function needed commited, so its next run commits that up front rather than
+	// faulting a page at a time. A run that never grew past what it started with doesn't say how much of that it
+	// used, so after DECAY_RUNS of those in a row the depth is halved. A function that still needs it grows once
+	// and is back at its peak.
+	namespace stack_depth
+	{
+		static constexpr unsigned DECAY_RUNS = 64;
+
+		static StackDepth* Entry(StackDepths* depths, void(*TaskFunc)(void*))
+		{
+			const uint64_t hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(TaskFunc)) * 0x9E3779B97F4A7C15ull;
+
+			return depths->entries + (hash >> (64 - STACK_DEPTH_TABLE_SIZE_LG2));
+		}
+
+		// 0 for task functions without a recorded depth
+		static size_t Find(StackDepths* depths, void(*TaskFunc)(void*))
+		{
+			const StackDepth* const entry = Entry(depths, TaskFunc);
+
+			return entry->TaskFunc == TaskFunc ? entry->depth : 0;
+		}
+
+		static void Record(StackDepths* depths, void(*TaskFunc)(void*), size_t startCommitedSize, size_t endCommitedSize)
+		{
+			StackDepth* const entry = Entry(depths, TaskFunc);
+
+			if (entry->TaskFunc != TaskFunc)
+			{
+				*entry = StackDepth{ TaskFunc, 0, 0, {} };
+			}
+
+			if (endCommitedSize > startCommitedSize)
+			{
+				entry->depth = std::max(entry->depth, endCommitedSize);
+				entry->quietRuns = 0;
+			}
+			else if (++entry->quietRuns == DECAY_RUNS)
+			{
+				entry->depth /= 2;
+				entry->quietRuns = 0;
+			}
+		}
+	}
+
+	// TaskRefs and task payloads up to 1KB come from page sized slabs, one size class per chunk, owned by the thread
+	// that created the task, so creating and finishing tasks never touches the heap or a lock. The owner allocates
+	// and frees through plain free lists; any other thread pushes onto the owner's remote free list, which the owner takes back whole once
+	// its local list runs dry. Chunks stay mapped until scheduler::Destroy, as other threads may still be freeing
+	// into them after their owner exits.
+	namespace task_alloc
+	{
+		static constexpr const unsigned TASK_REF_CLASS = 0;
+		static constexpr const unsigned FIRST_PAYLOAD_CLASS = 1;
+		static constexpr const size_t BLOCK_SIZES[TaskAlloc::BLOCK_CLASS_COUNT] = { 128, 128, 256, 512, 1024 }; // Blocks are aligned to their size
+		static constexpr const size_t CHUNK_SIZE = size_t(TaskAlloc::PAGE_SIZE) * TaskAlloc::CHUNK_PAGE_COUNT;
+		static constexpr const size_t SLOT_TABLE_CHUNK_COUNT = 2048; // 1GB reserved, a little under 8M live tasks
+
+		static_assert(sizeof(TaskRef) <= BLOCK_SIZES[TASK_REF_CLASS]);
+		static_assert(sizeof(TaskPage) <= BLOCK_SIZES[TASK_REF_CLASS]);
+
+		// Set for task and reactor threads, and the thread that called scheduler::Create
+		static thread_local TaskAlloc* t_taskAlloc = nullptr;
+
+		// The smallest payload class that fits, or BLOCK_CLASS_COUNT if the payload needs the heap
+		static unsigned PayloadClassFor(size_t size, size_t alignment)
+		{
+			const size_t blockSize = std::max(size, alignment);
+			unsigned blockClass = FIRST_PAYLOAD_CLASS;
+
+			while (blockClass < TaskAlloc::BLOCK_CLASS_COUNT && BLOCK_SIZES[blockClass] < blockSize)
+			{
+				++blockClass;
+			}
+
+			return blockClass;
+		}
+
+		static TaskPage* ToPage(void* block)
+		{
+			return reinterpret_cast<TaskPage*>(reinterpret_cast<uintptr_t>(block) & ~uintptr_t(TaskAlloc::PAGE_MASK));
+		}
+
+		static uint8_t* MapChunk()
+		{
+#if USING(OS_WINDOWS)
+			// Already 64KB aligned
+			return reinterpret_cast<uint8_t*>(VirtualAlloc(nullptr, CHUNK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			// Map a page extra so the chunk can be PAGE_SIZE aligned, then hand back what's left over either side
+			const size_t mappedSize = CHUNK_SIZE + TaskAlloc::PAGE_SIZE;
+			void* const mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+			if (mapped == MAP_FAILED)
+			{
+				return nullptr;
+			}
+
+			uint8_t* const mappedMem = reinterpret_cast<uint8_t*>(mapped);
+			uint8_t* const chunk = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(mappedMem) + TaskAlloc::PAGE_MASK) & ~uintptr_t(TaskAlloc::PAGE_MASK));
+			const size_t headSize = chunk - mappedMem;
+
+			if (headSize)
+			{
+				munmap(mappedMem, headSize);
+			}
+			if (headSize < TaskAlloc::PAGE_SIZE)
+			{
+				munmap(chunk + CHUNK_SIZE, TaskAlloc::PAGE_SIZE - headSize);
+			}
+
+			return chunk;
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+		}
+
+		static void CreateSlotTable(TaskSlotTable* table)
+		{
+			table->mem = nullptr;
+			table->size = CHUNK_SIZE * SLOT_TABLE_CHUNK_COUNT;
+			table->reserved = nullptr;
+			table->reservedSize = table->size;
+
+#if USING(OS_WINDOWS)
+			// Already 64KB aligned, chunks are commited as they're handed out
+			table->reserved = reinterpret_cast<uint8_t*>(VirtualAlloc(nullptr, table->size, MEM_RESERVE, PAGE_NOACCESS));
+			table->mem = table->reserved;
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			// The kernel commits pages on first touch. A page extra so mem can be PAGE_SIZE aligned.
+			table->reservedSize = table->size + TaskAlloc::PAGE_SIZE;
+
+			void* const reserved = mmap(nullptr, table->reservedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+			if (reserved != MAP_FAILED)
+			{
+				table->reserved = reinterpret_cast<uint8_t*>(reserved);
+				table->mem = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(table->reserved) + TaskAlloc::PAGE_MASK) & ~uintptr_t(TaskAlloc::PAGE_MASK));
+			}
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+
+			sanity(table->mem);
+
+			table->usedChunks.store(0, std::memory_order_relaxed);
+		}
+
+		static uint8_t* TakeSlotChunk(TaskSlotTable* table)
+		{
+			const size_t chunkIndex = table->usedChunks.fetch_add(1, std::memory_order_relaxed);
+
+			sanity(chunkIndex < SLOT_TABLE_CHUNK_COUNT && "Too many live tasks");
+
+			uint8_t* const chunk = table->mem + chunkIndex * CHUNK_SIZE;
+
+#if USING(OS_WINDOWS)
+			VirtualAlloc(chunk, CHUNK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+#endif //#if USING(OS_WINDOWS)
+
+			return chunk;
+		}
+
+		static void ReleaseSlotTable(TaskSlotTable* table)
+		{
+			if (table->reserved)
+			{
+#if USING(OS_WINDOWS)
+				VirtualFree(table->reserved, 0, MEM_RELEASE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				munmap(table->reserved, table->reservedSize);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			}
+
+			table->mem = nullptr;
+			table->reserved = nullptr;
+		}
+
+		static FreeList* CarvePage(TaskAlloc* alloc, unsigned blockClass)
+		{
+			if (alloc->freshPageCount[blockClass] == 0)
+			{
+				uint8_t* chunk;
+
+				if (blockClass == TASK_REF_CLASS)
+				{
+					chunk = TakeSlotChunk(alloc->slotTable);
+				}
+				else
+				{
+					chunk = MapChunk();
+
+					sanity(chunk);
+
+					reinterpret_cast<TaskPage*>(chunk)->nextChunk = alloc->chunks;
+					alloc->chunks = reinterpret_cast<TaskPage*>(chunk);
+				}
+
+				alloc->freshPages[blockClass] = chunk;
+				alloc->freshPageCount[blockClass] = TaskAlloc::CHUNK_PAGE_COUNT;
+			}
+
+			uint8_t* const pageMem = alloc->freshPages[blockClass];
+			TaskPage* const page = reinterpret_cast<TaskPage*>(pageMem);
+			const size_t blockSize = BLOCK_SIZES[blockClass];
+			FreeList* blocks = nullptr;
+
+			alloc->freshPages[blockClass] += TaskAlloc::PAGE_SIZE;
+			--alloc->freshPageCount[blockClass];
+
+			page->owner = alloc;
+			page->blockClass = blockClass;
+
+			// Backwards, so the free list hands them out low to high. The header takes the first block.
+			for (size_t blockOffset = TaskAlloc::PAGE_SIZE - blockSize; blockOffset >= blockSize; blockOffset -= blockSize)
+			{
+				FreeList* const block = reinterpret_cast<FreeList*>(pageMem + blockOffset);
+
+				block->next = blocks;
+				blocks = block;
+			}
+
+			return blocks;
+		}
+
+		static void* Alloc(TaskAlloc* alloc, unsigned blockClass)
+		{
+			FreeList* block = alloc->unusedBlocks[blockClass];
+
+			if (!block)
+			{
+				// Only the owner ever takes from the remote list, and always all of it, so there's no ABA
+				block = alloc->remoteFreed[blockClass].exchange(nullptr, std::memory_order_acquire);
+
+				if (!block)
+				{
+					block = CarvePage(alloc, blockClass);
+				}
+			}
+
+			alloc->unusedBlocks[blockClass] = block->next;
+			return block;
+		}
+
+		// From the calling thread's own TaskAlloc if it's one of sch's, otherwise from the one every other thread
+		// shares. Blocks freed into that one always come back through remoteFreed, none of its users own it.
+		static void* Alloc(scheduler::Scheduler* sch, unsigned blockClass)
+		{
+			if (t_taskAlloc && t_taskAlloc->slotTable == &sch->taskSlots)
+			{
+				return Alloc(t_taskAlloc, blockClass);
+			}
+
+			thread::Lock(&sch->foreignLock);
+			void* const block = Alloc(&sch->foreignAlloc, blockClass);
+			thread::Unlock(&sch->foreignLock);
+
+			return block;
+		}
+
+		static void Free(void* mem)
+		{
+			TaskPage* const page = ToPage(mem);
+			TaskAlloc* const owner = page->owner;
+			FreeList* const block = reinterpret_cast<FreeList*>(mem);
+
+			if (owner == t_taskAlloc)
+			{
+				block->next = owner->unusedBlocks[page->blockClass];
+				owner->unusedBlocks[page->blockClass] = block;
+			}
+			else
+			{
+				std::atomic<FreeList*>* const remoteFreed = owner->remoteFreed + page->blockClass;
+				FreeList* top = remoteFreed->load(std::memory_order_relaxed);
+
+				do
+				{
+					block->next = top;
+				} while (!remoteFreed->compare_exchange_weak(top, block, std::memory_order_release, std::memory_order_relaxed));
+			}
+		}
+
+		static void FreePayload(const Task& task)
+		{
+			if (task.ownedPtr)
+			{
+				void* const userData = reinterpret_cast<void*>(task.userDataPtr);
+
+				if (task.slabPtr)
+				{
+					Free(userData);
+				}
+				else
+				{
+#if USING(OS_WINDOWS)
+					_aligned_free(userData);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+					free(userData);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				}
+			}
+		}
+
+		// Every thread that could free into alloc must be done with it. Its TaskRefs go with the TaskSlotTable.
+		static void ReleaseAll(TaskAlloc* alloc)
+		{
+			for (TaskPage* chunk = alloc->chunks; chunk;)
+			{
+				TaskPage* const nextChunk = chunk->nextChunk;
+
+#if USING(OS_WINDOWS)
+				VirtualFree(chunk, 0, MEM_RELEASE);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				munmap(chunk, CHUNK_SIZE);
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+
+				chunk = nextChunk;
+			}
+
+			for (unsigned blockClass = 0; blockClass < TaskAlloc::BLOCK_CLASS_COUNT; ++blockClass)
+			{
+				alloc->unusedBlocks[blockClass] = nullptr;
+				alloc->freshPages[blockClass] = nullptr;
+				alloc->freshPageCount[blockClass] = 0;
+				alloc->remoteFreed[blockClass].store(nullptr, std::memory_order_relaxed);
+			}
+
+			alloc->chunks = nullptr;
+		}
+	}
+
+	// What the calling thread is to the scheduler. Set by task ThreadMain, and by scheduler::Create for its caller,
+	// which stands in for task thread 0 but never runs tasks.
+	namespace this_thread
+	{
+		using SwitchOnTopFunc = void(fiber::Fiber* curFiber, fiber::Fiber* toFiber, fiber::FiberFunc onTop, void* arg);
+
+		// Only on task threads, which run tasks on fibers
+		struct Worker
+		{
+			fiber::Fiber* rootFiber;
+			SwitchOnTopFunc* SwitchOnTop; // fiber::Api<FiberOpts>::SwitchOnTop of the thread's options
+		};
+
+		static thread_local scheduler::Scheduler* t_scheduler = nullptr;
+		static thread_local TaskThread* t_taskThread = nullptr;
+		static thread_local const Worker* t_worker = nullptr;
+
+		// Whose tasks threads the scheduler didn't start create, run and wait on. See scheduler::SetDefault.
+		static std::atomic<scheduler::Scheduler*> s_defaultScheduler{ nullptr };
+
+		static scheduler::Scheduler* Scheduler()
+		{
+			scheduler::Scheduler* const sch = t_scheduler ? t_scheduler : s_defaultScheduler.load(std::memory_order_acquire);
+
+			sanity(sch && "No scheduler to run tasks on, see scheduler::SetDefault");
+
+			return sch;
+		}
+
+		// The calling thread's TaskThread, if it's one of sch's. Task threads and the thread that called
+		// scheduler::Create have one.
+		static TaskThread* TaskThreadOf(const scheduler::Scheduler* sch)
+		{
+			return t_scheduler == sch ? t_taskThread : nullptr;
+		}
+	}
+
+	// A TaskHandle is its TaskRef's index in the TaskSlotTable plus the generation the slot had when the task was
+	// created, so copying one touches nothing shared. A finished task's slot goes back to its TaskAlloc and is
+	// handed out again under the next generation, so a stale handle reads as finished.
+	namespace task_ref
+	{
+		static constexpr const uint64_t TASK_CREATED = 0;
+		static constexpr const uint64_t TASK_QUEUED = 1;
+		static constexpr const uint64_t TASK_DONE = 2;
+		static constexpr const uint64_t TASK_STATUS_MASK = 0x3;
+		static constexpr const uint64_t TASK_SLEEPERS = 0x4; // A thread off the workers is waiting on state
+		static constexpr const uint64_t SLOT_INDEX_MASK = 0xffffffff;
+		static constexpr const unsigned GENERATION_SHIFT = 32;
+
+		// TaskRef::waiters is a TaskWaiter pointer in the low 48 bits and the low 16 bits of the generation above
+		// that, so a waiter holding a stale handle can't join the list of the slot's next task.
+		static constexpr const unsigned WAITERS_TAG_SHIFT = 48;
+		static constexpr const uint64_t WAITERS_PTR_MASK = (1ull << WAITERS_TAG_SHIFT) - 1;
+		static constexpr const uint64_t WAITERS_CLOSED = 1; // In place of the pointer once the task is done
+
+		static uint64_t WaitersTag(uint64_t generation)
+		{
+			return (generation & 0xffff) << WAITERS_TAG_SHIFT;
+		}
+
+		static TaskRef* Create(scheduler::Scheduler* sch)
+		{
+			TaskRef* const taskRef = reinterpret_cast<TaskRef*>(task_alloc::Alloc(sch, task_alloc::TASK_REF_CLASS));
+			const uint64_t generation = (taskRef->state.load(std::memory_order_relaxed) >> GENERATION_SHIFT) + 1;
+
+			taskRef->state.store(generation << GENERATION_SHIFT | TASK_CREATED, std::memory_order_relaxed);
+			taskRef->waiters.store(WaitersTag(generation), std::memory_order_relaxed);
+			taskRef->task.taskRef = taskRef;
+
+			return taskRef;
+		}
+
+		static uint64_t ToHandleData(const TaskSlotTable& table, const TaskRef* taskRef)
+		{
+			const uint64_t slotIndex = (reinterpret_cast<const uint8_t*>(taskRef) - table.mem) / task_alloc::BLOCK_SIZES[task_alloc::TASK_REF_CLASS];
+			const uint64_t generation = taskRef->state.load(std::memory_order_relaxed) >> GENERATION_SHIFT;
+
+			return generation << GENERATION_SHIFT | slotIndex;
+		}
+
+		// Slot 0 is the first page's header, so a null handle never names a task
+		static TaskRef* FromHandleData(const TaskSlotTable& table, uint64_t handleData)
+		{
+			const uint64_t slotIndex = handleData & SLOT_INDEX_MASK;
+
+			sanity(slotIndex * task_alloc::BLOCK_SIZES[task_alloc::TASK_REF_CLASS] < table.usedChunks.load(std::memory_order_relaxed) * task_alloc::CHUNK_SIZE && "Not a task handle");
+
+			return reinterpret_cast<TaskRef*>(table.mem + slotIndex * task_alloc::BLOCK_SIZES[task_alloc::TASK_REF_CLASS]);
+		}
+
+		// One load. A slot that moved on to another generation finished its task first.
+		static bool IsDone(const TaskSlotTable& table, uint64_t handleData)
+		{
+			const uint64_t state = FromHandleData(table, handleData)->state.load(std::memory_order_acquire);
+
+			return (state >> GENERATION_SHIFT) != (handleData >> GENERATION_SHIFT) || (state & TASK_STATUS_MASK) == TASK_DONE;
+		}
+
+		// Called on the task's thread once the task function returns. Suspended waiters go back to their own
+		// threads the way a yield does, through this thread's stalledTasks. The slot is free for reuse after this.
+		static void Complete(TaskRef* taskRef)
+		{
+			TaskThread* const thisThread = this_thread::t_taskThread;
+			const uint64_t generation = taskRef->state.load(std::memory_order_relaxed) >> GENERATION_SHIFT;
+			// Done before the list closes. A waiter that finds it closed resumes without being woken, and checks.
+			const uint64_t prevState = taskRef->state.exchange(generation << GENERATION_SHIFT | TASK_DONE, std::memory_order_acq_rel);
+			const uint64_t waiters = taskRef->waiters.exchange(WaitersTag(generation) | WAITERS_CLOSED, std::memory_order_acq_rel);
+
+			if (prevState & TASK_SLEEPERS)
+			{
+				thread::WakeOnWord(&taskRef->state, true);
+			}
+
+			for (TaskWaiter* waiter = reinterpret_cast<TaskWaiter*>(waiters & WAITERS_PTR_MASK); waiter;)
+			{
+				TaskWaiter* const nextWaiter = waiter->next; // Gone once its fiber resumes
+
+				spsc::queue::push(&thisThread->stalledTasks, ScheduledFiber{ waiter->fiber, waiter->threadId, {} });
+				waiter = nextWaiter;
+			}
+
+			task_alloc::Free(taskRef);
+		}
+	}
+
+	// task::Wait on a task thread suspends the calling task's fiber rather than the thread. The fiber switches to
+	// its thread's root fiber, which pushes it on the task's waiter list once it's fully switched out, so the task
+	// finishing on another thread can't resume it early. Anywhere else Wait sleeps on the task's state word.
+	namespace task_wait
+	{
+		struct PushWaiter
+		{
+			TaskRef* taskRef;
+			uint64_t handleData;
+			TaskWaiter* waiter;
+		};
+
+		// Runs on the root fiber, see fiber::FiberAPI::SwitchOnTop
+		static void PushWaiterOnTop(void* userData)
+		{
+			const PushWaiter* const push = reinterpret_cast<const PushWaiter*>(userData);
+			TaskWaiter* const waiter = push->waiter;
+			const uint64_t tag = task_ref::WaitersTag(push->handleData >> task_ref::GENERATION_SHIFT);
+			uint64_t waiters = push->taskRef->waiters.load(std::memory_order_acquire);
+
+			for (;;)
+			{
+				if ((waiters & ~task_ref::WAITERS_PTR_MASK) != tag || (waiters & task_ref::WAITERS_PTR_MASK) == task_ref::WAITERS_CLOSED)
+				{
+					// Finished while we switched out, resume it like a yield
+					spsc::queue::push(&this_thread::t_taskThread->stalledTasks, ScheduledFiber{ waiter->fiber, waiter->threadId, {} });
+					break;
+				}
+
+				waiter->next = reinterpret_cast<TaskWaiter*>(waiters & task_ref::WAITERS_PTR_MASK);
+
+				if (push->taskRef->waiters.compare_exchange_weak(waiters, tag | reinterpret_cast<uintptr_t>(waiter), std::memory_order_release, std::memory_order_acquire))
+				{
+#if USING(TRIM_PARKED_STACKS)
+					// Only this thread resumes it, so parking after it's visible to the finisher is fine. Not while
+					// profiling, a trim zeroes the painted pages the task's high water mark is read from.
+					if (!(this_thread::t_scheduler->opts & scheduler::Options::PROFILE_STACKS))
+					{
+						stack_trim::Park(this_thread::t_taskThread, waiter->fiber);
+					}
+#endif //#if USING(TRIM_PARKED_STACKS)
+					break;
+				}
+			}
+		}
+
+		static void Suspend(const this_thread::Worker* worker, TaskRef* taskRef, uint64_t handleData)
+		{
+			TaskWaiter waiter{ nullptr, fiber::GetCurrentFiber(), this_thread::t_taskThread->id, {} };
+			PushWaiter push{ taskRef, handleData, &waiter };
+
+			worker->SwitchOnTop(waiter.fiber, worker->rootFiber, PushWaiterOnTop, &push);
+		}
+
+		static void Sleep(TaskRef* taskRef, uint64_t handleData)
+		{
+			const uint64_t generation = handleData >> task_ref::GENERATION_SHIFT;
+			uint64_t state = taskRef->state.load(std::memory_order_acquire);
+
+			while ((state >> task_ref::GENERATION_SHIFT) == generation && (state & task_ref::TASK_STATUS_MASK) != task_ref::TASK_DONE)
+			{
+				if (!(state & task_ref::TASK_SLEEPERS))
+				{
+					if (!taskRef->state.compare_exchange_weak(state, state | task_ref::TASK_SLEEPERS, std::memory_order_acquire, std::memory_order_acquire))
+					{
+						continue;
+					}
+
+					state |= task_ref::TASK_SLEEPERS;
+				}
+
+				// The status bits are in the low half, which is at the address on everything we run on
+				thread::WaitOnWord(&taskRef->state, static_cast<uint32_t>(state));
+				state = taskRef->state.load(std::memory_order_acquire);
+			}
+		}
+	}
+
+	namespace task_thread
+	{
+		static constexpr size_t TASK_TOTAL_STACK_SIZE = scheduler::StackSize::DEFAULT.bytes; // Pool and arena stacks are this size
+		static constexpr size_t TASK_STACK_CLASS_SIZES[STACK_CLASS_COUNT] = { scheduler::StackSize::TINY.bytes, scheduler::StackSize::SMALL.bytes, scheduler::StackSize::DEFAULT.bytes, scheduler::StackSize::LARGE.bytes };
+		static constexpr unsigned TASK_DEFAULT_STACK_CLASS = 2;
+		static constexpr size_t TASK_INITIAL_STACK_SIZE = TASK_STACK_MIN_COMMIT;
+		static constexpr unsigned TASK_STACK_POOL_COUNT = 32; // Stacks reserved up front per task thread, more are reserved on demand
+		static constexpr unsigned TASK_FREE_STACK_HIGH_WATERMARK = 64; // Per class, past this a thread spills free stacks to the others
+		static constexpr unsigned TASK_STACK_BATCH_SIZE = 32;
+		static constexpr size_t TASK_HOT_STACK_SIZE = TASK_STACK_HOT_SIZE;
+		static constexpr unsigned TASK_STACK_ARENA_SLOT_COUNT = 16 * 1024; // Per task thread with Options::STACK_ARENA, only reserved address space
+		static constexpr unsigned TASK_LOCAL_BATCH_SIZE = 16; // Own tasks started per loop with Options::WORK_STEALING, before the pump gets a look in
+
+		static_assert(TASK_STACK_CLASS_SIZES[TASK_DEFAULT_STACK_CLASS] == TASK_TOTAL_STACK_SIZE);
+
+		// Smallest class that fits, or STACK_CLASS_COUNT for a stack of its own
+		static unsigned StackClassFor(size_t stackSize)
+		{
+			unsigned stackClass = 0;
+
+			while (stackClass < STACK_CLASS_COUNT && TASK_STACK_CLASS_SIZES[stackClass] < stackSize)
+			{
+				++stackClass;
+			}
+
+			return stackClass;
+		}
+
+		struct TaskContext
+		{
+			fiber::Fiber* taskFiber;
+			fiber::Fiber* rootFiber;
+			FreeStacks* freeStacks; // The stack class's list, nullptr for a stack of its own
+			StackArena* stackArena; // nullptr unless Options::STACK_ARENA
+			StackProfiles* stackProfiles; // nullptr unless profiling stacks
+			StackDepths* stackDepths; // nullptr unless the commited size can be read for free
+			size_t stackSize;
+			size_t paintSize;
+			size_t commitedSize; // When the task started, only kept with stackDepths
+			Task task;
+		};
+
+		struct StackReturn
+		{
+			void* stack;
+			FreeStacks* freeStacks;
+			StackArena* stackArena;
+			size_t stackSize;
+		};
+
+		// Runs on the root fiber's stack, after the finished task fiber has been switched out
+		static void ReturnStackOnTop(void* userData)
+		{
+			const StackReturn stackReturn = *reinterpret_cast<StackReturn*>(userData); // Copy out, this lives on the stack being returned
+
+#if USING(OS_LINUX)
+			if (stackReturn.stackArena && stack_alloc::InArena(*stackReturn.stackArena, stackReturn.stack))
+			{
+				stack_alloc::ArenaReturn(stackReturn.stackArena, stackReturn.stack, stackReturn.stackSize);
+				return;
+			}
+#endif //#if USING(OS_LINUX)
+
+			if (!stackReturn.freeStacks)
+			{
+				stack_alloc::Release(stackReturn.stack, stackReturn.stackSize);
+				return;
+			}
+
+			stack_alloc::Return(stackReturn.stack, stackReturn.stackSize, TASK_HOT_STACK_SIZE, &stackReturn.freeStacks->list);
+			++stackReturn.freeStacks->count;
+		}
+
+		static void RecordStackProfile(StackProfiles* stackProfiles, void(*TaskFunc)(void*), fiber::Fiber* taskFiber, void* taskStack, size_t stackSize, size_t paintSize)
+		{
+			size_t depth = fiber::GetStackHighWaterMark(taskFiber, paintSize);
+			const size_t commitedDepth = stack_alloc::CommitedSize(taskStack, stackSize) - stack_alloc::STACK_HEAD_OFFSET;
+
+			// Grew past the painted pages. Guard page growth only commits touched pages, so that's the depth.
+			if (commitedDepth > paintSize)
+			{
+				depth = std::max(depth, commitedDepth);
+			}
+
+			thread::Lock(&stackProfiles->lock);
+
+			scheduler::StackProfile& profile = stackProfiles->byTask[TaskFunc];
+
+			profile.TaskFunc = TaskFunc;
+			profile.peakBytes = std::max(profile.peakBytes, depth);
+			profile.totalBytes += depth;
+			++profile.runCount;
+
+			thread::Unlock(&stackProfiles->lock);
+		}
+
+		template<fiber::Options FiberOpts>
+		static void FiberTask(void* userData)
+		{
+			TaskContext taskCtx = *reinterpret_cast<TaskContext*>(userData); // Copy out, the creator's context is reused for its next task
+			fiber::Fiber* const taskFiber = taskCtx.taskFiber;
+			void* const taskUserData = taskCtx.task.inlinePayload ? taskCtx.task.payload : reinterpret_cast<void*>(taskCtx.task.userDataPtr);
+
+			taskCtx.task.TaskFunc(taskUserData);
+			task_alloc::FreePayload(taskCtx.task);
+
+			uint8_t* const taskStack = stack_alloc::FromFiber(taskFiber, taskCtx.stackSize);
+			StackReturn stackReturn{ taskStack, taskCtx.freeStacks, taskCtx.stackArena, taskCtx.stackSize };
+
+			// Before completing, so whoever waits on the task sees it in GetStackProfiles
+			if (taskCtx.stackProfiles)
+			{
+				RecordStackProfile(taskCtx.stackProfiles, taskCtx.task.TaskFunc, taskFiber, taskStack, taskCtx.stackSize, taskCtx.paintSize);
+			}
+
+			if (taskCtx.stackDepths)
+			{
+				stack_depth::Record(taskCtx.stackDepths, taskCtx.task.TaskFunc, taskCtx.commitedSize, stack_alloc::CommitedSize(taskStack, taskCtx.stackSize));
+			}
+
+			task_ref::Complete(taskCtx.task.taskRef);
+
+			fiber::Api<FiberOpts>::SwitchOnTop(taskFiber, taskCtx.rootFiber, ReturnStackOnTop, &stackReturn);
+		}
+
+		namespace run
+		{
+			template<fiber::Options FiberOpts>
+			static void DrainExecuteActive(fiber::Fiber *rootFiber, spsc::fifo_queue<fiber::Fiber*>* activeFibers)
+			{
+				while (std::optional<fiber::Fiber*> nextFiber = spsc::queue::try_pop(activeFibers))
+				{
+					sanity(nextFiber.has_value());
+
+#if USING(TRIM_PARKED_STACKS)
+					stack_trim::Unpark(this_thread::t_taskThread, nextFiber.value());
+#endif //#if USING(TRIM_PARKED_STACKS)
+
+					stack_grow::SetRunning(nextFiber.value());
+					fiber::Api<FiberOpts>::Switch(rootFiber, nextFiber.value());
+					stack_grow::SetRunning(nullptr);
+				}
+			}
+
+			template<fiber::Options FiberOpts>
+			static void Execute(fiber::Fiber *rootFiber, FreeStacks *freeStacks, StackExchange* stackExchanges, StackArena* stackArena, StackProfiles* stackProfiles, StackDepths* stackDepths, const Task& task)
+			{
+				const unsigned stackClass = StackClassFor(task.stackSize);
+				const bool ownStack = stackClass == STACK_CLASS_COUNT;
+				TaskContext taskCtx{ nullptr, rootFiber, ownStack ? nullptr : freeStacks + stackClass, stackArena, stackProfiles, stackDepths, ownStack ? task.stackSize : TASK_STACK_CLASS_SIZES[stackClass], 0, 0, task };
+				size_t initialStackSize = TASK_INITIAL_STACK_SIZE;
+				void* stackMem = nullptr;
+
+#if USING(OS_LINUX)
+				// Smaller classes take a whole slot too, it's only address space
+				if (stackArena && taskCtx.stackSize <= TASK_TOTAL_STACK_SIZE)
+				{
+					// Arena slots have no commit boundary to catch deeper use, so profiling paints the whole slot. All
+					// but the bottom page, the overflow check wants the slot's bottom word left zero.
+					const size_t paintedStackSize = stackProfiles ? TASK_TOTAL_STACK_SIZE - stack_alloc::PAGE_ALIGN : TASK_HOT_STACK_SIZE;
+
+					stackMem = stack_alloc::ArenaAcquire(stackArena, TASK_TOTAL_STACK_SIZE, paintedStackSize);
+					taskCtx.stackSize = stackMem ? TASK_TOTAL_STACK_SIZE : taskCtx.stackSize;
+					taskCtx.stackDepths = stackMem ? nullptr : stackDepths; // Arena slots don't track what they commit
+				}
+#endif //#if USING(OS_LINUX)
+
+				if (!stackMem)
+				{
+					FreeList* noFreeStacks = nullptr;
+
+					// Commit what this task function needed last time up front, rather than a fault per page
+					if (stackDepths)
+					{
+						initialStackSize = std::clamp(stack_depth::Find(stackDepths, task.TaskFunc), TASK_INITIAL_STACK_SIZE, taskCtx.stackSize - stack_alloc::PAGE_ALIGN);
+					}
+
+					if (ownStack)
+					{
+						stackMem = stack_alloc::CreateAcquire(taskCtx.stackSize, initialStackSize, &noFreeStacks, nullptr);
+					}
+					else
+					{
+						FreeStacks* const classFreeStacks = taskCtx.freeStacks;
+
+						// Out of stacks. Take some another thread spilled before reserving more.
+						if (!classFreeStacks->list)
+						{
+							stack_exchange::Refill(stackExchanges + stackClass, classFreeStacks);
+						}
+
+						classFreeStacks->count -= classFreeStacks->list ? 1 : 0;
+						StackPool* const pool = stackClass == TASK_DEFAULT_STACK_CLASS ? &this_thread::t_taskThread->stackPool : nullptr;
+
+						stackMem = stack_alloc::CreateAcquire(taskCtx.stackSize, initialStackSize, &classFreeStacks->list, pool);
+					}
+				}
+
+				if (taskCtx.stackDepths)
+				{
+					taskCtx.commitedSize = stack_alloc::CommitedSize(stackMem, taskCtx.stackSize);
+				}
+
+				fiber::Fiber* const newFiber = fiber::Api<FiberOpts>::Create(stackMem, taskCtx.stackSize - stack_alloc::STACK_HEADER_SIZE, initialStackSize - stack_alloc::STACK_HEADER_SIZE, &FiberTask<FiberOpts>, &taskCtx);
+				taskCtx.taskFiber = newFiber;
+
+				if (stackProfiles)
+				{
+					// Paint everything commited, recycled stacks may have grown past the initial size
+					taskCtx.paintSize = stack_alloc::CommitedSize(stackMem, taskCtx.stackSize) - stack_alloc::STACK_HEAD_OFFSET;
+					fiber::PaintStack(newFiber, taskCtx.paintSize);
+				}
+
+				stack_grow::SetRunning(newFiber);
+				fiber::Api<FiberOpts>::Switch(rootFiber, newFiber);
+				stack_grow::SetRunning(nullptr);
+			}
+
+			template<fiber::Options FiberOpts>
+			static void DrainExecuteWaiting(fiber::Fiber *rootFiber, FreeStacks *freeStacks, StackExchange* stackExchanges, StackArena* stackArena, StackProfiles* stackProfiles, StackDepths* stackDepths, spsc::ring_buffer<Task, THREAD_WAIT_QUEUE_SIZE_LG2>* waitingTasks)
+			{
+				while (std::optional<Task> nextTask = spsc::ring::try_pop(waitingTasks))
+				{
+					sanity(nextTask.has_value());
+
+					Execute<FiberOpts>(rootFiber, freeStacks, stackExchanges, stackArena, stackProfiles, stackDepths, nextTask.value());
+				}
+			}
+
+			// Options::WORK_STEALING. Newest first, so a task's children run while its data is still in cache.
+			template<fiber::Options FiberOpts>
+			static void DrainExecuteLocal(fiber::Fiber *rootFiber, FreeStacks *freeStacks, StackExchange* stackExchanges, StackArena* stackArena, StackProfiles* stackProfiles, StackDepths* stackDepths, ws::work_deque<TaskRef*>* localTasks)
+			{
+				// Bounded, fibers waiting on these only resume once the pump has routed them back
+				for (unsigned taskCount = 0; taskCount < TASK_LOCAL_BATCH_SIZE; ++taskCount)
+				{
+					const std::optional<TaskRef*> nextTask = ws::deque::try_pop(localTasks);
+
+					if (!nextTask)
+					{
+						break;
+					}
 
-			taskCtx->task.TaskFunc(taskUserData);
-			if (taskCtx->task.ownedPtr)
-			{
-				_aligned_free(taskUserData);
+					Execute<FiberOpts>(rootFiber, freeStacks, stackExchanges, stackArena, stackProfiles, stackDepths, nextTask.value()->task);
+				}
 			}
 
-			uint8_t* const taskStack = reinterpret_cast<uint8_t*>(taskFiber) - (TASK_TOTAL_STACK_SIZE - sizeof(fiber::Fiber*));
+			// Options::WORK_STEALING. Oldest first from a random victim, then the rest in turn. Thread 0 never
+			// runs tasks, so it never has any to steal.
+			static TaskRef* Steal(scheduler::Scheduler* sch, const TaskThread* thisThread, uint32_t* rng)
+			{
+				const unsigned victimCount = sch->taskThreadCount - 1;
 
-			stack_alloc::Return(taskStack, TASK_TOTAL_STACK_SIZE, freeStacks);
+				*rng ^= *rng << 13;
+				*rng ^= *rng >> 17;
+				*rng ^= *rng << 5;
 
-			api.Switch(taskFiber, taskCtx->rootFiber);
-		}
+				const unsigned firstVictim = *rng % victimCount;
 
-		namespace run
-		{
-			static void DrainExecuteActive(const fiber::FiberAPI& api, fiber::Fiber *rootFiber, spsc::fifo_queue<fiber::Fiber*>* activeFibers)
-			{
-				while (std::optional<fiber::Fiber*> nextFiber = spsc::queue::try_pop(activeFibers))
+				for (unsigned victimOffset = 0; victimOffset < victimCount; ++victimOffset)
 				{
-					sanity(nextFiber.has_value());
+					TaskThread* const victim = sch->taskThreads + 1 + (firstVictim + victimOffset) % victimCount;
+
+					if (victim == thisThread)
+					{
+						continue;
+					}
 
-					api.Switch(rootFiber, nextFiber.value());
+					if (const std::optional<TaskRef*> stolen = ws::deque::try_steal(&victim->localTasks))
+					{
+						return stolen.value();
+					}
 				}
+
+				return nullptr;
 			}
 
-			static void DrainExecuteWaiting(const fiber::FiberAPI& api, fiber::Fiber *rootFiber, FreeList **freeStacks, spsc::ring_buffer<Task, THREAD_WAIT_QUEUE_SIZE_LG2>* waitingTasks)
+			static bool AnyToSteal(const scheduler::Scheduler* sch, const TaskThread* thisThread)
 			{
-				while (std::optional<Task> nextTask = spsc::ring::try_pop(waitingTasks))
+				for (unsigned threadIndex = 1; threadIndex < sch->taskThreadCount; ++threadIndex)
 				{
-					sanity(nextTask.has_value());
-
-					TaskContext taskCtx{ nullptr, rootFiber, freeStacks, &api, nextTask.value() };
-					void* const stackMem = stack_alloc::CreateAcquire(TASK_TOTAL_STACK_SIZE, TASK_INITIAL_STACK_SIZE, freeStacks);
+					const TaskThread* const victim = sch->taskThreads + threadIndex;
 
-					fiber::Fiber* const newFiber = api.Create(stackMem, TASK_TOTAL_STACK_SIZE, TASK_INITIAL_STACK_SIZE, &FiberTask, &taskCtx);
-					taskCtx.taskFiber = newFiber;
-					api.Switch(rootFiber, newFiber);
+					if (victim != thisThread && !ws::deque::is_empty(&victim->localTasks))
+					{
+						return true;
+					}
 				}
+
+				return false;
 			}
 		}
 
 		namespace schedule
 		{
+			// Options::WORK_STEALING. After a push, wake one sleeping thread to come steal it.
+			static void WakeIdle(scheduler::Scheduler* sch, const TaskThread* thisThread)
+			{
+				const unsigned taskThreadCount = sch->taskThreadCount;
+				const unsigned thisIndex = thisThread->id;
+
+				for (unsigned threadOffset = 1; threadOffset < taskThreadCount; ++threadOffset)
+				{
+					TaskThread* const thread = sch->taskThreads + (thisIndex + threadOffset) % taskThreadCount;
+
+					// Parked, or about to recheck the deques before parking. Thread 0 never parks here.
+					if (thread != sch->taskThreads && thread->parkState.load(std::memory_order_relaxed) == THREAD_PARKED)
+					{
+						::thread::Wake(thread);
+						break;
+					}
+				}
+			}
+
 			static void DrainStalledTasks(scheduler::Scheduler* sch)
 			{
 				const unsigned taskThreadCount = sch->taskThreadCount;
@@ -348,10 +2303,11 @@ namespace
 
 						if (destIndex < taskThreadCount)
 						{
-							sanity(destIndex == threadIndex);
+							// A yield, or a waiter whose task finished on this thread
+							TaskThread* const resumeThread = sch->taskThreads + destIndex;
 
-							destThread = thread;
-							spsc::queue::push(&thread->runningTasks, fiber->fiber);
+							destThread = resumeThread;
+							spsc::queue::push(&resumeThread->runningTasks, fiber->fiber);
 						}
 						else
 						{
@@ -361,7 +2317,7 @@ namespace
 							sanity(reactorIndex < sch->reactorThreadCount);
 
 							destThread = reactor;
-							spsc::queue::push(&reactor->runningTasks, ScheduledFiber{ fiber->fiber, thread->id });
+							spsc::queue::push(&reactor->runningTasks, ScheduledFiber{ fiber->fiber, thread->id, {} });
 						}
 
 						thread::Wake(destThread);
@@ -385,6 +2341,7 @@ namespace
 						TaskThread* const destThread = sch->taskThreads + destIndex;
 
 						sanity(destIndex < taskThreadCount);
+
 						spsc::queue::push(&destThread->runningTasks, fiber->fiber);
 						thread::Wake(destThread);
 					}
@@ -394,9 +2351,14 @@ namespace
 			static void AssignNewTasksToThreads(scheduler::Scheduler* sch)
 			{
 				const unsigned taskThreadCount = sch->taskThreadCount;
-				const unsigned taskThreadDWordCount = (taskThreadCount + 31) & ~31;
+				const unsigned taskThreadDWordCount = (taskThreadCount + 31) / 32;
+#if USING(OS_WINDOWS)
 				TaskThread** const writeableThreads = reinterpret_cast<TaskThread**>(_alloca(sizeof(TaskThread*) * taskThreadCount));
 				uint8_t* const writeableOpenSlots = reinterpret_cast<uint8_t*>(_alloca(sizeof(uint8_t) * taskThreadCount));
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				TaskThread** const writeableThreads = reinterpret_cast<TaskThread**>(alloca(sizeof(TaskThread*) * taskThreadCount));
+				uint8_t* const writeableOpenSlots = reinterpret_cast<uint8_t*>(alloca(sizeof(uint8_t) * taskThreadCount));
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
 				unsigned writeableThreadCount = 0;
 
 				for (unsigned activeTaskThreadDWordIndex = 0; activeTaskThreadDWordIndex < taskThreadDWordCount; ++activeTaskThreadDWordIndex)
@@ -415,7 +2377,7 @@ namespace
 							const auto& writeTaskQueue = writeThread->tasksAwaitingExecution;
 							const unsigned openSlots = writeTaskQueue.CAPACITY - spsc::ring::current_size(writeTaskQueue);
 
-							sanity(openSlots < writeTaskQueue.CAPACITY);
+							sanity(openSlots <= writeTaskQueue.CAPACITY);
 
 							if ( openSlots > 0 )
 							{
@@ -428,27 +2390,40 @@ namespace
 
 				sanity(writeableThreadCount <= taskThreadCount);
 
-				// Take from each threads unassigned list and push to a write thread one by one. Not the best for
-				// cache, but most fair.
+				// Take from each threads unassigned list, and then the one threads outside the scheduler share, and push
+				// to a write thread one by one. Not the best for cache, but most fair.
 				unsigned writeIndex = 0;
 				for (;writeableThreadCount > 0;)
 				{
 					bool taskAdded = false;
 
-					for (unsigned readThreadIndex = 0; readThreadIndex < taskThreadCount && writeableThreadCount > 0; ++readThreadIndex)
+					for (unsigned readThreadIndex = 0; readThreadIndex <= taskThreadCount && writeableThreadCount > 0; ++readThreadIndex)
 					{
-						TaskThread* const readThread = sch->taskThreads + readThreadIndex;
+						spsc::fifo_queue<QueuedTask>* const readQueue = readThreadIndex < taskThreadCount ? &sch->taskThreads[readThreadIndex].unassignedTasks : &sch->foreignTasks;
 
-						if (std::optional<Task> task = spsc::queue::try_pop(&readThread->unassignedTasks))
+						if (std::optional<QueuedTask> task = spsc::queue::try_pop(readQueue))
 						{
 							sanity(task.has_value());
+
+							if (task->threadIndex != ANY_TASK_THREAD)
+							{
+								// Placed below, once the open slots counted above are no longer needed
+								sch->pinnedBacklog.push_back(*task);
+								taskAdded = true;
+								continue;
+							}
+
 							const unsigned writeThreadIndex = writeIndex % writeableThreadCount;
 							TaskThread* const writeThread = writeableThreads[writeThreadIndex];
-							const bool pushed = spsc::ring::try_push(&writeThread->tasksAwaitingExecution, *task);
+							const bool pushed = spsc::ring::try_push(&writeThread->tasksAwaitingExecution, task->task);
 							const uint8_t oldOpenSlots = writeableOpenSlots[writeThreadIndex]--;
 
 							sanity(pushed);
 
+							// Every push, the thread may have emptied its queue and parked since openSlots was read.
+							// Only a parked thread costs a syscall.
+							thread::Wake(writeThread);
+
 							switch (oldOpenSlots)
 							{
 							case 0:
@@ -467,9 +2442,6 @@ namespace
 								writeableThreadCount = writeableEnd;
 							}
 							break;
-							case writeThread->tasksAwaitingExecution.CAPACITY:
-								// Now has data, previously didn't. Wake up.
-								thread::Wake(writeThread);
 							default:
 								++writeIndex;
 							}
@@ -484,72 +2456,240 @@ namespace
 						break;
 					}
 				}
+
+				// Any whose thread is still full wait for a later pump, which that thread runs itself once it empties
+				size_t keptCount = 0;
+
+				for (const QueuedTask& pinned : sch->pinnedBacklog)
+				{
+					TaskThread* const pinThread = sch->taskThreads + pinned.threadIndex;
+
+					if (spsc::ring::try_push(&pinThread->tasksAwaitingExecution, pinned.task))
+					{
+						thread::Wake(pinThread);
+					}
+					else
+					{
+						sch->pinnedBacklog[keptCount++] = pinned;
+					}
+				}
+
+				sch->pinnedBacklog.resize(keptCount);
 			}
 		}
 
+		template<fiber::Options FiberOpts>
 		static void FiberMain(void* userData)
 		{
 			thread::Context* const ctx = reinterpret_cast<thread::Context*>(userData);
-			fiber::FiberAPI api = ctx->sch->fiberAPI;
 			TaskThread* const thisThread = reinterpret_cast<TaskThread*>(ctx->thisThread);
-			FreeList** freeStacks = &thisThread->freeStacks;
+			FreeStacks* const freeStacks = thisThread->freeStacks;
+			StackExchange* const stackExchanges = ctx->sch->stackExchanges + thisThread->numaNode * STACK_CLASS_COUNT;
+			StackProfiles* const stackProfiles = !!(ctx->sch->opts & scheduler::Options::PROFILE_STACKS) ? &thisThread->stackProfiles : nullptr;
+			StackArena* const stackArena = thisThread->stackArena.mem ? &thisThread->stackArena : nullptr;
+#if USING(OS_LINUX)
+			StackDepths* const stackDepths = &thisThread->stackDepths;
+#else //#if USING(OS_LINUX)
+			StackDepths* const stackDepths = nullptr; // Reading how far PAGE_GUARD grew a stack takes a VirtualQuery per page
+#endif //#else //#if USING(OS_LINUX)
 			std::atomic_bool* const running = &ctx->sch->running;
 			std::atomic_bool* const workPumpLock = &ctx->sch->workPumpLock;
+			std::atomic_bool* const workPumpRequested = &ctx->sch->workPumpRequested;
 			spsc::fifo_queue<fiber::Fiber*>* const activeFibers = &thisThread->runningTasks;
 			spsc::ring_buffer<Task, THREAD_WAIT_QUEUE_SIZE_LG2>* const waitingTasks = &thisThread->tasksAwaitingExecution;
+			ws::work_deque<TaskRef*>* const localTasks = &thisThread->localTasks;
+			const bool workStealing = !!(ctx->sch->opts & scheduler::Options::WORK_STEALING);
+			uint32_t stealRng = thisThread->id * 0x9e3779b9u + 1; // xorshift, never zero
 
 			for(;;)
 			{
-				run::DrainExecuteActive(api, ctx->rootFiber, activeFibers);
-				run::DrainExecuteWaiting(api, ctx->rootFiber, freeStacks, waitingTasks);
+#if USING(TRIM_PARKED_STACKS)
+				// Before resuming anything, a fiber that waited long enough is trimmed even as its wait ends
+				stack_trim::TrimParked(ctx->sch, thisThread);
+#endif //#if USING(TRIM_PARKED_STACKS)
+
+				run::DrainExecuteActive<FiberOpts>(ctx->rootFiber, activeFibers);
+				run::DrainExecuteWaiting<FiberOpts>(ctx->rootFiber, freeStacks, stackExchanges, stackArena, stackProfiles, stackDepths, waitingTasks);
+
+				if (workStealing)
+				{
+					run::DrainExecuteLocal<FiberOpts>(ctx->rootFiber, freeStacks, stackExchanges, stackArena, stackProfiles, stackDepths, localTasks);
+				}
+
+				for (unsigned stackClass = 0; stackClass < STACK_CLASS_COUNT; ++stackClass)
+				{
+					if (freeStacks[stackClass].count > TASK_FREE_STACK_HIGH_WATERMARK)
+					{
+						stack_exchange::Spill(stackExchanges + stackClass, freeStacks + stackClass, TASK_FREE_STACK_HIGH_WATERMARK - TASK_STACK_BATCH_SIZE, TASK_STACK_BATCH_SIZE, TASK_STACK_CLASS_SIZES[stackClass], thisThread->stackPool);
+					}
+				}
+
+				// Whatever woke this thread may need the pump. If it's busy, and the holder already went past it,
+				// leave a request rather than park with the work stranded.
+				bool pump = !workPumpLock->exchange(true, std::memory_order_seq_cst);
+
+				if (!pump)
+				{
+					workPumpRequested->store(true, std::memory_order_seq_cst);
+					pump = !workPumpLock->exchange(true, std::memory_order_seq_cst);
+				}
 
-				if (!workPumpLock->exchange(true, std::memory_order_acq_rel))
+				while (pump)
 				{
 					scheduler::Scheduler* const sch = ctx->sch;
+
+					workPumpRequested->store(false, std::memory_order_relaxed);
 					
 					schedule::DrainStalledTasks(sch);
 					schedule::DrainReactors(sch);
 					schedule::AssignNewTasksToThreads(sch);
 
-					workPumpLock->store(false, std::memory_order_release);
+					workPumpLock->store(false, std::memory_order_seq_cst);
+					pump = workPumpRequested->load(std::memory_order_seq_cst) && !workPumpLock->exchange(true, std::memory_order_seq_cst);
 				}
 
-				if (spsc::ring::current_size(*waitingTasks) == 0 && spsc::queue::is_empty(*activeFibers))
+				if (spsc::ring::current_size(*waitingTasks) == 0 && spsc::queue::is_empty(*activeFibers) && ws::deque::is_empty(localTasks))
 				{
+					if (workStealing)
+					{
+						if (TaskRef* const stolen = run::Steal(ctx->sch, thisThread, &stealRng))
+						{
+							run::Execute<FiberOpts>(ctx->rootFiber, freeStacks, stackExchanges, stackArena, stackProfiles, stackDepths, stolen->task);
+							continue;
+						}
+					}
+
 					if (!running->load(std::memory_order_acquire))
 					{
 						break;
 					}
 					else
 					{
-						thread::Sleep(thisThread);
+#if USING(OS_LINUX)
+						if (stackArena)
+						{
+							stack_alloc::TrimArena(stackArena, TASK_TOTAL_STACK_SIZE, TASK_HOT_STACK_SIZE);
+						}
+#endif //#if USING(OS_LINUX)
+
+						if (workStealing)
+						{
+							// Parked before the recheck, so a Run pushing after it is sure to see us and wake us
+							if (thread::PrepareSleep(thisThread))
+							{
+								ctx->sch->idleTaskThreads.fetch_add(1, std::memory_order_relaxed);
+								std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with the one in task::Run
+
+								if (run::AnyToSteal(ctx->sch, thisThread))
+								{
+									thread::CancelSleep(thisThread);
+								}
+								else
+								{
+									thread::FinishSleep(thisThread);
+								}
+
+								ctx->sch->idleTaskThreads.fetch_sub(1, std::memory_order_relaxed);
+							}
+						}
+						else
+						{
+							thread::Sleep(thisThread);
+						}
 					}
 				}
 			}
 		}
 
+		template<fiber::Options FiberOpts>
 		static void ThreadMain(scheduler::Scheduler* sch, unsigned threadIndex)
 		{
-			static constexpr unsigned taskThreadStackSize = 1024; // Most likely overkill;
+			static constexpr unsigned taskThreadStackSize = 64 * 1024; // Drains and the work pump run on this, pump allocas scale with thread count
 			uint8_t* const taskThreadStack = new uint8_t[taskThreadStackSize];
-			thread::Context ctx{ sch, sch->taskThreads + threadIndex };
+			thread::Context ctx{ sch, sch->taskThreads + threadIndex, nullptr };
+			TaskThread* const thisThread = sch->taskThreads + threadIndex;
 
 			sanity(threadIndex < sch->taskThreadCount);
 
-			ctx.rootFiber = sch->fiberAPI.Create(taskThreadStack, taskThreadStackSize, 0, FiberMain, &ctx);
-			sch->fiberAPI.Start(ctx.rootFiber);
+			this_thread::t_scheduler = sch;
+			this_thread::t_taskThread = thisThread;
+			task_alloc::t_taskAlloc = &thisThread->taskAlloc;
+
+#if USING(OS_LINUX)
+			numa::EnterNode(sch->numa, thisThread->numaNode);
+
+			if (!!(sch->opts & scheduler::Options::STACK_ARENA))
+			{
+				thisThread->stackArena = stack_alloc::CreateArena(TASK_STACK_ARENA_SLOT_COUNT, TASK_TOTAL_STACK_SIZE);
+				numa::Bind(sch->numa, thisThread->stackArena.mem, thisThread->stackArena.size, thisThread->numaNode);
+			}
+#endif //#if USING(OS_LINUX)
+
+			if (!thisThread->stackArena.mem)
+			{
+				thisThread->stackPool = stack_alloc::CreatePool(TASK_STACK_POOL_COUNT, TASK_TOTAL_STACK_SIZE);
+
+#if USING(OS_LINUX)
+				numa::Bind(sch->numa, thisThread->stackPool.mem, thisThread->stackPool.size, thisThread->numaNode);
+#endif //#if USING(OS_LINUX)
+			}
+
+#if USING(OS_LINUX)
+			void* const altStack = stack_grow::AddAltStack();
+#endif //#if USING(OS_LINUX)
+
+			ctx.rootFiber = fiber::Api<FiberOpts>::Create(taskThreadStack, taskThreadStackSize, 0, FiberMain<FiberOpts>, &ctx);
+
+			const this_thread::Worker worker{ ctx.rootFiber, &fiber::Api<FiberOpts>::SwitchOnTop };
+
+			this_thread::t_worker = &worker;
+			fiber::Api<FiberOpts>::Start(ctx.rootFiber);
+			this_thread::t_worker = nullptr;
+
+#if USING(OS_LINUX)
+			stack_grow::RemoveAltStack(altStack);
+#endif //#if USING(OS_LINUX)
+
+			for (unsigned stackClass = 0; stackClass < STACK_CLASS_COUNT; ++stackClass)
+			{
+				FreeStacks* const classFreeStacks = thisThread->freeStacks + stackClass;
+
+				// Other threads may be mid pop on a batch of ours, so everything that can move stays mapped until
+				// scheduler::Destroy. Only the pool is released here.
+				while (classFreeStacks->count > 0)
+				{
+					const unsigned prevCount = classFreeStacks->count;
+
+					stack_exchange::Spill(sch->stackExchanges + thisThread->numaNode * STACK_CLASS_COUNT + stackClass, classFreeStacks, 0, TASK_STACK_BATCH_SIZE, TASK_STACK_CLASS_SIZES[stackClass], thisThread->stackPool);
+					if (classFreeStacks->count == prevCount)
+					{
+						break; // Pool stacks
+					}
+				}
+
+				stack_alloc::ReleaseAll(classFreeStacks->list, TASK_STACK_CLASS_SIZES[stackClass], thisThread->stackPool);
+				*classFreeStacks = FreeStacks{};
+			}
 
-			stack_alloc::ReleaseAll(reinterpret_cast<TaskThread*>(ctx.thisThread)->freeStacks);
+			stack_alloc::ReleasePool(thisThread->stackPool);
+#if USING(OS_LINUX)
+			stack_alloc::ReleaseArena(thisThread->stackArena);
+#endif //#if USING(OS_LINUX)
+			thisThread->stackPool = StackPool{};
+			thisThread->stackArena = StackArena{};
+			this_thread::t_scheduler = nullptr;
+			this_thread::t_taskThread = nullptr;
+			task_alloc::t_taskAlloc = nullptr;
 			delete[]taskThreadStack;
 		}
 	}
 
 	namespace reactor_thread
 	{
+		template<fiber::Options FiberOpts>
 		static void FiberMain(void* userData)
 		{
 			thread::Context* const ctx = reinterpret_cast<thread::Context*>(userData);
-			fiber::FiberAPI api = ctx->sch->fiberAPI;
 			const unsigned taskThreadCount = ctx->sch->taskThreadCount;
 			ReactorThread* const thisThread = reinterpret_cast<ReactorThread*>(ctx->thisThread);
 			fiber::Fiber* const rootFiber = ctx->rootFiber;
@@ -565,7 +2705,7 @@ namespace
 
 					sanity(fiberThreadPair->threadId < taskThreadCount);
 
-					api.Switch(rootFiber, fiberThreadPair->fiber);
+					fiber::Api<FiberOpts>::Switch(rootFiber, fiberThreadPair->fiber);
 					spsc::queue::push(finishedFibers, std::move(fiberThreadPair.value()));
 				}
 
@@ -583,44 +2723,82 @@ namespace
 			}
 		}
 
+		template<fiber::Options FiberOpts>
 		static void ThreadMain(scheduler::Scheduler* sch, unsigned threadId)
 		{
-			static constexpr unsigned reactorThreadStackSize = 1024; // Most likely overkill;
+			static constexpr unsigned reactorThreadStackSize = 64 * 1024;
 			const unsigned threadIndex = threadId - sch->taskThreadCount;
 			uint8_t* const reactorThreadStack = new uint8_t[reactorThreadStackSize];
-			thread::Context ctx{ sch, sch->reactorThreads + threadIndex };
+			thread::Context ctx{ sch, sch->reactorThreads + threadIndex, nullptr };
 
 			sanity(threadId > sch->taskThreadCount);
 			sanity(threadIndex < sch->reactorThreadCount);
 
-			ctx.rootFiber = sch->fiberAPI.Create(reactorThreadStack, reactorThreadStackSize, 0, FiberMain, &ctx);
-			sch->fiberAPI.Start(ctx.rootFiber);
+			task_alloc::t_taskAlloc = &ctx.thisThread->taskAlloc;
+			ctx.rootFiber = fiber::Api<FiberOpts>::Create(reactorThreadStack, reactorThreadStackSize, 0, FiberMain<FiberOpts>, &ctx);
+			fiber::Api<FiberOpts>::Start(ctx.rootFiber);
+			task_alloc::t_taskAlloc = nullptr;
 			delete[] reactorThreadStack;
 		}
 	}
 
-	namespace task_ref
+	namespace thread
 	{
-		static void DecRef(TaskRef* t)
+		using ThreadMainFunc = void(scheduler::Scheduler* sch, unsigned threadId);
+
+		// Picks the fiber options at thread start, so the whole thread runs on fiber::Api<Opts>
+		template<typename ThreadT>
+		static ThreadMainFunc* GetThreadMain(fiber::Options fiberOpts)
 		{
-			if (t)
+			static constexpr fiber::Options BOTH = fiber::Options::OS_API_SAFETY | fiber::Options::PRESERVE_FPU_CONTROL;
+
+			if constexpr (std::is_same_v<ThreadT, TaskThread>)
 			{
-				--t->users;
+				switch (static_cast<unsigned>(fiberOpts)) // Combinations of flags aren't enumerators
+				{
+					case static_cast<unsigned>(fiber::Options::NONE): return task_thread::ThreadMain<fiber::Options::NONE>;
+					case static_cast<unsigned>(fiber::Options::OS_API_SAFETY): return task_thread::ThreadMain<fiber::Options::OS_API_SAFETY>;
+					case static_cast<unsigned>(fiber::Options::PRESERVE_FPU_CONTROL): return task_thread::ThreadMain<fiber::Options::PRESERVE_FPU_CONTROL>;
+					case static_cast<unsigned>(BOTH): return task_thread::ThreadMain<BOTH>;
+				}
 			}
-		}
-
-		static void IncRef(TaskRef* t)
-		{
-			if (t)
+			else
 			{
-				++t->users;
+				static_assert(std::is_same_v<ThreadT, ReactorThread>);
+
+				switch (static_cast<unsigned>(fiberOpts)) // Combinations of flags aren't enumerators
+				{
+					case static_cast<unsigned>(fiber::Options::NONE): return reactor_thread::ThreadMain<fiber::Options::NONE>;
+					case static_cast<unsigned>(fiber::Options::OS_API_SAFETY): return reactor_thread::ThreadMain<fiber::Options::OS_API_SAFETY>;
+					case static_cast<unsigned>(fiber::Options::PRESERVE_FPU_CONTROL): return reactor_thread::ThreadMain<fiber::Options::PRESERVE_FPU_CONTROL>;
+					case static_cast<unsigned>(BOTH): return reactor_thread::ThreadMain<BOTH>;
+				}
 			}
+
+			sanity(0 && "Unknown options");
+
+			return nullptr;
 		}
 	}
 }
 
 namespace scheduler
 {
+	struct TaskHandleAccess
+	{
+		static TaskHandle Make(uint64_t data)
+		{
+			TaskHandle handle;
+
+			handle.data = data;
+			return handle;
+		}
+
+		static uint64_t Data(const TaskHandle& handle)
+		{
+			return handle.data;
+		}
+	};
 
 	namespace thread
 	{
@@ -629,78 +2807,159 @@ namespace scheduler
 
 	namespace task
 	{
-		TaskHandle Create(void (*TaskPtr)(void*), const void* userData, size_t dataSize, size_t alignment)
+		TaskHandle Create(void (*TaskPtr)(void*), const void* userData, size_t dataSize, size_t alignment, StackSize stackSize)
 		{
 			if (!userData)
 			{
-				return Create_Stack(TaskPtr, userData);
+				return Create_Stack(TaskPtr, userData, stackSize);
+			}
+			else if (dataSize <= TASK_INLINE_PAYLOAD_SIZE && alignment <= TASK_INLINE_PAYLOAD_ALIGN)
+			{
+				// Small enough to ride along in the Task, nothing to allocate or free
+				Scheduler* const sch = ::this_thread::Scheduler();
+				TaskRef* const taskRef = task_ref::Create(sch);
+				Task& task = taskRef->task;
+				task.TaskFunc = TaskPtr;
+				task.userDataPtr = 0;
+				task.inlinePayload = true;
+				task.slabPtr = false;
+				task.ownedPtr = false;
+				task.stackSize = stackSize.bytes;
+
+				memcpy(task.payload, userData, dataSize);
+
+				return TaskHandleAccess::Make(task_ref::ToHandleData(sch->taskSlots, taskRef));
 			}
 			else
 			{
-				void* const dataCpy = _aligned_malloc(dataSize, alignment);
-				Task task;
+				Scheduler* const sch = ::this_thread::Scheduler();
+				TaskRef* const taskRef = task_ref::Create(sch);
+				const unsigned payloadClass = task_alloc::PayloadClassFor(dataSize, alignment);
+				const bool fitsSlab = payloadClass < TaskAlloc::BLOCK_CLASS_COUNT;
+#if USING(OS_WINDOWS)
+				void* const dataCpy = fitsSlab ? task_alloc::Alloc(sch, payloadClass) : _aligned_malloc(dataSize, alignment);
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				const size_t payloadAlign = std::max(alignment, sizeof(void*));
+				void* const dataCpy = fitsSlab ? task_alloc::Alloc(sch, payloadClass) : aligned_alloc(payloadAlign, (dataSize + payloadAlign - 1) & ~(payloadAlign - 1)); // Size must be a multiple
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+				Task& task = taskRef->task;
 				task.TaskFunc = TaskPtr;
 				task.userDataPtr = reinterpret_cast<uintptr_t>(dataCpy);
+				task.inlinePayload = false;
+				task.slabPtr = fitsSlab;
 				task.ownedPtr = true;
+				task.stackSize = stackSize.bytes;
 
 				sanity(task.userDataPtr == reinterpret_cast<uintptr_t>(dataCpy) && "Byte aligned userData?");
 
 				memcpy(dataCpy, userData, dataSize);
+
+				return TaskHandleAccess::Make(task_ref::ToHandleData(sch->taskSlots, taskRef));
 			}
 		}
 
-		TaskHandle Create_Stack(void (*TaskPtr)(void*), const void* userData)
+		TaskHandle Create_Stack(void (*TaskPtr)(void*), const void* userData, StackSize stackSize)
 		{
-			Task task;
+			Scheduler* const sch = ::this_thread::Scheduler();
+			TaskRef* const taskRef = task_ref::Create(sch);
+			Task& task = taskRef->task;
 			task.TaskFunc = TaskPtr;
 			task.userDataPtr = reinterpret_cast<uintptr_t>(userData);
+			task.inlinePayload = false;
+			task.slabPtr = false;
 			task.ownedPtr = false;
+			task.stackSize = stackSize.bytes;
 
 			sanity(task.userDataPtr == reinterpret_cast<uintptr_t>(userData) && "Byte aligned userData?");
+
+			return TaskHandleAccess::Make(task_ref::ToHandleData(sch->taskSlots, taskRef));
 		}
 
+		void Run(TaskHandle task, unsigned optThread)
+		{
+			const uint64_t handleData = TaskHandleAccess::Data(task);
+			scheduler::Scheduler* const sch = ::this_thread::Scheduler();
+			TaskRef* const taskRef = task_ref::FromHandleData(sch->taskSlots, handleData);
+			TaskThread* const thisThread = ::this_thread::TaskThreadOf(sch);
+			// Thread 0 never runs tasks, so pins spread over the rest
+			const unsigned pinThread = optThread == ~0u ? ANY_TASK_THREAD : 1 + optThread % (sch->taskThreadCount - 1);
 
-		void Run(TaskHandle task, unsigned optThread);
-		void RunAndWait(TaskHandle task, unsigned optThread);
-		void Wait(TaskHandle task);
-	}
+			sanity(taskRef->state.load(std::memory_order_relaxed) >> task_ref::GENERATION_SHIFT == handleData >> task_ref::GENERATION_SHIFT && "Task already finished");
+			sanity((taskRef->state.load(std::memory_order_relaxed) & task_ref::TASK_STATUS_MASK) == task_ref::TASK_CREATED && "Task already run");
 
-	TaskHandle::TaskHandle() : data(nullptr) {}
+			// Add, not store, a thread may already be sleeping on it
+			taskRef->state.fetch_add(task_ref::TASK_QUEUED - task_ref::TASK_CREATED, std::memory_order_release);
 
-	TaskHandle::TaskHandle(const TaskHandle& rhs) : data(rhs.data)
-	{
-		task_ref::IncRef(reinterpret_cast<TaskRef*>(data));
-	}
+			if (!thisThread)
+			{
+				// Not one of the scheduler's threads, so there's no queue of our own to push to
+				::thread::Lock(&sch->foreignLock);
+				spsc::queue::push(&sch->foreignTasks, QueuedTask{ taskRef->task, pinThread, {} });
+				::thread::Unlock(&sch->foreignLock);
 
-	TaskHandle::TaskHandle(TaskHandle&& rhs) : data(rhs.data)
-	{
-		rhs.data = nullptr;
-	}
+				::thread::Wake(sch->taskThreads + 1);
+			}
+			else if (!!(sch->opts & Options::WORK_STEALING) && ::this_thread::t_worker && pinThread == ANY_TASK_THREAD)
+			{
+				// Ours to pop next, or for an idle thread to steal. Never touches the pump.
+				ws::deque::push(&thisThread->localTasks, taskRef);
 
-	TaskHandle& TaskHandle::operator=(const TaskHandle& rhs)
-	{
-		task_ref::DecRef(reinterpret_cast<TaskRef*>(data));
-		data = rhs.data;
-		task_ref::IncRef(reinterpret_cast<TaskRef*>(data));
-		return *this;
-	}
+				// Pairs with the one after a task thread parks
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (sch->idleTaskThreads.load(std::memory_order_relaxed) > 0)
+				{
+					::task_thread::schedule::WakeIdle(sch, thisThread);
+				}
+			}
+			else
+			{
+				// Pinned tasks go through the pump too, stolen ones could run anywhere
+				spsc::queue::push(&thisThread->unassignedTasks, QueuedTask{ taskRef->task, pinThread, {} });
 
-	TaskHandle& TaskHandle::operator=(TaskHandle&& rhs)
-	{
-		data = rhs.data;
-		rhs.data = nullptr;
-		return *this;
-	}
+				// Task threads pump on their own, the creating thread needs one to
+				if (!::this_thread::t_worker)
+				{
+					::thread::Wake(sch->taskThreads + 1);
+				}
+			}
+		}
 
-	TaskHandle::~TaskHandle()
-	{
-		task_ref::DecRef(reinterpret_cast<TaskRef*>(data));
+		void RunAndWait(TaskHandle task, unsigned optThread)
+		{
+			Run(task, optThread);
+			Wait(task);
+		}
+
+		void Wait(TaskHandle task)
+		{
+			const uint64_t handleData = TaskHandleAccess::Data(task);
+			const Scheduler* const sch = ::this_thread::Scheduler();
+			const TaskSlotTable& slotTable = sch->taskSlots;
+
+			if (!task_ref::IsDone(slotTable, handleData))
+			{
+				TaskRef* const taskRef = task_ref::FromHandleData(slotTable, handleData);
+				const ::this_thread::Worker* const worker = ::this_thread::t_scheduler == sch ? ::this_thread::t_worker : nullptr;
+
+				// Anywhere else, including another scheduler's task threads, sleeps the thread
+				if (worker)
+				{
+					task_wait::Suspend(worker, taskRef, handleData);
+				}
+				else
+				{
+					task_wait::Sleep(taskRef, handleData);
+				}
+
+				sanity(task_ref::IsDone(slotTable, handleData));
+			}
+		}
 	}
 
 	Scheduler* Create(Options opts)
 	{
 		Scheduler* const out = new Scheduler;
-		const unsigned taskThreadCount = std::thread::hardware_concurrency();
+		const unsigned taskThreadCount = std::max(2u, std::thread::hardware_concurrency()); // Thread 0 never runs tasks, so always one more. Can read 0.
 
 		{
 			fiber::Options fiberOpts = fiber::Options::NONE;
@@ -714,14 +2973,57 @@ namespace scheduler
 				fiberOpts |= fiber::Options::PRESERVE_FPU_CONTROL;
 			}
 
-			out->fiberAPI = fiber::GetAPI(fiberOpts);
+			out->fiberOpts = fiberOpts;
 		}
 
+		out->opts = opts;
+
+#if USING(OS_LINUX)
+		stack_grow::Install();
+#endif //#if USING(OS_LINUX)
+
 		out->running.store(true, std::memory_order_relaxed);
 		out->workPumpLock.store(true, std::memory_order_relaxed);
+		out->workPumpRequested.store(false, std::memory_order_relaxed);
+		out->idleTaskThreads.store(0, std::memory_order_relaxed);
+		out->parkedTrims.store(0, std::memory_order_relaxed);
+		out->parkedTrimmedBytes.store(0, std::memory_order_relaxed);
+
+#if USING(OS_LINUX)
+		out->numa = numa::Discover();
+#else //#if USING(OS_LINUX)
+		out->numa = NumaTopology{ {}, {}, 1, false, {} };
+#endif //#else //#if USING(OS_LINUX)
+
+		out->stackExchanges = new StackExchange[out->numa.nodeCount * STACK_CLASS_COUNT];
 
+		for (unsigned exchangeIndex = 0; exchangeIndex < out->numa.nodeCount * STACK_CLASS_COUNT; ++exchangeIndex)
+		{
+			out->stackExchanges[exchangeIndex].top.store(0, std::memory_order_relaxed);
+		}
+
+		::task_alloc::CreateSlotTable(&out->taskSlots);
 		out->taskThreadCount = taskThreadCount;
 		out->taskThreads = new TaskThread[taskThreadCount];
+
+		for (unsigned threadIndex = 0; threadIndex < taskThreadCount; ++threadIndex)
+		{
+			out->taskThreads[threadIndex].taskAlloc.slotTable = &out->taskSlots;
+		}
+
+		out->foreignAlloc.slotTable = &out->taskSlots;
+
+		// The creating thread stands in for task thread 0
+		::task_alloc::t_taskAlloc = &out->taskThreads[0].taskAlloc;
+		::this_thread::t_scheduler = out;
+		::this_thread::t_taskThread = out->taskThreads;
+
+#if USING(OS_LINUX)
+		for (unsigned threadIndex = 0; threadIndex < taskThreadCount; ++threadIndex)
+		{
+			out->taskThreads[threadIndex].numaNode = numa::NodeOf(out->numa, threadIndex);
+		}
+#endif //#if USING(OS_LINUX)
 		out->reactorThreadCount = 0;
 		out->reactorThreads = nullptr;
 
@@ -733,14 +3035,18 @@ namespace scheduler
 			out->activeTaskThreads[dwordIndex].store(~0u, std::memory_order_relaxed);
 		}
 
+		// Thread 0 is the creating thread, which never takes tasks. It may be blocked in task::Wait.
+		out->activeTaskThreads[0].fetch_and(~1u, std::memory_order_relaxed);
+
 		// Skip 0, that's the main thread.
 		for (unsigned threadIndex = 1; threadIndex < taskThreadCount; ++threadIndex)
 		{
 			TaskThread* const thread = out->taskThreads + threadIndex;
 
-			thread->thread = std::thread(task_thread::ThreadMain, out, threadIndex);
-			thread->id = threadIndex;
+			thread->id = threadIndex; // Before it starts, task::Wait reads it
+			thread->thread = std::thread(::thread::GetThreadMain<TaskThread>(out->fiberOpts), out, threadIndex);
 
+#if USING(OS_WINDOWS)
 			{
 				static const wchar_t baseTaskThreadName[] = L"Task Thread ";
 				std::thread::native_handle_type threadHandle = thread->thread.native_handle();
@@ -748,39 +3054,165 @@ namespace scheduler
 
 				// Pin and name task threads
 				wcscpy(threadName, baseTaskThreadName);
-				_itow(threadIndex, threadName + ARRAYSIZE(baseTaskThreadName), 10);
+				_itow(threadIndex, threadName + ARRAYSIZE(baseTaskThreadName) - 1, 10);
 				SetThreadIdealProcessor(threadHandle, threadIndex / 64);
 				SetThreadAffinityMask(threadHandle, 1ull << (threadIndex & 63));
 				SetThreadDescription(threadHandle, threadName);
 			}
+#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
+			{
+				char threadName[sizeof("Task 4294967295")]; // Any thread index, and inside linux's 15 character cap
+
+				// numa::EnterNode pins the thread to its node's cpus once it starts
+				snprintf(threadName, sizeof(threadName), "Task %u", threadIndex);
+				pthread_setname_np(thread->thread.native_handle(), threadName);
+			}
+#endif //#elif USING(OS_LINUX) //#if USING(OS_WINDOWS)
 		}
 
+		// Everything the pump touches is set up
+		out->workPumpLock.store(false, std::memory_order_release);
+
+		// The first scheduler is the default until it's destroyed
+		Scheduler* noDefault = nullptr;
+		::this_thread::s_defaultScheduler.compare_exchange_strong(noDefault, out, std::memory_order_release, std::memory_order_relaxed);
+
 		return out;
 	}
 
 	void Destroy(Scheduler* sch)
 	{
+		Scheduler* wasDefault = sch;
+		::this_thread::s_defaultScheduler.compare_exchange_strong(wasDefault, nullptr, std::memory_order_relaxed, std::memory_order_relaxed);
+
 		sch->running.store(false, std::memory_order_release);
-		WakeByAddressAll(&sch->running);
+
+		// Threads park on their own parkState. One not parked yet keeps the notification, and sees running on
+		// its way back round instead of parking.
+		for (unsigned threadIndex = 1; threadIndex < sch->taskThreadCount; ++threadIndex)
+		{
+			::thread::Wake(sch->taskThreads + threadIndex);
+		}
+		for (unsigned threadIndex = 0; threadIndex < sch->reactorThreadCount; ++threadIndex)
+		{
+			::thread::Wake(sch->reactorThreads + threadIndex);
+		}
 
 		for (unsigned threadIndex = 1; threadIndex < sch->taskThreadCount; ++threadIndex)
 		{
 			TaskThread* thread = sch->taskThreads + threadIndex;
 
 			thread->thread.join();
-			while (thread->freeStacks)
+
+			// ThreadMain releases its stacks on the way out
+			for (const FreeStacks& freeStacks : thread->freeStacks)
 			{
-				FreeList* const next = thread->freeStacks->next;
-				delete[] thread->freeStacks;
-				thread->freeStacks = next;
+				sanity(!freeStacks.list);
 			}
 		}
+		for (unsigned threadIndex = 0; threadIndex < sch->reactorThreadCount; ++threadIndex)
+		{
+			sch->reactorThreads[threadIndex].thread.join();
+		}
+
+		for (unsigned exchangeIndex = 0; exchangeIndex < sch->numa.nodeCount * STACK_CLASS_COUNT; ++exchangeIndex)
+		{
+			stack_exchange::ReleaseAll(sch->stackExchanges + exchangeIndex, ::task_thread::TASK_STACK_CLASS_SIZES[exchangeIndex % STACK_CLASS_COUNT]);
+		}
+
+		delete[] sch->stackExchanges;
+
+		// Every thread is joined, so nothing can free into these any more. TaskHandles must not outlive the scheduler.
+		for (unsigned threadIndex = 0; threadIndex < sch->taskThreadCount; ++threadIndex)
+		{
+			::task_alloc::ReleaseAll(&sch->taskThreads[threadIndex].taskAlloc);
+		}
+		for (unsigned threadIndex = 0; threadIndex < sch->reactorThreadCount; ++threadIndex)
+		{
+			::task_alloc::ReleaseAll(&sch->reactorThreads[threadIndex].taskAlloc);
+		}
+
+		::task_alloc::ReleaseAll(&sch->foreignAlloc);
+
+		if (::task_alloc::t_taskAlloc == &sch->taskThreads[0].taskAlloc)
+		{
+			::task_alloc::t_taskAlloc = nullptr;
+		}
+		if (::this_thread::t_scheduler == sch)
+		{
+			::this_thread::t_scheduler = nullptr;
+			::this_thread::t_taskThread = nullptr;
+		}
+
+		::task_alloc::ReleaseSlotTable(&sch->taskSlots);
 
 		delete[] sch->taskThreads;
 		delete[] sch->reactorThreads;
 		delete[] sch->activeTaskThreads;
 
-		memset(sch, 0, sizeof(*sch));
+#if USING(OS_LINUX)
+		stack_grow::Uninstall();
+#endif //#if USING(OS_LINUX)
+
+		// Anything still holding the scheduler finds no threads rather than freed ones
+		sch->taskThreads = nullptr;
+		sch->reactorThreads = nullptr;
+		sch->activeTaskThreads = nullptr;
+		sch->taskThreadCount = 0;
+		sch->reactorThreadCount = 0;
+		sch->stackExchanges = nullptr;
 		delete sch;
 	}
+
+	void SetDefault(Scheduler* sch)
+	{
+		::this_thread::s_defaultScheduler.store(sch, std::memory_order_release);
+	}
+
+	size_t GetStackProfiles(Scheduler* sch, StackProfile* outProfiles, size_t maxProfiles)
+	{
+		StackProfileMap merged;
+
+		for (unsigned threadIndex = 0; threadIndex < sch->taskThreadCount; ++threadIndex)
+		{
+			StackProfiles* threadProfiles = &sch->taskThreads[threadIndex].stackProfiles;
+
+			::thread::Lock(&threadProfiles->lock);
+
+			for (const auto& [TaskFunc, threadProfile] : threadProfiles->byTask)
+			{
+				StackProfile& profile = merged[TaskFunc];
+
+				profile.TaskFunc = TaskFunc;
+				profile.peakBytes = std::max(profile.peakBytes, threadProfile.peakBytes);
+				profile.totalBytes += threadProfile.totalBytes;
+				profile.runCount += threadProfile.runCount;
+			}
+
+			::thread::Unlock(&threadProfiles->lock);
+		}
+
+		size_t outIndex = 0;
+		for (const auto& [TaskFunc, profile] : merged)
+		{
+			if (outIndex < maxProfiles)
+			{
+				outProfiles[outIndex] = profile;
+			}
+
+			++outIndex;
+		}
+
+		return outIndex;
+	}
+
+	StackTrimStats GetStackTrimStats(Scheduler* sch)
+	{
+		return StackTrimStats{ sch->parkedTrims.load(std::memory_order_relaxed), sch->parkedTrimmedBytes.load(std::memory_order_relaxed) };
+	}
+
+	size_t GetTaskSlotBytes(Scheduler* sch)
+	{
+		return sch->taskSlots.usedChunks.load(std::memory_order_relaxed) * ::task_alloc::CHUNK_SIZE;
+	}
 }
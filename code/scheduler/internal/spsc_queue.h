@@ -68,7 +68,8 @@ namespace spsc
 				using node = typename fifo_queue<T>::node;
 				node* ret;
 
-				if (q->first == q->headCopy)
+				// Nodes before head are done with, the consumer may still be in head itself
+				if (q->first != q->headCopy)
 				{
 					ret = q->first;
 					q->first = q->first->next.load(std::memory_order_relaxed);
@@ -76,7 +77,7 @@ namespace spsc
 				else
 				{
 					q->headCopy = q->head.load(std::memory_order_acquire);
-					if (q->first == q->headCopy)
+					if (q->first != q->headCopy)
 					{
 						ret = q->first;
 						q->first = q->first->next.load(std::memory_order_relaxed);
@@ -104,6 +105,7 @@ namespace spsc
 				node* const newTail = queue_internal::alloc_node(q);
 
 				newTail->value.buf[0] = std::move(val);
+				newTail->value.head.store(0, std::memory_order_relaxed); // May be recycled
 				newTail->value.tail.store(1, std::memory_order_release); // Release the new value to the consumer thread
 
 				newTail->next.store(nullptr, std::memory_order_relaxed);
@@ -126,19 +128,24 @@ namespace spsc
 
 				if (ret == std::nullopt)
 				{
-					node* const curTail = q->tail.load(std::memory_order_acquire);
+					node* const curHeadNext = curHead->next.load(std::memory_order_acquire);
 
-					if (curTail == curHead)
+					if (!curHeadNext)
 					{
-						sanity(curHead->next.load(std::memory_order_acquire) == nullptr);
 						break;
 					}
-					else
+
+					// The producer has moved on and won't push here again, but its last pushes may not have been
+					// visible to the first try
+					ret = ring::try_pop(&curHead->value);
+
+					if (ret != std::nullopt)
 					{
-						node* const curHeadNext = curHead->next.load(std::memory_order_acquire);
-						q->head.store(curHeadNext, std::memory_order_relaxed);
-						curHead = curHeadNext;
+						return ret;
 					}
+
+					q->head.store(curHeadNext, std::memory_order_release); // Release to alloc_node, which recycles it
+					curHead = curHeadNext;
 				}
 				else
 				{
@@ -165,7 +172,7 @@ namespace spsc
 			{
 				const node* const curTail = q.tail.load(std::memory_order_acquire);
 
-				return curHead != curTail;
+				return curHead == curTail;
 			}
 		}
 	}
@@ -61,7 +61,7 @@ namespace spsc
 			const unsigned curTail = ring.tail.load(std::memory_order_acquire); 
 			const unsigned curHead = ring.head.load(std::memory_order_acquire);
 
-			return ring.CAPACITY - (curTail - curHead);
+			return curTail - curHead;
 		}
 
 		template<typename T, unsigned CapacityLg2>
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <type_traits>
+#include <cstdint>
+
+// Chase-Lev work stealing deque, with the memory orderings from Le, Pop, Cohen and Zappa Nardelli's
+// "Correct and Efficient Work-Stealing for Weak Memory Models". The owning thread pushes and pops the
+// bottom, any thread steals from the top. Grows without bound. Outgrown arrays are kept until the deque
+// is destroyed, since a thief may still be reading one.
+
+namespace ws
+{
+	template<typename T>
+	struct work_deque
+	{
+		static_assert(std::is_pointer_v<T>); // Thieves read items racing the owner, so they must be atomic
+
+		static constexpr unsigned INITIAL_CAPACITY_LG2 = 8;
+
+		struct array
+		{
+			int64_t mask;
+			std::atomic<T>* buf;
+			array* retired; // The smaller array this one replaced
+		};
+
+		std::atomic_int64_t top;
+		uint8_t _cachePad[64 - sizeof(top)];
+		std::atomic_int64_t bottom;
+		std::atomic<array*> items;
+
+		work_deque() : top(0), bottom(0), items(new array{ (1ll << INITIAL_CAPACITY_LG2) - 1, new std::atomic<T>[1ull << INITIAL_CAPACITY_LG2], nullptr })
+		{
+		}
+
+		~work_deque()
+		{
+			array* a = items.load(std::memory_order_relaxed);
+
+			while (a)
+			{
+				array* const retired = a->retired;
+
+				delete[] a->buf;
+				delete a;
+				a = retired;
+			}
+		}
+
+		work_deque(const work_deque&) = delete;
+		work_deque(work_deque&&) = delete;
+		work_deque& operator=(const work_deque&) = delete;
+		work_deque& operator=(work_deque&&) = delete;
+	};
+
+	namespace deque
+	{
+		namespace deque_internal
+		{
+			template<typename T>
+			static typename work_deque<T>::array* grow(typename work_deque<T>::array* a, int64_t top, int64_t bottom)
+			{
+				using array = typename work_deque<T>::array;
+				const int64_t capacity = (a->mask + 1) * 2;
+				array* const grown = new array{ capacity - 1, new std::atomic<T>[capacity], a };
+
+				for (int64_t index = top; index < bottom; ++index)
+				{
+					grown->buf[index & grown->mask].store(a->buf[index & a->mask].load(std::memory_order_relaxed), std::memory_order_relaxed);
+				}
+
+				return grown;
+			}
+		}
+
+		// Owner only
+		template<typename T>
+		static void push(work_deque<T>* d, T val)
+		{
+			using array = typename work_deque<T>::array;
+			const int64_t b = d->bottom.load(std::memory_order_relaxed);
+			const int64_t t = d->top.load(std::memory_order_acquire);
+			array* a = d->items.load(std::memory_order_relaxed);
+
+			if (b - t > a->mask)
+			{
+				a = deque_internal::grow<T>(a, t, b);
+				d->items.store(a, std::memory_order_release); // Release the copied items to thieves
+			}
+
+			a->buf[b & a->mask].store(val, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			d->bottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		// Owner only, newest first
+		template<typename T>
+		static std::optional<T> try_pop(work_deque<T>* d)
+		{
+			using array = typename work_deque<T>::array;
+			const int64_t b = d->bottom.load(std::memory_order_relaxed) - 1;
+			array* const a = d->items.load(std::memory_order_relaxed);
+
+			d->bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst); // Thieves must see the claim before we read top
+
+			int64_t t = d->top.load(std::memory_order_relaxed);
+			std::optional<T> ret = std::nullopt;
+
+			if (t <= b)
+			{
+				ret = a->buf[b & a->mask].load(std::memory_order_relaxed);
+
+				if (t == b)
+				{
+					// Last item, race thieves for it
+					if (!d->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					{
+						ret = std::nullopt;
+					}
+
+					d->bottom.store(b + 1, std::memory_order_relaxed);
+				}
+			}
+			else
+			{
+				d->bottom.store(b + 1, std::memory_order_relaxed);
+			}
+
+			return ret;
+		}
+
+		// Any thread, oldest first. Also fails when losing a race with another thief or the owner.
+		template<typename T>
+		static std::optional<T> try_steal(work_deque<T>* d)
+		{
+			using array = typename work_deque<T>::array;
+			int64_t t = d->top.load(std::memory_order_acquire);
+
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			const int64_t b = d->bottom.load(std::memory_order_acquire);
+
+			if (t < b)
+			{
+				array* const a = d->items.load(std::memory_order_acquire);
+				const T ret = a->buf[t & a->mask].load(std::memory_order_relaxed);
+
+				if (d->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					return ret;
+				}
+			}
+
+			return std::nullopt;
+		}
+
+		// Any thread. Only a hint when called by a thief.
+		template<typename T>
+		static bool is_empty(const work_deque<T>* d)
+		{
+			const int64_t b = d->bottom.load(std::memory_order_acquire);
+			const int64_t t = d->top.load(std::memory_order_acquire);
+
+			return b <= t;
+		}
+	}
+}
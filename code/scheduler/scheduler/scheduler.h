@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 namespace scheduler
 {
 	struct Scheduler;
@@ -10,6 +12,24 @@ namespace scheduler
 		OS_ABI_SAFE = 1<<0,
 		PRESERVE_FPU_CONTROL = 1<<1,
 		WORK_STEALING = 1<<2,
+		PROFILE_STACKS = 1<<3, // Paint task stacks and record their peak depth per task function
+		// Linux only. Carve task stacks out of one mapping per thread. There are no guard pages between them: a task
+		// that overflows its stack writes over the stack below, and is only caught, by aborting, once it finishes.
+		STACK_ARENA = 1<<4,
+	};
+
+	struct StackProfile
+	{
+		void (*TaskFunc)(void*);
+		size_t peakBytes;
+		size_t totalBytes; // Divide by runCount for the mean
+		size_t runCount;
+	};
+
+	struct StackTrimStats
+	{
+		size_t parkedTrims; // Times a fiber suspended in task::Wait had its stack trimmed to its live frames
+		size_t parkedTrimmedBytes;
 	};
 
 	constexpr Options operator|(Options a, Options b)
@@ -19,5 +39,23 @@ namespace scheduler
 
 	Scheduler* Create(Options opts);
 	void Destroy(Scheduler* sch);
+
+	/* Threads a scheduler didn't start, other than the one that created it, create, run and wait on the default
+	*  scheduler's tasks. The first scheduler created is the default until it's destroyed. Null leaves none.
+	*/
 	void SetDefault(Scheduler* sch);
+
+	/* Merges every task thread's stack profile, one entry per task function. Only gathered with
+	*  Options::PROFILE_STACKS. Fills up to maxProfiles entries and returns the number of task
+	*  functions seen. Threads record as their tasks finish, so tasks still running aren't counted yet.
+	*  Safe to call while tasks run.
+	*/
+	size_t GetStackProfiles(Scheduler* sch, StackProfile* outProfiles, size_t maxProfiles);
+
+	// Totals since Create. Trimming only happens on linux, see PARKED_STACK_TRIM_MS.
+	StackTrimStats GetStackTrimStats(Scheduler* sch);
+
+	// Task slots handed out to threads so far. Slots are reused once their task finishes, on whichever thread that is,
+	// so this stays at the most tasks ever live at once.
+	size_t GetTaskSlotBytes(Scheduler* sch);
 }
@@ -1,48 +1,73 @@
 #pragma once
 
 #include <type_traits>
+#include <cstddef>
+#include <cstdint>
 
 namespace scheduler
 {
 	struct Scheduler;
-	struct TaskHandle
+
+	// Size of the stack a task runs on. Stacks are recycled per class, and an explicit size runs on the smallest
+	// class that fits it. Sizes past LARGE get a stack of their own, released once the task finishes.
+	// On linux only the top 16KB (TASK_STACK_MIN_COMMIT) is commited up front, the rest is commited down to the
+	// lowest page touched. The kernel's own accesses don't grow it, a syscall writing to stack the task hasn't
+	// reached fails with EFAULT. Calling a syscall wrapper touches below the caller's frame, so only an inline
+	// syscall from a leaf function can. Frames past a page need -fstack-clash-protection, which the CMake build
+	// adds to anything linking Scheduler.
+	struct StackSize
 	{
-		TaskHandle();
-		TaskHandle(const TaskHandle& rhs);
-		TaskHandle(TaskHandle&& rhs);
-		TaskHandle& operator=(const TaskHandle& rhs);
-		TaskHandle& operator=(TaskHandle&& rhs);
-		~TaskHandle();
+		size_t bytes;
+
+		static const StackSize TINY; // Leaf tasks
+		static const StackSize SMALL;
+		static const StackSize DEFAULT;
+		static const StackSize LARGE; // Deep recursion
+	};
 
+	inline constexpr StackSize StackSize::TINY{ 64 * 1024 };
+	inline constexpr StackSize StackSize::SMALL{ 256 * 1024 };
+	inline constexpr StackSize StackSize::DEFAULT{ 1024 * 1024 };
+	inline constexpr StackSize StackSize::LARGE{ 8 * 1024 * 1024 };
+
+	// Cheap to copy, nothing is shared between copies. Stays valid after the task finishes, and reads as finished
+	// from then on.
+	struct TaskHandle
+	{
 	private:
-		void* data;
+		friend struct TaskHandleAccess;
+
+		uint64_t data = 0; // Slot index in the low 32 bits, the slot's generation in the high
 	};
 
 	namespace task
 	{
-		TaskHandle Create(void (*Task)(void*), const void* userData, size_t dataSize, size_t alignment = 0);
-		TaskHandle Create_Stack(void (*Task)(void*), const void* userData); // Task had better finish before userData goes out of scope
+		TaskHandle Create(void (*Task)(void*), const void* userData, size_t dataSize, size_t alignment = 0, StackSize stackSize = StackSize::DEFAULT);
+		TaskHandle Create_Stack(void (*Task)(void*), const void* userData, StackSize stackSize = StackSize::DEFAULT); // Task had better finish before userData goes out of scope
 
 		template<typename FuncT>
-		TaskHandle Create(FuncT Task)
+		TaskHandle Create(FuncT Task, StackSize stackSize = StackSize::DEFAULT)
 		{
 			static_assert(std::is_trivially_copyable_v<FuncT>);
 
-			return Create([](const void* userData)
+			return Create([](void* userData)
 			{
-				reinterpret_cast<FuncT*>(const_cast<void*>(uesrData))();
-			}, &Task, sizeof(Task), alignof(FuncT));
+				(*reinterpret_cast<FuncT*>(userData))();
+			}, &Task, sizeof(Task), alignof(FuncT), stackSize);
 		}
 
+		// By reference, Task is called in place. It had better outlive the task.
 		template<typename FuncT>
-		TaskHandle Create_Stack(FuncT Task)
+		TaskHandle Create_Stack(FuncT& Task, StackSize stackSize = StackSize::DEFAULT)
 		{
-			return Create_Stack([](const void* userData)
+			return Create_Stack([](void* userData)
 			{
-				reinterpret_cast<FuncT*>(const_cast<void*>(uesrData))();
-			}, &Task);
+				(*reinterpret_cast<FuncT*>(userData))();
+			}, &Task, stackSize);
 		}
 
+		// optThread pins the task to one task thread, taken modulo their count, so equal values share a thread. Pinned
+		// tasks are never stolen. By default a task runs wherever the scheduler puts it.
 		void Run(TaskHandle task, unsigned optThread = ~0u);
 		void RunAndWait(TaskHandle task, unsigned optThread = ~0u);
 		void Wait(TaskHandle task);
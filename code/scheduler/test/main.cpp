@@ -0,0 +1,1136 @@
+#include "platform.h"
+#include "../scheduler/scheduler.h"
+#include "../scheduler/task.h"
+#include "../internal/ws_deque.h"
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+#if USING(OS_LINUX)
+# include <unistd.h>
+# include <signal.h>
+# include <sys/wait.h>
+# include <sys/resource.h>
+#endif //#if USING(OS_LINUX)
+
+static constexpr unsigned OPTION_COUNT = 5;
+static const char* const s_optionNames[OPTION_COUNT] = { "OS_ABI_SAFE", "PRESERVE_FPU_CONTROL", "WORK_STEALING", "PROFILE_STACKS", "STACK_ARENA" };
+
+static const char* OptionsName(scheduler::Options opts, char* outName, size_t nameSize)
+{
+	outName[0] = '\0';
+
+	for (unsigned option = 0; option < OPTION_COUNT; ++option)
+	{
+		if (static_cast<unsigned>(opts) & (1u << option))
+		{
+			if (outName[0])
+			{
+				strncat(outName, " | ", nameSize - strlen(outName) - 1);
+			}
+			strncat(outName, s_optionNames[option], nameSize - strlen(outName) - 1);
+		}
+	}
+
+	return outName[0] ? outName : "NONE";
+}
+
+struct FibData
+{
+	unsigned n;
+	std::atomic<unsigned>* leafSum;
+};
+
+// Fork-join. Both halves are created and run before either is waited on, so waits suspend with work outstanding.
+static void FibTask(void* dataPtr)
+{
+	const FibData* const data = reinterpret_cast<const FibData*>(dataPtr);
+
+	if (data->n < 2)
+	{
+		data->leafSum->fetch_add(data->n, std::memory_order_relaxed);
+		return;
+	}
+
+	const FibData left{ data->n - 1, data->leafSum };
+	const FibData right{ data->n - 2, data->leafSum };
+	const scheduler::TaskHandle leftTask = scheduler::task::Create(FibTask, &left, sizeof(left), alignof(FibData));
+	const scheduler::TaskHandle rightTask = scheduler::task::Create(FibTask, &right, sizeof(right), alignof(FibData));
+
+	scheduler::task::Run(leftTask);
+	scheduler::task::Run(rightTask);
+	scheduler::task::Wait(leftTask);
+	scheduler::task::Wait(rightTask);
+}
+
+static unsigned Fib(unsigned n)
+{
+	return n < 2 ? n : Fib(n - 1) + Fib(n - 2);
+}
+
+static unsigned RunFib(unsigned n)
+{
+	std::atomic<unsigned> leafSum{ 0 };
+	const FibData root{ n, &leafSum };
+
+	scheduler::task::RunAndWait(scheduler::task::Create(FibTask, &root, sizeof(root), alignof(FibData)));
+
+	return leafSum.load(std::memory_order_relaxed);
+}
+
+static bool RunFibTest(scheduler::Options opts)
+{
+	static constexpr unsigned FIB_N = 15;
+	char optsName[128];
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+	const unsigned sum = RunFib(FIB_N);
+
+	scheduler::Destroy(sch);
+
+	const bool passed = sum == Fib(FIB_N);
+
+	printf("%s: fork-join fib(%u), options: %s, sum %u, expected %u\n", passed ? "PASSED" : "FAILED", FIB_N, OptionsName(opts, optsName, sizeof(optsName)), sum, Fib(FIB_N));
+
+	return passed;
+}
+
+// Lost wakeups only show some of the time, each run gives a parked thread another chance to miss its work
+static bool RunRepeatedForkJoinTest(scheduler::Options opts)
+{
+	static constexpr unsigned FIB_N = 10;
+	static constexpr unsigned SCHEDULER_COUNT = 32;
+	static constexpr unsigned RUN_COUNT = 16; // Per scheduler
+	char optsName[128];
+	unsigned failedRuns = 0;
+
+	for (unsigned schedulerIndex = 0; schedulerIndex < SCHEDULER_COUNT; ++schedulerIndex)
+	{
+		scheduler::Scheduler* const sch = scheduler::Create(opts);
+
+		for (unsigned runIndex = 0; runIndex < RUN_COUNT; ++runIndex)
+		{
+			failedRuns += RunFib(FIB_N) == Fib(FIB_N) ? 0 : 1;
+		}
+
+		scheduler::Destroy(sch);
+	}
+
+	const bool passed = failedRuns == 0;
+
+	printf("%s: %u runs of fork-join fib(%u), options: %s, %u miscounted\n", passed ? "PASSED" : "FAILED", SCHEDULER_COUNT * RUN_COUNT, FIB_N, OptionsName(opts, optsName, sizeof(optsName)), failedRuns);
+
+	return passed;
+}
+
+static void CountTask(void* dataPtr)
+{
+	reinterpret_cast<std::atomic<unsigned>*>(dataPtr)->fetch_add(1, std::memory_order_relaxed);
+}
+
+template<size_t Size, size_t Align>
+struct alignas(Align) Payload
+{
+	size_t* sum;
+	uint8_t bytes[Size - sizeof(size_t*)];
+};
+
+template<size_t Size, size_t Align>
+static void SumPayloadTask(void* dataPtr)
+{
+	Payload<Size, Align>* const payload = reinterpret_cast<Payload<Size, Align>*>(dataPtr);
+
+	*payload->sum = (reinterpret_cast<uintptr_t>(payload) & (Align - 1)) == 0 ? 0 : ~size_t(0);
+	for (const uint8_t byte : payload->bytes)
+	{
+		*payload->sum += byte;
+	}
+}
+
+// The payload is copied at Create, so overwriting the original before the task runs mustn't show
+template<size_t Size, size_t Align>
+static bool RunPayload(size_t* outSum)
+{
+	Payload<Size, Align> payload;
+	size_t expected = 0;
+
+	payload.sum = outSum;
+	for (size_t byteIndex = 0; byteIndex < sizeof(payload.bytes); ++byteIndex)
+	{
+		payload.bytes[byteIndex] = static_cast<uint8_t>(byteIndex + 1);
+		expected += static_cast<uint8_t>(byteIndex + 1);
+	}
+
+	scheduler::TaskHandle task = scheduler::task::Create(SumPayloadTask<Size, Align>, &payload, sizeof(payload), alignof(Payload<Size, Align>));
+
+	memset(payload.bytes, 0, sizeof(payload.bytes));
+	scheduler::task::RunAndWait(task);
+
+	return *outSum == expected;
+}
+
+// Small payloads ride in the task, big or over-aligned ones are copied to the heap
+static bool RunPayloadTest()
+{
+	scheduler::Scheduler* const sch = scheduler::Create(scheduler::Options::NONE);
+	size_t sum = 0;
+	bool passed = true;
+
+	passed &= RunPayload<16, 8>(&sum);
+	passed &= RunPayload<48, 16>(&sum);
+	passed &= RunPayload<64, 64>(&sum);
+	passed &= RunPayload<256, 8>(&sum);
+
+	scheduler::Destroy(sch);
+
+	printf("%s: task payloads copied inline and to the heap\n", passed ? "PASSED" : "FAILED");
+
+	return passed;
+}
+
+static bool RunFunctorTest()
+{
+	std::atomic<unsigned> count{ 0 };
+	std::atomic<unsigned>* const countPtr = &count;
+	scheduler::Scheduler* const sch = scheduler::Create(scheduler::Options::NONE);
+
+	// Copied into the task
+	scheduler::task::RunAndWait(scheduler::task::Create([countPtr]() { countPtr->fetch_add(1, std::memory_order_relaxed); }));
+
+	// Called in place
+	auto addTwo = [&count]() { count.fetch_add(2, std::memory_order_relaxed); };
+	scheduler::task::RunAndWait(scheduler::task::Create_Stack(addTwo, scheduler::StackSize::TINY));
+
+	scheduler::Destroy(sch);
+
+	const bool passed = count.load(std::memory_order_relaxed) == 3;
+
+	printf("%s: functor tasks, count %u, expected 3\n\n", passed ? "PASSED" : "FAILED", count.load(std::memory_order_relaxed));
+
+	return passed;
+}
+
+static constexpr size_t RECURSE_FRAME_SIZE = 1024;
+
+static size_t Recurse(size_t depth)
+{
+	volatile uint8_t frame[RECURSE_FRAME_SIZE];
+
+	frame[depth % RECURSE_FRAME_SIZE] = static_cast<uint8_t>(depth);
+
+	// Not a tail call, every frame stays live
+	return depth == 0 ? 0 : Recurse(depth - 1) + frame[depth % RECURSE_FRAME_SIZE];
+}
+
+struct RecurseData
+{
+	size_t depth;
+	size_t result;
+};
+
+static void RecurseTask(void* dataPtr)
+{
+	RecurseData* const data = reinterpret_cast<RecurseData*>(dataPtr);
+
+	data->result = Recurse(data->depth);
+}
+
+static bool RunDeepStackTest(scheduler::Options opts)
+{
+	static const scheduler::StackSize stackSizes[] = { scheduler::StackSize::TINY, scheduler::StackSize::SMALL, scheduler::StackSize::DEFAULT, scheduler::StackSize::LARGE, { scheduler::StackSize::LARGE.bytes * 2 } };
+	char optsName[128];
+	bool passed = true;
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+
+	printf("Deep recursion, options: %s\n", OptionsName(opts, optsName, sizeof(optsName)));
+
+	for (const scheduler::StackSize stackSize : stackSizes)
+	{
+		// Three quarters of the stack, leaving room for the frames under the task and frame overhead
+		RecurseData data{ stackSize.bytes * 3 / 4 / (RECURSE_FRAME_SIZE + 64), 0 };
+		size_t expected = 0;
+
+		for (size_t depth = 1; depth <= data.depth; ++depth)
+		{
+			expected += static_cast<uint8_t>(depth);
+		}
+
+		scheduler::task::RunAndWait(scheduler::task::Create_Stack(RecurseTask, &data, stackSize));
+
+		const bool stackPassed = data.result == expected;
+
+		printf("%s: %zu KB stack, %zu frames\n", stackPassed ? "PASSED" : "FAILED", stackSize.bytes / 1024, data.depth);
+		passed &= stackPassed;
+	}
+
+	scheduler::Destroy(sch);
+	printf("\n");
+
+	return passed;
+}
+
+static bool RunStackProfileTest(scheduler::Options opts)
+{
+	static constexpr size_t USED_STACK_SIZE = 300 * 1024;
+	char optsName[128];
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+	RecurseData data{ USED_STACK_SIZE / RECURSE_FRAME_SIZE, 0 }; // Frames are at least RECURSE_FRAME_SIZE
+	scheduler::StackProfile profile{};
+
+	scheduler::task::RunAndWait(scheduler::task::Create_Stack(RecurseTask, &data));
+
+	const size_t profileCount = scheduler::GetStackProfiles(sch, &profile, 1);
+
+	scheduler::Destroy(sch);
+
+	const bool passed = profileCount == 1 && profile.TaskFunc == RecurseTask && profile.peakBytes >= USED_STACK_SIZE;
+
+	printf("%s: stack profile, options: %s, peak %zu bytes, used at least %zu\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), profile.peakBytes, USED_STACK_SIZE);
+
+	return passed;
+}
+
+// Deep tasks grow their stack past the part kept resident when it's returned, shallow ones stay within it. Each deep
+// task after the first runs on a recycled stack that was trimmed back, and has to regrow it.
+static bool RunStackRecycleTest(scheduler::Options opts)
+{
+	static constexpr unsigned ROUND_COUNT = 16;
+	static constexpr size_t DEEP_STACK_SIZE = 300 * 1024;
+	static constexpr size_t SHALLOW_STACK_SIZE = 8 * 1024;
+	char optsName[128];
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+	unsigned failedRounds = 0;
+
+	for (unsigned round = 0; round < ROUND_COUNT; ++round)
+	{
+		RecurseData data{ (round & 1 ? SHALLOW_STACK_SIZE : DEEP_STACK_SIZE) / RECURSE_FRAME_SIZE, 0 };
+		size_t expected = 0;
+
+		for (size_t depth = 1; depth <= data.depth; ++depth)
+		{
+			expected += static_cast<uint8_t>(depth);
+		}
+
+		scheduler::task::RunAndWait(scheduler::task::Create_Stack(RecurseTask, &data));
+
+		failedRounds += data.result == expected ? 0 : 1;
+	}
+
+	scheduler::Destroy(sch);
+
+	const bool passed = failedRounds == 0;
+
+	printf("%s: recycled stacks trimmed and regrown, options: %s, %u rounds, %u wrong\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), ROUND_COUNT, failedRounds);
+
+	return passed;
+}
+
+// The scheduler learns how much stack a task function needs and commits that up front, halving it after a long
+// run of tasks that never needed it. A deep task after the depth decayed has to grow its stack again.
+static bool RunLearnedStackDepthTest(scheduler::Options opts)
+{
+	static constexpr unsigned SHALLOW_RUN_COUNT = 256; // Past a few decays
+	static constexpr size_t DEEP_STACK_SIZE = 300 * 1024;
+	static constexpr size_t SHALLOW_STACK_SIZE = 8 * 1024;
+	char optsName[128];
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+	unsigned failedRuns = 0;
+
+	for (unsigned run = 0; run < SHALLOW_RUN_COUNT + 4; ++run)
+	{
+		// Deep twice to learn the depth and run with it commited, shallow until it decays, deep twice more
+		const bool deep = run < 2 || run >= SHALLOW_RUN_COUNT + 2;
+		RecurseData data{ (deep ? DEEP_STACK_SIZE : SHALLOW_STACK_SIZE) / RECURSE_FRAME_SIZE, 0 };
+		size_t expected = 0;
+
+		for (size_t depth = 1; depth <= data.depth; ++depth)
+		{
+			expected += static_cast<uint8_t>(depth);
+		}
+
+		scheduler::task::RunAndWait(scheduler::task::Create_Stack(RecurseTask, &data));
+
+		failedRuns += data.result == expected ? 0 : 1;
+	}
+
+	scheduler::Destroy(sch);
+
+	const bool passed = failedRuns == 0;
+
+	printf("%s: learned stack depth decayed and relearned, options: %s, %u runs, %u wrong\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), SHALLOW_RUN_COUNT + 4, failedRuns);
+
+	return passed;
+}
+
+template<unsigned FuncIndex>
+static void ProfiledTask(void* dataPtr)
+{
+	reinterpret_cast<std::atomic<unsigned>*>(dataPtr)->fetch_add(1, std::memory_order_relaxed);
+}
+
+// Distinct task functions, so the threads' profile maps keep growing while they're read
+template<unsigned... FuncIndices>
+static constexpr std::array<void(*)(void*), sizeof...(FuncIndices)> ProfiledTasks(std::integer_sequence<unsigned, FuncIndices...>)
+{
+	return { ProfiledTask<FuncIndices>... };
+}
+
+static bool RunConcurrentStackProfileTest(scheduler::Options opts)
+{
+	static constexpr unsigned FUNC_COUNT = 64;
+	static constexpr unsigned RUNS_PER_FUNC = 32;
+	static constexpr auto s_taskFuncs = ProfiledTasks(std::make_integer_sequence<unsigned, FUNC_COUNT>());
+	char optsName[128];
+	std::atomic<unsigned> count{ 0 };
+	scheduler::StackProfile profiles[FUNC_COUNT] = {};
+	size_t maxProfileCount = 0;
+	bool grew = true;
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+
+	for (unsigned run = 0; run < RUNS_PER_FUNC; ++run)
+	{
+		scheduler::TaskHandle tasks[FUNC_COUNT];
+
+		for (unsigned funcIndex = 0; funcIndex < FUNC_COUNT; ++funcIndex)
+		{
+			tasks[funcIndex] = scheduler::task::Create_Stack(s_taskFuncs[funcIndex], &count);
+			scheduler::task::Run(tasks[funcIndex]);
+		}
+
+		// Read while they run, never seeing fewer functions than before
+		const size_t profileCount = scheduler::GetStackProfiles(sch, profiles, FUNC_COUNT);
+
+		grew &= profileCount >= maxProfileCount;
+		maxProfileCount = std::max(maxProfileCount, profileCount);
+
+		for (const scheduler::TaskHandle& task : tasks)
+		{
+			scheduler::task::Wait(task);
+		}
+	}
+
+	const size_t profileCount = scheduler::GetStackProfiles(sch, profiles, FUNC_COUNT);
+	unsigned runCount = 0;
+
+	scheduler::Destroy(sch);
+
+	for (size_t profileIndex = 0; profileIndex < std::min(profileCount, size_t(FUNC_COUNT)); ++profileIndex)
+	{
+		runCount += static_cast<unsigned>(profiles[profileIndex].runCount);
+	}
+
+	const bool passed = grew && profileCount == FUNC_COUNT && runCount == FUNC_COUNT * RUNS_PER_FUNC && count.load() == FUNC_COUNT * RUNS_PER_FUNC;
+
+	printf("%s: stack profiles read while running, options: %s, %zu functions, %u runs\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), profileCount, runCount);
+
+	return passed;
+}
+
+// Nothing here suspends a task fiber, so however long the tasks take, no stack is parked and none is trimmed
+static bool RunUnparkedTrimTest(scheduler::Options opts)
+{
+	static constexpr size_t USED_STACK_SIZE = 300 * 1024;
+	char optsName[128];
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+	RecurseData data{ USED_STACK_SIZE / RECURSE_FRAME_SIZE, 0 };
+
+	scheduler::task::RunAndWait(scheduler::task::Create_Stack(RecurseTask, &data));
+
+	const scheduler::StackTrimStats stats = scheduler::GetStackTrimStats(sch);
+
+	scheduler::Destroy(sch);
+
+	const bool passed = stats.parkedTrims == 0 && stats.parkedTrimmedBytes == 0;
+
+	printf("%s: no parked stack trims without waits, options: %s, %zu trims, %zu bytes\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), stats.parkedTrims, stats.parkedTrimmedBytes);
+
+	return passed;
+}
+
+static void LongTask(void*)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(1500)); // Past PARKED_STACK_TRIM_MS
+}
+
+// Commits a deep stack, then waits on a long task from a shallow frame
+static void DeepThenWaitTask(void* dataPtr)
+{
+	RecurseTask(dataPtr);
+
+	const scheduler::TaskHandle longTask = scheduler::task::Create_Stack(LongTask, nullptr, scheduler::StackSize::TINY);
+
+	scheduler::task::Run(longTask);
+	scheduler::task::Wait(longTask);
+}
+
+static bool RunStackTrimTest(scheduler::Options opts)
+{
+	char optsName[128];
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+	RecurseData data{ 256, 0 };
+	const bool profiling = !!(static_cast<unsigned>(opts) & static_cast<unsigned>(scheduler::Options::PROFILE_STACKS));
+	scheduler::StackProfile profiles[2] = {}; // DeepThenWaitTask and LongTask
+	scheduler::StackProfile profile{};
+
+	scheduler::task::RunAndWait(scheduler::task::Create_Stack(DeepThenWaitTask, &data, scheduler::StackSize::DEFAULT));
+
+	const scheduler::StackTrimStats trimStats = scheduler::GetStackTrimStats(sch);
+	const size_t profileCount = std::min(scheduler::GetStackProfiles(sch, profiles, 2), size_t(2));
+
+	scheduler::Destroy(sch);
+
+	for (size_t profileIndex = 0; profileIndex < profileCount; ++profileIndex)
+	{
+		if (profiles[profileIndex].TaskFunc == DeepThenWaitTask)
+		{
+			profile = profiles[profileIndex];
+		}
+	}
+
+	bool passed;
+
+	if (profiling)
+	{
+		// Never trimmed, and the peak is the recursion, not the whole painted stack
+		passed = trimStats.parkedTrims == 0 && profile.peakBytes >= 256 * 1024 && profile.peakBytes < 512 * 1024;
+	}
+	else
+	{
+#if USING(OS_LINUX)
+		// Most of the 256 frames were committed below the waiting frame
+		passed = trimStats.parkedTrims == 1 && trimStats.parkedTrimmedBytes >= 128 * 1024;
+#else //#if USING(OS_LINUX)
+		passed = trimStats.parkedTrims == 0;
+#endif //#else //#if USING(OS_LINUX)
+	}
+
+	printf("%s: parked stack trim, options: %s, %zu trims, %zu bytes, peak %zu bytes\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), trimStats.parkedTrims, trimStats.parkedTrimmedBytes, profile.peakBytes);
+
+	return passed;
+}
+
+// Every class's free stacks go through the exchanges when a task thread exits, and Destroy releases what's left there
+static bool RunStackExchangeTest(scheduler::Options opts)
+{
+	static const scheduler::StackSize stackSizes[] = { scheduler::StackSize::TINY, scheduler::StackSize::SMALL, scheduler::StackSize::DEFAULT, scheduler::StackSize::LARGE };
+	static constexpr unsigned SCHEDULER_COUNT = 8;
+	static constexpr unsigned TASK_COUNT = 64;
+	char optsName[128];
+	unsigned failedSchedulers = 0;
+
+	for (unsigned schedulerIndex = 0; schedulerIndex < SCHEDULER_COUNT; ++schedulerIndex)
+	{
+		scheduler::Scheduler* const sch = scheduler::Create(opts);
+		std::atomic<unsigned> count{ 0 };
+
+		{
+			scheduler::TaskHandle tasks[TASK_COUNT];
+
+			for (unsigned taskIndex = 0; taskIndex < TASK_COUNT; ++taskIndex)
+			{
+				tasks[taskIndex] = scheduler::task::Create_Stack(CountTask, &count, stackSizes[taskIndex % std::size(stackSizes)]);
+				scheduler::task::Run(tasks[taskIndex]);
+			}
+			for (const scheduler::TaskHandle& task : tasks)
+			{
+				scheduler::task::Wait(task);
+			}
+		}
+
+		scheduler::Destroy(sch);
+
+		failedSchedulers += count.load(std::memory_order_relaxed) == TASK_COUNT ? 0 : 1;
+	}
+
+	const bool passed = failedSchedulers == 0;
+
+	printf("%s: stacks of every class through the exchanges, options: %s, %u schedulers of %u tasks, %u miscounted\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), SCHEDULER_COUNT, TASK_COUNT, failedSchedulers);
+
+	return passed;
+}
+
+struct WideData
+{
+	std::atomic<unsigned>* byteSum;
+	uint8_t bytes[120];
+};
+
+static void WideTask(void* dataPtr)
+{
+	const WideData* const data = reinterpret_cast<const WideData*>(dataPtr);
+	unsigned byteSum = 0;
+
+	for (uint8_t byte : data->bytes)
+	{
+		byteSum += byte;
+	}
+
+	data->byteSum->fetch_add(byteSum, std::memory_order_relaxed);
+}
+
+// Threads the scheduler didn't start create, run and wait on tasks of the default scheduler, all at once
+static bool RunForeignThreadTest(scheduler::Options opts)
+{
+	static constexpr unsigned FIB_N = 12;
+	static constexpr unsigned THREAD_COUNT = 4;
+	static constexpr unsigned WIDE_TASK_COUNT = 64; // Per thread
+	char optsName[128];
+	std::atomic<unsigned> failedRuns{ 0 };
+	std::atomic<unsigned> byteSum{ 0 };
+	std::thread threads[THREAD_COUNT];
+	WideData wide{ &byteSum, {} };
+
+	for (unsigned byteIndex = 0; byteIndex < sizeof(wide.bytes); ++byteIndex)
+	{
+		wide.bytes[byteIndex] = static_cast<uint8_t>(byteIndex);
+	}
+
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+
+	for (std::thread& thread : threads)
+	{
+		thread = std::thread([&failedRuns, &wide]()
+		{
+			scheduler::TaskHandle tasks[WIDE_TASK_COUNT];
+
+			for (scheduler::TaskHandle& task : tasks)
+			{
+				task = scheduler::task::Create(WideTask, &wide, sizeof(wide), alignof(WideData), scheduler::StackSize::TINY);
+				scheduler::task::Run(task);
+			}
+
+			failedRuns.fetch_add(RunFib(FIB_N) == Fib(FIB_N) ? 0 : 1, std::memory_order_relaxed);
+
+			for (const scheduler::TaskHandle& task : tasks)
+			{
+				scheduler::task::Wait(task);
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	scheduler::Destroy(sch);
+
+	const unsigned expectedByteSum = THREAD_COUNT * WIDE_TASK_COUNT * (sizeof(wide.bytes) * (sizeof(wide.bytes) - 1) / 2);
+	const bool passed = failedRuns.load(std::memory_order_relaxed) == 0 && byteSum.load(std::memory_order_relaxed) == expectedByteSum;
+
+	printf("%s: tasks from %u std::threads, options: %s, %u fib(%u) miscounted, byte sum %u, expected %u\n", passed ? "PASSED" : "FAILED", THREAD_COUNT, OptionsName(opts, optsName, sizeof(optsName)), failedRuns.load(std::memory_order_relaxed), FIB_N, byteSum.load(std::memory_order_relaxed), expectedByteSum);
+
+	return passed;
+}
+
+// Every task is created on this thread and finishes on a task thread, so its TaskRef and payload only come back
+// through the creating thread's remote free list. Without that the TaskRef chunks grow with every batch.
+static bool RunRemoteFreeTest(scheduler::Options opts)
+{
+	static constexpr unsigned BATCH_COUNT = 128;
+	static constexpr unsigned BATCH_SIZE = 1024;
+	static constexpr size_t MAX_SLOT_BYTES = 4 * 512 * 1024; // A few slot chunks, the batch in flight and the one before
+	char optsName[128];
+	std::atomic<unsigned> byteSum{ 0 };
+	WideData wide{ &byteSum, {} };
+
+	wide.bytes[0] = 1;
+
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+
+	for (unsigned batchIndex = 0; batchIndex < BATCH_COUNT; ++batchIndex)
+	{
+		scheduler::TaskHandle tasks[BATCH_SIZE];
+
+		for (scheduler::TaskHandle& task : tasks)
+		{
+			task = scheduler::task::Create(WideTask, &wide, sizeof(wide), alignof(WideData), scheduler::StackSize::TINY);
+			scheduler::task::Run(task);
+		}
+		for (const scheduler::TaskHandle& task : tasks)
+		{
+			scheduler::task::Wait(task);
+		}
+	}
+
+	const size_t slotBytes = scheduler::GetTaskSlotBytes(sch);
+
+	scheduler::Destroy(sch);
+
+	const bool passed = byteSum.load(std::memory_order_relaxed) == BATCH_COUNT * BATCH_SIZE && slotBytes <= MAX_SLOT_BYTES;
+
+	printf("%s: %u tasks freed off their creating thread, options: %s, %u ran, %zu slot bytes, at most %zu\n", passed ? "PASSED" : "FAILED", BATCH_COUNT * BATCH_SIZE, OptionsName(opts, optsName, sizeof(optsName)), byteSum.load(std::memory_order_relaxed), slotBytes, MAX_SLOT_BYTES);
+
+	return passed;
+}
+
+// Handles of finished tasks, waited on once their slots belong to new tasks that can't finish yet. A handle that
+// only read its slot's status would block on the new task.
+static bool RunStaleHandleTest(scheduler::Options opts)
+{
+	static constexpr unsigned TASK_COUNT = 256;
+	char optsName[128];
+	std::atomic<unsigned> count{ 0 };
+	std::atomic<unsigned>* const countPtr = &count;
+	scheduler::TaskHandle staleTasks[TASK_COUNT];
+	scheduler::TaskHandle blockedTasks[TASK_COUNT];
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+
+	for (scheduler::TaskHandle& task : staleTasks)
+	{
+		task = scheduler::task::Create_Stack(CountTask, &count, scheduler::StackSize::TINY);
+		scheduler::task::Run(task);
+	}
+	for (const scheduler::TaskHandle& task : staleTasks)
+	{
+		scheduler::task::Wait(task);
+	}
+
+	// Created, never run until every stale handle has been waited on
+	const scheduler::TaskHandle gate = scheduler::task::Create_Stack(CountTask, &count, scheduler::StackSize::TINY);
+
+	// Mostly in the slots the finished tasks gave back
+	for (scheduler::TaskHandle& task : blockedTasks)
+	{
+		task = scheduler::task::Create([gate, countPtr]()
+		{
+			scheduler::task::Wait(gate);
+			countPtr->fetch_add(1, std::memory_order_relaxed);
+		}, scheduler::StackSize::TINY);
+		scheduler::task::Run(task);
+	}
+
+	for (const scheduler::TaskHandle& task : staleTasks)
+	{
+		scheduler::task::Wait(task);
+	}
+
+	scheduler::task::Run(gate);
+	for (const scheduler::TaskHandle& task : blockedTasks)
+	{
+		scheduler::task::Wait(task);
+	}
+
+	scheduler::Destroy(sch);
+
+	const bool passed = count.load(std::memory_order_relaxed) == 2 * TASK_COUNT + 1;
+
+	printf("%s: wait on %u handles after their slots were reused, options: %s, %u of %u tasks ran\n", passed ? "PASSED" : "FAILED", TASK_COUNT, OptionsName(opts, optsName, sizeof(optsName)), count.load(std::memory_order_relaxed), 2 * TASK_COUNT + 1);
+
+	return passed;
+}
+
+static constexpr unsigned PIN_THREAD_COUNT = 3;
+static constexpr unsigned PINNED_TASK_COUNT = 192;
+
+static void RecordThreadTask(void* dataPtr)
+{
+	*reinterpret_cast<std::thread::id*>(dataPtr) = std::this_thread::get_id();
+}
+
+// Tasks pinned to the same optThread all record the same thread
+static unsigned RunPinned(std::thread::id* ranOn)
+{
+	scheduler::TaskHandle tasks[PINNED_TASK_COUNT];
+	unsigned strayTasks = 0;
+
+	for (unsigned taskIndex = 0; taskIndex < PINNED_TASK_COUNT; ++taskIndex)
+	{
+		tasks[taskIndex] = scheduler::task::Create_Stack(RecordThreadTask, ranOn + taskIndex, scheduler::StackSize::TINY);
+		scheduler::task::Run(tasks[taskIndex], taskIndex % PIN_THREAD_COUNT);
+	}
+	for (const scheduler::TaskHandle& task : tasks)
+	{
+		scheduler::task::Wait(task);
+	}
+
+	for (unsigned taskIndex = 0; taskIndex < PINNED_TASK_COUNT; ++taskIndex)
+	{
+		strayTasks += ranOn[taskIndex] == ranOn[taskIndex % PIN_THREAD_COUNT] ? 0 : 1;
+	}
+
+	return strayTasks;
+}
+
+struct PinnedData
+{
+	std::thread::id* ranOn;
+	unsigned* strayTasks;
+};
+
+static void PinFromTask(void* dataPtr)
+{
+	const PinnedData* const data = reinterpret_cast<const PinnedData*>(dataPtr);
+
+	*data->strayTasks = RunPinned(data->ranOn);
+}
+
+// Pinned from the creating thread, and from a task, where work stealing would otherwise keep them local
+static bool RunPinnedTest(scheduler::Options opts)
+{
+	char optsName[128];
+	std::thread::id ranOn[PINNED_TASK_COUNT];
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+	const unsigned strayFromThread = RunPinned(ranOn);
+	unsigned strayFromTask = 0;
+	const PinnedData pinned{ ranOn, &strayFromTask };
+
+	scheduler::task::RunAndWait(scheduler::task::Create(PinFromTask, &pinned, sizeof(pinned), alignof(PinnedData)));
+	scheduler::Destroy(sch);
+
+	const bool passed = strayFromThread == 0 && strayFromTask == 0;
+
+	printf("%s: tasks pinned to %u threads, options: %s, %u strays run from a thread, %u from a task\n", passed ? "PASSED" : "FAILED", PIN_THREAD_COUNT, OptionsName(opts, optsName, sizeof(optsName)), strayFromThread, strayFromTask);
+
+	return passed;
+}
+
+// The owner pushes and pops while thieves steal, past the initial capacity so the deque grows under them. Every item
+// comes out exactly once.
+static bool RunWorkDequeTest()
+{
+	static constexpr unsigned ITEM_COUNT = 64 * 1024;
+	static constexpr unsigned THIEF_COUNT = 3;
+	static std::atomic<unsigned> s_takenCounts[ITEM_COUNT];
+	ws::work_deque<std::atomic<unsigned>*> deque;
+	std::atomic<bool> pushing{ true };
+	std::atomic<unsigned> stolenCount{ 0 };
+	std::thread thieves[THIEF_COUNT];
+	unsigned wrongCounts = 0;
+
+	for (std::atomic<unsigned>& takenCount : s_takenCounts)
+	{
+		takenCount.store(0, std::memory_order_relaxed);
+	}
+
+	for (std::thread& thief : thieves)
+	{
+		thief = std::thread([&deque, &pushing, &stolenCount]()
+		{
+			while (pushing.load(std::memory_order_acquire) || !ws::deque::is_empty(&deque))
+			{
+				if (const std::optional<std::atomic<unsigned>*> stolen = ws::deque::try_steal(&deque))
+				{
+					stolen.value()->fetch_add(1, std::memory_order_relaxed);
+					stolenCount.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		});
+	}
+
+	for (unsigned itemIndex = 0; itemIndex < ITEM_COUNT; ++itemIndex)
+	{
+		ws::deque::push(&deque, s_takenCounts + itemIndex);
+
+		if (itemIndex % 3 == 0)
+		{
+			if (const std::optional<std::atomic<unsigned>*> popped = ws::deque::try_pop(&deque))
+			{
+				popped.value()->fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	}
+	while (const std::optional<std::atomic<unsigned>*> popped = ws::deque::try_pop(&deque))
+	{
+		popped.value()->fetch_add(1, std::memory_order_relaxed);
+	}
+
+	pushing.store(false, std::memory_order_release);
+	for (std::thread& thief : thieves)
+	{
+		thief.join();
+	}
+
+	for (const std::atomic<unsigned>& takenCount : s_takenCounts)
+	{
+		wrongCounts += takenCount.load(std::memory_order_relaxed) == 1 ? 0 : 1;
+	}
+
+	const bool passed = wrongCounts == 0;
+
+	printf("%s: work deque with %u thieves, %u items, %u stolen, %u not taken exactly once\n", passed ? "PASSED" : "FAILED", THIEF_COUNT, ITEM_COUNT, stolenCount.load(std::memory_order_relaxed), wrongCounts);
+
+	return passed;
+}
+
+static bool RunRecreateTest()
+{
+	static constexpr unsigned SCHEDULER_COUNT = 16;
+	static constexpr unsigned TASK_COUNT = 64;
+	unsigned failedSchedulers = 0;
+
+	for (unsigned schedulerIndex = 0; schedulerIndex < SCHEDULER_COUNT; ++schedulerIndex)
+	{
+		const scheduler::Options opts = schedulerIndex & 1 ? scheduler::Options::WORK_STEALING : scheduler::Options::NONE;
+		scheduler::Scheduler* const sch = scheduler::Create(opts);
+		std::atomic<unsigned> count{ 0 };
+
+		{
+			scheduler::TaskHandle tasks[TASK_COUNT];
+
+			for (scheduler::TaskHandle& task : tasks)
+			{
+				task = scheduler::task::Create_Stack(CountTask, &count);
+				scheduler::task::Run(task);
+			}
+			for (const scheduler::TaskHandle& task : tasks)
+			{
+				scheduler::task::Wait(task);
+			}
+		}
+
+		scheduler::Destroy(sch);
+
+		failedSchedulers += count.load(std::memory_order_relaxed) == TASK_COUNT ? 0 : 1;
+	}
+
+	const bool passed = failedSchedulers == 0;
+
+	printf("%s: Destroy and re-Create, %u schedulers of %u tasks, %u miscounted\n\n", passed ? "PASSED" : "FAILED", SCHEDULER_COUNT, TASK_COUNT, failedSchedulers);
+
+	return passed;
+}
+
+#if USING(OS_LINUX)
+static constexpr size_t SYSCALL_BUFFER_SIZE = 8 * 1024;
+
+struct SyscallData
+{
+	int readFd;
+	ssize_t readBytes;
+};
+
+// The task never touches the buffer itself, only the kernel writes to it
+static void ReadIntoStackTask(void* dataPtr)
+{
+	SyscallData* const data = reinterpret_cast<SyscallData*>(dataPtr);
+	uint8_t buffer[SYSCALL_BUFFER_SIZE];
+
+	data->readBytes = read(data->readFd, buffer, sizeof(buffer));
+	data->readBytes = data->readBytes == SYSCALL_BUFFER_SIZE && buffer[0] == 0x5a && buffer[SYSCALL_BUFFER_SIZE - 1] == 0x5a ? data->readBytes : -1;
+}
+
+// Stack growth only sees faults from user code. The call into read has to have grown the stack past the buffer.
+static bool RunSyscallIntoStackTest(scheduler::Options opts)
+{
+	char optsName[128];
+	uint8_t written[SYSCALL_BUFFER_SIZE];
+	int fds[2];
+
+	memset(written, 0x5a, sizeof(written));
+
+	if (pipe(fds) != 0 || write(fds[1], written, sizeof(written)) != static_cast<ssize_t>(sizeof(written)))
+	{
+		printf("FAILED: syscall into a fresh task stack, no pipe\n");
+		return false;
+	}
+
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+	SyscallData data{ fds[0], 0 };
+
+	scheduler::task::RunAndWait(scheduler::task::Create_Stack(ReadIntoStackTask, &data));
+	scheduler::Destroy(sch);
+
+	close(fds[0]);
+	close(fds[1]);
+
+	const bool passed = data.readBytes == SYSCALL_BUFFER_SIZE;
+
+	printf("%s: syscall into a fresh task stack, options: %s, read %zd bytes, expected %zu\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), data.readBytes, SYSCALL_BUFFER_SIZE);
+
+	return passed;
+}
+
+static constexpr size_t OVERFLOW_FRAME_SIZE = 8 * 1024; // Two pages, as if the guard page weren't there
+static constexpr size_t TASK_STACK_SIZE = 1024 * 1024;
+
+// Fills each frame bottom up. Only stack probing keeps the first write from landing past the guard page.
+static size_t OverflowRecurse(size_t depth)
+{
+	volatile uint8_t frame[OVERFLOW_FRAME_SIZE];
+
+	for (size_t byteIndex = 0; byteIndex < OVERFLOW_FRAME_SIZE; ++byteIndex)
+	{
+		frame[byteIndex] = static_cast<uint8_t>(depth | 1);
+	}
+
+	return depth == 0 ? frame[0] : OverflowRecurse(depth - 1) + frame[OVERFLOW_FRAME_SIZE - 1];
+}
+
+static void OverflowTask(void*)
+{
+	OverflowRecurse(TASK_STACK_SIZE / OVERFLOW_FRAME_SIZE + 16);
+}
+
+// A task that runs off the bottom of its stack has to hit the guard, not the stack below it. Arena slots have no
+// guard, so there it's caught once the task finishes. A task waiting on a gate holds the lowest stack, so the
+// overflowing one has a commited neighbour to run into. Forked, as the process dies.
+static bool RunStackOverflowTest(scheduler::Options opts)
+{
+	const bool arena = !!(static_cast<unsigned>(opts) & static_cast<unsigned>(scheduler::Options::STACK_ARENA));
+	const char* const overflowMsg = arena ? "Fiber stack overflowed its arena slot" : "Fiber stack overflow";
+	const int overflowSignal = arena ? SIGABRT : SIGSEGV;
+	char optsName[128];
+	char childOutput[256] = {};
+	int fds[2];
+
+	if (pipe(fds) != 0)
+	{
+		printf("FAILED: stack overflow caught, no pipe\n");
+		return false;
+	}
+
+	const pid_t child = fork();
+
+	if (child == 0)
+	{
+		const struct rlimit noCore{ 0, 0 };
+		std::atomic<unsigned> count{ 0 };
+
+		setrlimit(RLIMIT_CORE, &noCore);
+		dup2(fds[1], STDERR_FILENO);
+
+		scheduler::Create(opts); // Never destroyed, the process dies first
+		const scheduler::TaskHandle gate = scheduler::task::Create_Stack(CountTask, &count);
+
+		// All on one thread, which has its own stacks. The last task only starts once the overflowed stack is back.
+		scheduler::task::Run(scheduler::task::Create([gate]() { scheduler::task::Wait(gate); }), 0);
+		scheduler::task::Run(scheduler::task::Create_Stack(OverflowTask, nullptr), 0);
+		scheduler::task::RunAndWait(scheduler::task::Create_Stack(CountTask, &count), 0);
+		_exit(0);
+	}
+
+	int status = 0;
+
+	close(fds[1]);
+	waitpid(child, &status, 0);
+
+	const ssize_t outputSize = read(fds[0], childOutput, sizeof(childOutput) - 1);
+
+	close(fds[0]);
+
+	const bool sawOverflow = outputSize > 0 && strstr(childOutput, overflowMsg);
+	const bool passed = WIFSIGNALED(status) && WTERMSIG(status) == overflowSignal && sawOverflow;
+
+	printf("%s: stack overflow caught, options: %s, %s, %s\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "ran to the end", sawOverflow ? "reported" : "not reported");
+
+	return passed;
+}
+
+// Two made up nodes, whatever the machine has. Their stacks only move through their own node's exchange.
+static bool RunSimulatedNumaTest(scheduler::Options opts)
+{
+	static constexpr unsigned FIB_N = 15;
+	static constexpr unsigned TASK_COUNT = 512;
+	char optsName[128];
+	std::atomic<unsigned> count{ 0 };
+
+	setenv("SCHEDULER_NUMA_NODES", "2", 1);
+
+	scheduler::Scheduler* const sch = scheduler::Create(opts);
+
+	unsetenv("SCHEDULER_NUMA_NODES");
+
+	const unsigned sum = RunFib(FIB_N);
+
+	{
+		scheduler::TaskHandle tasks[TASK_COUNT];
+
+		for (scheduler::TaskHandle& task : tasks)
+		{
+			task = scheduler::task::Create_Stack(CountTask, &count, scheduler::StackSize::TINY);
+			scheduler::task::Run(task);
+		}
+		for (const scheduler::TaskHandle& task : tasks)
+		{
+			scheduler::task::Wait(task);
+		}
+	}
+
+	scheduler::Destroy(sch);
+
+	const bool passed = sum == Fib(FIB_N) && count.load(std::memory_order_relaxed) == TASK_COUNT;
+
+	printf("%s: 2 simulated numa nodes, options: %s, fib sum %u, expected %u, %u of %u tasks ran\n", passed ? "PASSED" : "FAILED", OptionsName(opts, optsName, sizeof(optsName)), sum, Fib(FIB_N), count.load(std::memory_order_relaxed), TASK_COUNT);
+
+	return passed;
+}
+#endif //#if USING(OS_LINUX)
+
+int main()
+{
+	bool passed = true;
+
+	setvbuf(stdout, nullptr, _IONBF, 0); // A hang shows where it stopped
+
+	for (unsigned optionBits = 0; optionBits < (1u << OPTION_COUNT); ++optionBits)
+	{
+		// STACK_ARENA is ignored off linux
+		passed &= RunFibTest(static_cast<scheduler::Options>(optionBits));
+	}
+	printf("\n");
+
+	passed &= RunRepeatedForkJoinTest(scheduler::Options::NONE);
+	passed &= RunRepeatedForkJoinTest(scheduler::Options::WORK_STEALING);
+	passed &= RunRepeatedForkJoinTest(scheduler::Options::STACK_ARENA);
+	printf("\n");
+
+	passed &= RunStackProfileTest(scheduler::Options::PROFILE_STACKS);
+	passed &= RunStackProfileTest(scheduler::Options::PROFILE_STACKS | scheduler::Options::STACK_ARENA);
+	passed &= RunStackRecycleTest(scheduler::Options::NONE);
+	passed &= RunStackRecycleTest(scheduler::Options::PROFILE_STACKS);
+	passed &= RunStackRecycleTest(scheduler::Options::STACK_ARENA);
+	passed &= RunStackRecycleTest(scheduler::Options::PROFILE_STACKS | scheduler::Options::STACK_ARENA);
+	passed &= RunLearnedStackDepthTest(scheduler::Options::NONE);
+	passed &= RunLearnedStackDepthTest(scheduler::Options::PROFILE_STACKS);
+	passed &= RunConcurrentStackProfileTest(scheduler::Options::PROFILE_STACKS);
+	passed &= RunConcurrentStackProfileTest(scheduler::Options::PROFILE_STACKS | scheduler::Options::WORK_STEALING);
+	printf("\n");
+
+	passed &= RunDeepStackTest(scheduler::Options::NONE);
+	passed &= RunDeepStackTest(scheduler::Options::STACK_ARENA);
+	passed &= RunDeepStackTest(scheduler::Options::PROFILE_STACKS);
+	printf("\n");
+
+	passed &= RunUnparkedTrimTest(scheduler::Options::NONE);
+	passed &= RunUnparkedTrimTest(scheduler::Options::STACK_ARENA);
+	passed &= RunStackTrimTest(scheduler::Options::NONE);
+	passed &= RunStackTrimTest(scheduler::Options::STACK_ARENA);
+	passed &= RunStackTrimTest(scheduler::Options::PROFILE_STACKS);
+	passed &= RunStackTrimTest(scheduler::Options::PROFILE_STACKS | scheduler::Options::STACK_ARENA);
+	printf("\n");
+
+	passed &= RunStackExchangeTest(scheduler::Options::NONE);
+	passed &= RunStackExchangeTest(scheduler::Options::WORK_STEALING);
+	passed &= RunPayloadTest();
+	passed &= RunWorkDequeTest();
+	passed &= RunFunctorTest();
+	passed &= RunRecreateTest();
+	passed &= RunForeignThreadTest(scheduler::Options::NONE);
+	passed &= RunForeignThreadTest(scheduler::Options::WORK_STEALING);
+	passed &= RunRemoteFreeTest(scheduler::Options::NONE);
+	passed &= RunRemoteFreeTest(scheduler::Options::WORK_STEALING);
+	passed &= RunStaleHandleTest(scheduler::Options::NONE);
+	passed &= RunStaleHandleTest(scheduler::Options::WORK_STEALING);
+	passed &= RunPinnedTest(scheduler::Options::NONE);
+	passed &= RunPinnedTest(scheduler::Options::WORK_STEALING);
+
+#if USING(OS_LINUX)
+	passed &= RunSyscallIntoStackTest(scheduler::Options::NONE);
+	passed &= RunSyscallIntoStackTest(scheduler::Options::PROFILE_STACKS);
+	passed &= RunStackOverflowTest(scheduler::Options::NONE);
+	passed &= RunStackOverflowTest(scheduler::Options::STACK_ARENA);
+	printf("\n");
+
+	passed &= RunSimulatedNumaTest(scheduler::Options::NONE);
+	passed &= RunSimulatedNumaTest(scheduler::Options::WORK_STEALING);
+	printf("\n");
+#endif //#if USING(OS_LINUX)
+
+	return passed ? 0 : 1;
+}
@@ -3,7 +3,7 @@
 #include "usings.h"
 
 #define OS_WINDOWS USE_IF(_WIN32)
-#define OS_LINUX   USE_IF(false && __gnu_linux__)
+#define OS_LINUX   USE_IF(__gnu_linux__)
 
 #if !USING(OS_WINDOWS) && !USING(OS_LINUX)
 # error Unsupported operating sytem. Only windows and linux are currently supported.
@@ -1,3 +1,7 @@
 #pragma once
 
-#define sanity(X) do{ if(!(X)) __debugbreak(); }while(0)
+#ifdef _MSC_VER
+# define sanity(X) do{ if(!(X)) __debugbreak(); }while(0)
+#else //#ifdef _MSC_VER
+# define sanity(X) do{ if(!(X)) __builtin_trap(); }while(0)
+#endif //#else //#ifdef _MSC_VER